@@ -8,6 +8,19 @@
 #include "shared.h"
 #include "firstpass.h"
 #include "secondpass.h"
+#include "output.h"
+#include "dynstr.h"
+#include "batch.h"
+#include "jobserver.h"
+#include "job.h"
+#include "manifest.h"
+#include "server.h"
+#include "watch.h"
+#include "cache.h"
+#include "maclib.h"
+#include "filecache.h"
+#include "diag.h"
+#include "util.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -18,96 +31,446 @@
  */
 void print_usage()
 {
-    puts("usage: assembler <basename> [...basename]");
+    puts("usage: assembler [-j jobs | -p] [-t threads] [-P | --window KiB] [--cache dir]");
+    puts("                 [--incremental [--verify]] [--check] [--max-errors n] [--fail-fast]");
+    puts("                 [--diagnostics format] [--memo] [--macros library] [--summary]");
+    puts("                 [--stats] <basename> [...basename]");
+    puts("       assembler [-j jobs | -p] [-t threads] [-P | --window KiB] [--cache dir]");
+    puts("                 [--incremental [--verify]] [--check] [--max-errors n] [--fail-fast]");
+    puts("                 [--diagnostics format] [--memo] [--macros library] [--stats]");
+    puts("                 [-0] --manifest <file>");
+    puts("       assembler [--check] [--diagnostics format] [--memo] [--macros library] [-s] -");
+    puts("       assembler [-j workers] [-t threads] [-P | --window KiB] [--memo] [--macros library]");
+    puts("                 --serve <socket>");
+    puts("       assembler --compile-macros <file> <library>");
     puts("example: assembler file1 file2 file3");
+    puts("options:");
+    puts("  -j jobs  assemble up to <jobs> files concurrently, within make's");
+    puts("           jobserver limit when run from a parallel make, as are the");
+    puts("           threads of -p, -t and -P");
+    puts("  -p       pipeline: read, encode and write consecutive files concurrently");
+    puts("  -t threads");
+    puts("           split the work on each large file across up to <threads> threads");
+    puts("  -P       preprocess each file on its own thread, feeding the first pass");
+    puts("           as macros are expanded");
+    puts("  --window KiB");
+    puts("           like -P, and read each source through a window of <KiB> kibibytes");
+    puts("           rather than in whole, so memory use doesn't grow with its size");
+    puts("  --manifest file");
+    puts("           read the basenames from <file>, one per line, or from stdin if");
+    puts("           <file> is -; implies --summary");
+    puts("  -0       basenames in the manifest are separated by NUL characters");
+    puts("  --watch  assemble the files, then reassemble each one whenever its");
+    puts("           source changes, until interrupted; -j and -p don't apply");
+    puts("  --summary");
+    puts("           print the number of files assembled, failed and skipped, and");
+    puts("           timings, once the batch is done");
+    puts("  --cache dir");
+    puts("           keep the outcome of each file in <dir>, keyed by the contents of");
+    puts("           its source, and restore it instead of assembling the file again");
+    puts("  --incremental");
+    puts("           keep a record of each line next to the outputs, and only process");
+    puts("           the lines that changed when the file is assembled again");
+    puts("  --verify also assemble each file from scratch and fail it if the outputs");
+    puts("           differ from the incremental ones");
+    puts("  --check  run every pass to report errors, but write no output files");
+    puts("  --max-errors n");
+    puts("           stop assembling a file once <n> errors were reported");
+    puts("  --fail-fast");
+    puts("           stop each file at its first error unless --max-errors is given,");
+    puts("           and assemble no further files once one failed");
+    puts("  --diagnostics format");
+    puts("           print the messages of each file as text, the default, or as json,");
+    puts("           one object per line");
+    puts("  --stats  print the time each phase of each file took, what it made and");
+    puts("           the throughput, then the same summed over the batch");
+    puts("  --memo   parse each distinct line of a file once, replaying what it made");
+    puts("           of it where the line recurs, and print the hit rate");
+    puts("  --macros library");
+    puts("           expand the macros of <library>, made by --compile-macros, in");
+    puts("           every file that doesn't define its own by the same name");
+    puts("  --compile-macros file library");
+    puts("           compile the macros defined in <file> into <library>");
+    puts("  --serve socket");
+    puts("           serve assembly requests on the Unix domain socket <socket>");
+    puts("           until interrupted, -j of them concurrently");
+    puts("  -        read source from stdin and write a framed object to stdout");
+    puts("  -s       with -, also write the entries and externals sections");
 }
 
 /**
- * Assembles a file.
+ * Assembles source read from standard input and writes the output files to
+ * standard output as one framed stream. Diagnostics go to standard error.
  *
- * @param basename Path to the source file to process without extension.
+ * @param with_symbols Also write the entries and externals sections.
+ * @param options Options.
  * @return Zero on success, non-zero on failure.
  */
-static int assemble(const char *basename)
+static int assemble_stream(int with_symbols, const job_options_t *options)
 {
-    char as_filename[FILENAME_MAX],  /* Source assembly file path (.as). */
-         am_filename[FILENAME_MAX],  /* Macro expanded file path (.am). */
-         ob_filename[FILENAME_MAX],  /* Object file path (.ob). */
-         ent_filename[FILENAME_MAX], /* Entry points file path (.ent). */
-         ext_filename[FILENAME_MAX]; /* Externals file path (.ext). */
-    shared_t *shared; /* Shared assembly state. */
-
-    /* Check if filename is too long so we don't overflow the filename
-       arrays. */
-    if ((strlen(basename) + 3) > FILENAME_MAX) {
-        printf("assemble: basename %s too long.\n", basename);
-        return 1;
+    dynstr_t *source = dynstr_alloc(4096); /* Source text. */
+    dynstr_t *expanded = dynstr_alloc(4096); /* Macro expanded source text. */
+    shared_t *shared = shared_alloc(); /* Shared assembly state. */
+    diagbuf_t *diags = diagbuf_alloc("-"); /* Diagnostics. */
+    int error = 1; /* Return value. */
+
+    if (!source || !expanded || !shared || !diags) {
+        fprintf(stderr, "error: out of memory.\n");
+        goto done;
     }
 
-    /* Set input filename to basename with .as extension. */
-    strcpy(as_filename, basename);
-    strcat(as_filename, ".as");
+    /* Collect diagnostics for standard error, to keep the stream clean. */
+    shared->diag = diagbuf_append;
+    shared->diag_ctx = diags;
+    job_configure(shared, options, 0);
 
-    /* Set output filename to base with .am extension. */
-    strcpy(am_filename, basename);
-    strcat(am_filename, ".am");
+    /* Read the entire source; standard input need not be seekable. */
+    if (dynstr_append_stream(source, stdin) != 0) {
+        diagbuf_add(diags, DIAG_ERROR, 0, 0, 0, "could not read source from standard input.");
+        goto done;
+    }
 
-    /* Preprocess. */
-    if (preprocess(as_filename, am_filename)) {
-        printf("error: could not preprocess source file.\n");
-        return 1;
+    /* Assemble. */
+    if (preprocess(dynstr_pointer(source), expanded, shared)) {
+        diagbuf_add(diags, DIAG_ERROR, 0, 0, 0, "could not preprocess source file.");
+        goto done;
+    }
+    if (firstpass(dynstr_pointer(expanded), shared)) {
+        diagbuf_add(diags, DIAG_FATAL, 0, 0, 0, "first pass failed.");
+        goto done;
+    }
+    if (secondpass(shared)) {
+        diagbuf_add(diags, DIAG_FATAL, 0, 0, 0, "second pass failed.");
+        goto done;
     }
 
-    /* Allocate shared assembly state. We don't keep this on the stack because
-       the memory segments are quite large. */
-    shared = shared_alloc();
+    /* Write the sections, unless only checking. */
+    if (options->check)
+        error = 0;
+    else if ((error = write_sections(stdout, shared, with_symbols) || fflush(stdout) != 0) != 0)
+        diagbuf_add(diags, DIAG_ERROR, 0, 0, 0, "could not write output.");
 
-    /* Run first pass. */
-    if (firstpass(am_filename, shared)) {
-        printf("fatal error: first pass failed.\n");
-        shared_free(shared);
-        return 1;
+done:
+    if (diags) {
+        diagbuf_write(diags, options->diag_format, stderr);
+        diagbuf_free(diags);
     }
+    if (shared)
+        shared_free(shared);
+    if (expanded)
+        dynstr_free(expanded);
+    if (source)
+        dynstr_free(source);
 
-    /* Set object file path by appending .ob extension. */
-    strcpy(ob_filename, basename);
-    strcat(ob_filename, ".ob");
+    return error;
+}
 
-    /* Set entry points file path by appending .ent. */
-    strcpy(ent_filename, basename);
-    strcat(ent_filename, ".ent");
+/**
+ * Compiles the macros defined in a file into a macro library.
+ *
+ * @param source_path Path of the file.
+ * @param lib_path Path of the library to write.
+ * @return Zero on success, non-zero on failure.
+ */
+static int compile_macros(const char *source_path, const char *lib_path)
+{
+    dynstr_t *source = dynstr_alloc(4096); /* Source text. */
+    diaglist_t *diags = diaglist_alloc(); /* Errors in the definitions. */
+    FILE *fp; /* Source file. */
+    int error = 1; /* Return value. */
 
-    /* Set externals file path by appending .ext. */
-    strcpy(ext_filename, basename);
-    strcat(ext_filename, ".ext");
+    if (!source || !diags) {
+        printf("error: out of memory.\n");
+        goto done;
+    }
 
-    /* Run second pass. */
-    if (secondpass(am_filename, ob_filename, ent_filename, ext_filename, shared)) {
-        printf("fatal error: second pass failed.\n");
-        shared_free(shared);
-        return 1;
+    /* Read the file. */
+    if ((fp = fopen(source_path, "r")) == 0) {
+        printf("error: could not open %s.\n", source_path);
+        goto done;
     }
+    error = dynstr_append_stream(source, fp) != 0;
+    fclose(fp);
+    if (error) {
+        printf("error: could not read %s.\n", source_path);
+        goto done;
+    }
+
+    /* Compile. */
+    error = maclib_compile(dynstr_pointer(source), lib_path, diags);
+    diaglist_flush(diags, diag_print, stdout);
+    if (error)
+        printf("error: could not compile macro library %s.\n", lib_path);
 
-    /* Free shared assembly state. */
-    shared_free(shared);
+done:
+    if (diags)
+        diaglist_free(diags);
+    if (source)
+        dynstr_free(source);
 
-    return 0;
+    return error;
 }
 
 int main(int argc, char *argv[])
 {
-    int error = 0; /* Did some file fail to process? */
+    int error = 1; /* Did some file fail to process? */
+    int jobs = 1; /* Number of files to assemble concurrently. */
+    jobserver_t *js; /* Connection to make's jobserver. */
+    int pipelined = 0; /* Overlap the stages of consecutive files? */
+    int with_symbols = 0; /* Write symbol sections in stream mode? */
+    const char *manifest_path = 0; /* Manifest file, if given. */
+    const char *socket_path = 0; /* Socket to serve requests on, if given. */
+    char delim = '\n'; /* Separator of basenames in the manifest. */
+    int summarize = 0; /* Print a summary of the batch? */
+    int watching = 0; /* Reassemble files as they change? */
+    manifest_t *basenames = 0; /* Basenames to assemble. */
+    batch_summary_t summary; /* Outcome of the batch. */
+    double started; /* Time at which the batch started. */
+    job_options_t options; /* Options applying to every file. */
+    const char *macros_path = 0; /* Macro library, if given. */
+    maclib_t *macros = 0; /* Loaded macro library. */
+    int kib; /* Size of the source window in KiB. */
+    int i; /* Index of current argument. */
+
+    /* Default options. */
+    options.threads = 1;
+    options.streamed = 0;
+    options.stream_inline = 0;
+    options.cache_dir = 0;
+    options.incremental = 0;
+    options.verify = 0;
+    options.memo = 0;
+    options.window = 0;
+    options.check = 0;
+    options.max_errors = 0;
+    options.fail_fast = 0;
+    options.diag_format = DIAG_FORMAT_TEXT;
+    options.stats = 0;
+    options.macros = 0;
+    options.includes = 0;
+
+    /* Parse options. A lone hyphen is not an option but the stream
+       basename. */
+    for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; ++i) {
+        if (strcmp(argv[i], "-j") == 0) {
+            if (i + 1 >= argc || (jobs = atoi(argv[i + 1])) < 1 || jobs > MAX_JOBS) {
+                printf("error: -j expects a number of jobs between 1 and %d.\n", MAX_JOBS);
+                return 1;
+            }
+            ++i;
+        } else if (strcmp(argv[i], "-t") == 0) {
+            if (i + 1 >= argc || (options.threads = atoi(argv[i + 1])) < 1 || options.threads > MAX_THREADS) {
+                printf("error: -t expects a number of threads between 1 and %d.\n", MAX_THREADS);
+                return 1;
+            }
+            ++i;
+        } else if (strcmp(argv[i], "-P") == 0) {
+            options.streamed = 1;
+        } else if (strcmp(argv[i], "--window") == 0) {
+            if (i + 1 >= argc || (kib = atoi(argv[i + 1])) < 1 || kib > MAX_WINDOW_KIB) {
+                printf("error: --window expects a number of KiB between 1 and %d.\n", MAX_WINDOW_KIB);
+                return 1;
+            }
+            options.window = (size_t)kib * 1024;
+            options.streamed = 1;
+            ++i;
+        } else if (strcmp(argv[i], "-p") == 0) {
+            pipelined = 1;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            with_symbols = 1;
+        } else if (strcmp(argv[i], "--manifest") == 0) {
+            if (i + 1 >= argc) {
+                printf("error: --manifest expects a file.\n");
+                return 1;
+            }
+            manifest_path = argv[++i];
+            summarize = 1;
+        } else if (strcmp(argv[i], "--serve") == 0) {
+            if (i + 1 >= argc) {
+                printf("error: --serve expects a socket path.\n");
+                return 1;
+            }
+            socket_path = argv[++i];
+        } else if (strcmp(argv[i], "--cache") == 0) {
+            if (i + 1 >= argc) {
+                printf("error: --cache expects a directory.\n");
+                return 1;
+            }
+            options.cache_dir = argv[++i];
+        } else if (strcmp(argv[i], "--incremental") == 0) {
+            options.incremental = 1;
+        } else if (strcmp(argv[i], "--verify") == 0) {
+            options.verify = 1;
+        } else if (strcmp(argv[i], "--check") == 0) {
+            options.check = 1;
+        } else if (strcmp(argv[i], "--max-errors") == 0) {
+            if (i + 1 >= argc || (options.max_errors = atoi(argv[i + 1])) < 1) {
+                printf("error: --max-errors expects a positive number of errors.\n");
+                return 1;
+            }
+            ++i;
+        } else if (strcmp(argv[i], "--diagnostics") == 0) {
+            if (i + 1 < argc && strcmp(argv[i + 1], "text") == 0) {
+                options.diag_format = DIAG_FORMAT_TEXT;
+            } else if (i + 1 < argc && strcmp(argv[i + 1], "json") == 0) {
+                options.diag_format = DIAG_FORMAT_JSON;
+            } else {
+                printf("error: --diagnostics expects text or json.\n");
+                return 1;
+            }
+            ++i;
+        } else if (strcmp(argv[i], "--fail-fast") == 0) {
+            options.fail_fast = 1;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            options.stats = 1;
+        } else if (strcmp(argv[i], "--memo") == 0) {
+            options.memo = 1;
+        } else if (strcmp(argv[i], "--macros") == 0) {
+            if (i + 1 >= argc) {
+                printf("error: --macros expects a macro library.\n");
+                return 1;
+            }
+            macros_path = argv[++i];
+        } else if (strcmp(argv[i], "--compile-macros") == 0) {
+            if (i + 2 >= argc) {
+                printf("error: --compile-macros expects a source file and a library.\n");
+                return 1;
+            }
+            return compile_macros(argv[i + 1], argv[i + 2]);
+        } else if (strcmp(argv[i], "--watch") == 0) {
+            watching = 1;
+        } else if (strcmp(argv[i], "-0") == 0) {
+            delim = '\0';
+        } else if (strcmp(argv[i], "--summary") == 0) {
+            summarize = 1;
+        } else {
+            printf("error: unknown option %s.\n", argv[i]);
+            print_usage();
+            return 1;
+        }
+    }
 
-    /* Too few arguments, print correct usage. */
-    if (argc < 2) {
-        print_usage();
+    /* Failing fast stops each file at its first error too. */
+    if (options.fail_fast && !options.max_errors)
+        options.max_errors = 1;
+
+    /* The build cache and the line records both need the whole source. */
+    if (options.window && (options.cache_dir || options.incremental)) {
+        printf("error: --window can't be combined with --cache or --incremental.\n");
+        return 1;
+    }
+
+    /* Both of them write files when checking should write none. */
+    if (options.check && (options.cache_dir || options.incremental)) {
+        printf("error: --check can't be combined with --cache or --incremental.\n");
+        return 1;
+    }
+
+    if (options.cache_dir && cache_open(options.cache_dir) != 0) {
+        printf("error: could not create cache directory %s.\n", options.cache_dir);
         return 1;
     }
 
-    /* Assemble all assembly files with basenames given in the argument
-       list. */
-    while (*++argv)
-        error |= assemble(*argv);
+    /* Map the macro library once; every file and thread shares it. */
+    if (macros_path) {
+        if ((macros = maclib_open(macros_path)) == 0) {
+            printf("error: could not load macro library %s.\n", macros_path);
+            return 1;
+        }
+        options.macros = macros;
+    }
+
+    /* Included files are preprocessed once for all files. */
+    if ((options.includes = preprocess_cache_alloc()) == 0) {
+        printf("error: out of memory.\n");
+        goto done;
+    }
+
+    if (socket_path) {
+        /* The server takes its files from requests only. */
+        if (i < argc || manifest_path) {
+            printf("error: --serve takes no basenames.\n");
+            goto done;
+        }
+        error = server_run(socket_path, &options, jobs);
+        goto done;
+    }
+
+    if (manifest_path) {
+        /* Basenames come from the manifest only. */
+        if (i < argc) {
+            printf("error: basenames can't be given along with --manifest.\n");
+            goto done;
+        }
+        if ((basenames = manifest_open(manifest_path, delim)) == 0) {
+            printf("error: could not open manifest %s.\n", manifest_path);
+            goto done;
+        }
+    } else {
+        /* Too few arguments, print correct usage. */
+        if (i >= argc) {
+            print_usage();
+            goto done;
+        }
+
+        /* Check for stream mode. */
+        if (strcmp(argv[i], "-") == 0 && !watching) {
+            if (i + 1 < argc) {
+                printf("error: - must be the only basename.\n");
+                goto done;
+            }
+            error = assemble_stream(with_symbols, &options);
+            goto done;
+        }
+
+        /* Assemble all assembly files with basenames given in the argument
+           list. */
+        if ((basenames = manifest_from_list(argv + i, argc - i)) == 0) {
+            printf("error: out of memory.\n");
+            goto done;
+        }
+    }
+
+    if (watching) {
+        error = watch_run(basenames, &options);
+        goto done;
+    }
+
+    memset(&summary, 0, sizeof(summary));
+    started = monotonic_seconds();
+
+    /* Share the CPU budget of a parallel make, if we run under one and may
+       run more than one thread. */
+    js = jobs > 1 || pipelined || options.threads > 1 || options.streamed ? jobserver_open() : 0;
+
+    if (jobs > 1)
+        error = batch_parallel(basenames, &options, &summary, jobs, js);
+    else if (pipelined)
+        error = batch_pipeline(basenames, &options, &summary, js);
+    else
+        error = batch_serial(basenames, &options, &summary, js);
+
+    if (js)
+        jobserver_close(js);
+
+    if (summarize)
+        batch_summary_print(&summary, monotonic_seconds() - started);
+    if (options.cache_dir)
+        batch_cache_print(&summary);
+    if (options.incremental)
+        batch_lines_print(&summary);
+    if (options.memo)
+        batch_memo_print(&summary);
+    if (options.stats)
+        batch_stats_print(&summary, monotonic_seconds() - started, options.diag_format);
+
+done:
+    if (basenames)
+        manifest_close(basenames);
+    if (options.includes)
+        filecache_free(options.includes);
+    if (macros)
+        maclib_close(macros);
 
     return error;
 }
@@ -0,0 +1,546 @@
+/**
+ * @file batch.c
+ * @author Tamir Attias
+ * @brief Batch assembly driver implementation.
+ */
+
+#include "batch.h"
+#include "constants.h"
+#include "job.h"
+#include "queue.h"
+#include "jobserver.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+/**
+ * Files to assemble, shared between the workers of a parallel batch.
+ */
+typedef struct {
+    /** Basenames of the files to assemble. */
+    manifest_t *basenames;
+    /** Options applying to every file. */
+    const job_options_t *options;
+    /** Non-zero once all basenames were claimed. */
+    int exhausted;
+    /** Did some file fail to process? */
+    int error;
+    /** Outcome of the batch. */
+    batch_summary_t *summary;
+    /** Guards basenames, exhausted, error and summary. */
+    pthread_mutex_t lock;
+    /** Jobserver limiting the number of busy workers, may be null. */
+    jobserver_t *js;
+} batch_t;
+
+/**
+ * Worker of a parallel batch.
+ */
+typedef struct {
+    /** Batch the worker belongs to. */
+    batch_t *batch;
+    /** Non-zero if the worker runs on the process's implicit jobserver
+        token and need not acquire one. */
+    int implicit_token;
+} worker_t;
+
+/**
+ * Queues connecting the stages of a pipelined batch.
+ */
+typedef struct {
+    /** Loaded jobs waiting to be encoded. */
+    queue_t *loaded;
+    /** Encoded jobs waiting to be written. */
+    queue_t *encoded;
+    /** Did some file fail to process? Only accessed by the write stage. */
+    int error;
+    /** Non-zero once a file failed and the batch fails fast, so no further
+        files are loaded. */
+    int halted;
+    /** Guards halted. */
+    pthread_mutex_t lock;
+    /** Outcome of the batch, written by the write stage, and by the load
+        stage once the write stage has finished. */
+    batch_summary_t *summary;
+} pipeline_t;
+
+/**
+ * Adds the outcome of a file to the summary of a batch.
+ *
+ * @param summary Summary.
+ * @param basename Basename of the file.
+ * @param error Non-zero if the file failed to assemble.
+ * @param skipped Non-zero if the file's source could not be read.
+ * @param seconds Time taken by the file.
+ */
+static void record_file(batch_summary_t *summary, const char *basename,
+                        int error, int skipped, double seconds)
+{
+    ++summary->processed;
+    summary->failed += error != 0;
+    summary->skipped += skipped != 0;
+    summary->file_seconds += seconds;
+
+    /* Keep track of the slowest file. */
+    if (summary->processed == 1 || seconds > summary->slowest_seconds) {
+        summary->slowest_seconds = seconds;
+        strcpy(summary->slowest, basename);
+    }
+}
+
+/**
+ * Records the outcome of a job that ran all of its stages.
+ *
+ * @param summary Summary.
+ * @param job Job.
+ * @param error Result of the job.
+ */
+static void record_job(batch_summary_t *summary, const job_t *job, int error)
+{
+    record_file(summary, job->basename, error, job->skipped,
+                monotonic_seconds() - job->started);
+
+    summary->lines_reused += job->lines_reused;
+    summary->lines_total += job->lines_total;
+    summary->memo_lines += job->memo_lines;
+    summary->memo_hits += job->memo_hits;
+    stats_add(&summary->stats, &job->stats);
+
+    /* Files that couldn't be read were never looked up. */
+    if (job->options.cache_dir && !job->skipped) {
+        if (job->hit) {
+            ++summary->cache_hits;
+            summary->cache_saved += job->saved;
+        } else {
+            ++summary->cache_misses;
+        }
+    }
+}
+
+/**
+ * Takes as many jobserver tokens as are free right away, up to a number.
+ *
+ * @param js Jobserver connection.
+ * @param count Maximum number of tokens to take.
+ * @param tokens Buffer of count characters receiving the tokens.
+ * @return Number of tokens taken.
+ */
+static int take_tokens(jobserver_t *js, int count, char *tokens)
+{
+    int taken = 0; /* Return value. */
+
+    while (taken < count && jobserver_acquire(js, 0, &tokens[taken]) == 0)
+        ++taken;
+
+    return taken;
+}
+
+/**
+ * Returns jobserver tokens.
+ *
+ * @param js Jobserver connection.
+ * @param count Number of tokens.
+ * @param tokens Tokens received from take_tokens.
+ */
+static void return_tokens(jobserver_t *js, int count, const char *tokens)
+{
+    int i; /* Counter. */
+
+    for (i = 0; i < count; ++i)
+        jobserver_release(js, tokens[i]);
+}
+
+/**
+ * Assembles a single file, reporting failure to allocate the job.
+ *
+ * @param basename Basename of the file.
+ * @param options Options.
+ * @param summary Summary receiving the outcome.
+ * @param lock If not null, held while updating the summary.
+ * @param js If not null, every thread the file runs beyond the calling one
+ *           must hold a token from this jobserver.
+ * @return Zero on success, non-zero on failure.
+ */
+static int assemble(const char *basename, const job_options_t *options,
+                    batch_summary_t *summary, pthread_mutex_t *lock, jobserver_t *js)
+{
+    job_options_t limited; /* Options within the tokens taken. */
+    char tokens[MAX_THREADS]; /* Tokens taken for the file's threads. */
+    int held = 0; /* Number of tokens taken. */
+    int wanted; /* Number of threads the file runs at most. */
+    job_t *job; /* Job for the file. */
+    int error; /* Return value. */
+
+    /* The file makes do with the tokens that are free as it starts rather
+       than wait for more. A streamed file's preprocessor thread is done by
+       the time the second pass splits its work, so one token covers it. */
+    if (js) {
+        wanted = options->streamed && options->threads < 2 ? 2 : options->threads;
+        held = take_tokens(js, wanted - 1, tokens);
+        limited = *options;
+        if (limited.threads > held + 1)
+            limited.threads = held + 1;
+        limited.stream_inline |= held == 0;
+        options = &limited;
+    }
+
+    if ((job = job_alloc(basename, options)) == 0) {
+        printf("error: out of memory assembling %s.\n", basename);
+        error = 1;
+    } else {
+        error = job_run(job);
+    }
+
+    /* Record the outcome. */
+    if (lock)
+        pthread_mutex_lock(lock);
+    if (job)
+        record_job(summary, job, error);
+    else
+        record_file(summary, basename, error, 0, 0);
+    if (lock)
+        pthread_mutex_unlock(lock);
+
+    if (job)
+        job_free(job);
+    if (js)
+        return_tokens(js, held, tokens);
+
+    return error;
+}
+
+void batch_summary_print(const batch_summary_t *summary, double seconds)
+{
+    printf("batch: %d processed, %d assembled, %d failed, %d skipped in %.3f s",
+           summary->processed, summary->processed - summary->failed,
+           summary->failed - summary->skipped, summary->skipped, seconds);
+    if (seconds > 0)
+        printf(" (%.1f files/s)", summary->processed / seconds);
+    printf(".\n");
+
+    if (summary->processed > 0) {
+        printf("batch: %.3f s per file on average, slowest %s in %.3f s.\n",
+               summary->file_seconds / summary->processed,
+               summary->slowest, summary->slowest_seconds);
+    }
+}
+
+void batch_cache_print(const batch_summary_t *summary)
+{
+    printf("cache: %d hits, %d misses, %.3f s saved.\n",
+           summary->cache_hits, summary->cache_misses, summary->cache_saved);
+}
+
+void batch_lines_print(const batch_summary_t *summary)
+{
+    printf("incremental: %ld of %ld lines replayed.\n", summary->lines_reused, summary->lines_total);
+}
+
+void batch_memo_print(const batch_summary_t *summary)
+{
+    printf("memo: %ld of %ld lines replayed", summary->memo_hits, summary->memo_lines);
+    if (summary->memo_lines > 0)
+        printf(" (%.1f%% hit rate)", 100.0 * summary->memo_hits / summary->memo_lines);
+    printf(".\n");
+}
+
+void batch_stats_print(const batch_summary_t *summary, double seconds, diag_format_t format)
+{
+    if (format == DIAG_FORMAT_JSON) {
+        stats_write_json(stdout, 0, &summary->stats, seconds);
+        printf("\n");
+    } else {
+        stats_print(stdout, "stats: total: ", &summary->stats, seconds);
+    }
+}
+
+int batch_serial(manifest_t *basenames, const job_options_t *options,
+                 batch_summary_t *summary, jobserver_t *js)
+{
+    char basename[MANIFEST_NAME_SIZE]; /* Basename of current file. */
+    int error = 0; /* Did some file fail to process? */
+
+    while (!(error && options->fail_fast) && manifest_next(basenames, basename))
+        error |= assemble(basename, options, summary, 0, js);
+
+    return error;
+}
+
+/**
+ * Checks if a parallel batch has files left to claim.
+ *
+ * @param batch Batch.
+ * @return Non-zero if files may remain.
+ */
+static int files_remain(batch_t *batch)
+{
+    int remain; /* Return value. */
+
+    pthread_mutex_lock(&batch->lock);
+    remain = !batch->exhausted;
+    pthread_mutex_unlock(&batch->lock);
+
+    return remain;
+}
+
+/**
+ * Worker thread of a parallel batch. Assembles files until none remain.
+ *
+ * @param arg Pointer to the worker.
+ * @return Null pointer.
+ */
+static void *batch_worker(void *arg)
+{
+    worker_t *worker = (worker_t*)arg;
+    batch_t *batch = worker->batch;
+    char basename[MANIFEST_NAME_SIZE]; /* Basename to assemble. */
+    int claimed; /* Was a basename claimed? */
+    int error; /* Result of assembly. */
+    char token; /* Jobserver token held by the worker. */
+    int result; /* Result of acquiring a token. */
+
+    /* Additional workers must hold a jobserver token. Keep checking for
+       remaining work while waiting so we don't hang once the other
+       workers have finished the batch. */
+    if (batch->js && !worker->implicit_token) {
+        while ((result = jobserver_acquire(batch->js, JOBSERVER_POLL_MS, &token)) > 0) {
+            if (!files_remain(batch))
+                return 0;
+        }
+
+        /* Leave the work to the other workers if the jobserver broke. */
+        if (result < 0)
+            return 0;
+    }
+
+    for (;;) {
+        /* Claim the next file, unless failing fast after a failure. */
+        pthread_mutex_lock(&batch->lock);
+        claimed = !batch->exhausted && !(batch->error && batch->options->fail_fast) &&
+                  manifest_next(batch->basenames, basename);
+        batch->exhausted = !claimed;
+        pthread_mutex_unlock(&batch->lock);
+
+        /* Check if no files remain. */
+        if (!claimed)
+            break;
+
+        error = assemble(basename, batch->options, batch->summary, &batch->lock, batch->js);
+
+        /* Record failure. */
+        pthread_mutex_lock(&batch->lock);
+        batch->error |= error;
+        pthread_mutex_unlock(&batch->lock);
+    }
+
+    /* Return the token. */
+    if (batch->js && !worker->implicit_token)
+        jobserver_release(batch->js, token);
+
+    return 0;
+}
+
+int batch_parallel(manifest_t *basenames, const job_options_t *options,
+                   batch_summary_t *summary, int jobs, jobserver_t *js)
+{
+    pthread_t threads[MAX_JOBS]; /* Worker threads. */
+    worker_t workers[MAX_JOBS]; /* Worker state. */
+    batch_t batch; /* Work shared between the workers. */
+    const int count = manifest_count(basenames); /* Number of files if known. */
+    int i; /* Counter. */
+
+    /* No point in starting more workers than there are files. */
+    if (count >= 0 && jobs > count)
+        jobs = count;
+    if (jobs > MAX_JOBS)
+        jobs = MAX_JOBS;
+
+    batch.basenames = basenames;
+    batch.options = options;
+    batch.exhausted = 0;
+    batch.error = 0;
+    batch.summary = summary;
+    batch.js = js;
+    pthread_mutex_init(&batch.lock, 0);
+
+    /* Start the additional workers. If a thread can't be created the
+       remaining workers pick up its share. */
+    for (i = 1; i < jobs; ++i) {
+        workers[i].batch = &batch;
+        workers[i].implicit_token = 0;
+        if (pthread_create(&threads[i], 0, batch_worker, &workers[i]) != 0)
+            break;
+    }
+
+    /* This thread is the first worker and uses the implicit token. */
+    workers[0].batch = &batch;
+    workers[0].implicit_token = 1;
+    batch_worker(&workers[0]);
+
+    /* Wait for all workers to finish. */
+    while (--i > 0)
+        pthread_join(threads[i], 0);
+
+    pthread_mutex_destroy(&batch.lock);
+
+    return batch.error;
+}
+
+/**
+ * Encode stage thread of a pipelined batch.
+ *
+ * @param arg Pointer to the pipeline.
+ * @return Null pointer.
+ */
+static void *encode_stage(void *arg)
+{
+    pipeline_t *pl = (pipeline_t*)arg;
+    job_t *job; /* Current job. */
+
+    while ((job = (job_t*)queue_pop(pl->loaded)) != 0) {
+        job_encode(job);
+        queue_push(pl->encoded, job);
+    }
+
+    /* No more jobs for the write stage. */
+    queue_close(pl->encoded);
+
+    return 0;
+}
+
+/**
+ * Write stage thread of a pipelined batch.
+ *
+ * @param arg Pointer to the pipeline.
+ * @return Null pointer.
+ */
+static void *write_stage(void *arg)
+{
+    pipeline_t *pl = (pipeline_t*)arg;
+    job_t *job; /* Current job. */
+
+    int error; /* Result of current job. */
+
+    while ((job = (job_t*)queue_pop(pl->encoded)) != 0) {
+        error = job_write(job);
+        record_job(pl->summary, job, error);
+        pl->error |= error;
+        if (error && job->options.fail_fast) {
+            pthread_mutex_lock(&pl->lock);
+            pl->halted = 1;
+            pthread_mutex_unlock(&pl->lock);
+        }
+        job_free(job);
+    }
+
+    return 0;
+}
+
+/**
+ * Checks if a pipelined batch stopped loading files after a failure.
+ *
+ * @param pl Pipeline.
+ * @return Non-zero if no further files are to be loaded.
+ */
+static int pipeline_halted(pipeline_t *pl)
+{
+    int halted; /* Return value. */
+
+    pthread_mutex_lock(&pl->lock);
+    halted = pl->halted;
+    pthread_mutex_unlock(&pl->lock);
+
+    return halted;
+}
+
+int batch_pipeline(manifest_t *basenames, const job_options_t *options,
+                   batch_summary_t *summary, jobserver_t *js)
+{
+    const job_options_t *files = options; /* Options of the files. */
+    job_options_t limited; /* Options of the files under a jobserver. */
+    char tokens[2]; /* Tokens held by the encode and write stages. */
+    pipeline_t pl; /* Pipeline queues. */
+    pthread_t encoder, writer; /* Stage threads. */
+    char basename[MANIFEST_NAME_SIZE]; /* Basename of file being loaded. */
+    char failed[MANIFEST_NAME_SIZE]; /* Basename of last failed file. */
+    job_t *job; /* Job being loaded. */
+    int error = 0; /* Failures detected by the load stage. */
+    int lost = 0; /* Number of files that could not be given a job. */
+    int held = 0; /* Number of tokens held by the stages. */
+
+    /* Under a jobserver the encode and write stages hold a token each, and
+       the files run no threads beyond the stages'. The batch is assembled
+       serially unless both tokens are free as it starts. */
+    if (js) {
+        if ((held = take_tokens(js, 2, tokens)) < 2) {
+            return_tokens(js, held, tokens);
+            return batch_serial(basenames, options, summary, js);
+        }
+        limited = *options;
+        limited.threads = 1;
+        limited.stream_inline = 1;
+        files = &limited;
+    }
+
+    /* Allocate queues. */
+    pl.loaded = queue_alloc(PIPELINE_QUEUE_DEPTH);
+    pl.encoded = queue_alloc(PIPELINE_QUEUE_DEPTH);
+    pl.error = 0;
+    pl.halted = 0;
+    pl.summary = summary;
+    pthread_mutex_init(&pl.lock, 0);
+
+    /* Start the encode and write stages. */
+    if (!pl.loaded || !pl.encoded ||
+        pthread_create(&encoder, 0, encode_stage, &pl) != 0) {
+        if (pl.loaded)
+            queue_free(pl.loaded);
+        if (pl.encoded)
+            queue_free(pl.encoded);
+        pthread_mutex_destroy(&pl.lock);
+        return_tokens(js, held, tokens);
+        return batch_serial(basenames, options, summary, js);
+    }
+    if (pthread_create(&writer, 0, write_stage, &pl) != 0) {
+        /* Nothing was queued yet; shut the encoder down and go serial. */
+        queue_close(pl.loaded);
+        pthread_join(encoder, 0);
+        queue_free(pl.loaded);
+        queue_free(pl.encoded);
+        pthread_mutex_destroy(&pl.lock);
+        return_tokens(js, held, tokens);
+        return batch_serial(basenames, options, summary, js);
+    }
+
+    /* Load stage runs on this thread. */
+    while (!(error && options->fail_fast) && !pipeline_halted(&pl) &&
+           manifest_next(basenames, basename)) {
+        if ((job = job_alloc(basename, files)) == 0) {
+            printf("error: out of memory assembling %s.\n", basename);
+            strcpy(failed, basename);
+            error = 1;
+            ++lost;
+            continue;
+        }
+        job_load(job);
+        queue_push(pl.loaded, job);
+    }
+
+    /* No more jobs; wait for the later stages to drain. */
+    queue_close(pl.loaded);
+    pthread_join(encoder, 0);
+    pthread_join(writer, 0);
+
+    queue_free(pl.loaded);
+    queue_free(pl.encoded);
+    pthread_mutex_destroy(&pl.lock);
+    return_tokens(js, held, tokens);
+
+    /* Count the files that never made it into the pipeline. */
+    for (; lost > 0; --lost)
+        record_file(summary, failed, 1, 0, 0);
+
+    return error | pl.error;
+}
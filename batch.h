@@ -0,0 +1,153 @@
+/**
+ * @file batch.h
+ * @author Tamir Attias
+ * @brief Batch assembly driver declarations.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "manifest.h"
+#include "stats.h"
+#include "diag.h"
+
+/* Forward declarations. */
+struct jobserver;
+struct job_options;
+
+/**
+ * Maximum number of files assembled concurrently.
+ */
+#define MAX_JOBS 64
+
+/**
+ * Interval at which workers waiting for a jobserver token check whether
+ * the batch is already done, in milliseconds.
+ */
+#define JOBSERVER_POLL_MS 50
+
+/**
+ * Number of files that may wait between two pipeline stages.
+ */
+#define PIPELINE_QUEUE_DEPTH 2
+
+/**
+ * Outcome of a batch.
+ */
+typedef struct {
+    /** Number of files taken from the manifest. */
+    int processed;
+    /** Number of files that failed to assemble. */
+    int failed;
+    /** Number of failed files whose source could not be read at all. */
+    int skipped;
+    /** Sum of the times taken by each file, in seconds. */
+    double file_seconds;
+    /** Time taken by the slowest file, in seconds. */
+    double slowest_seconds;
+    /** Basename of the slowest file. */
+    char slowest[MANIFEST_NAME_SIZE];
+    /** Number of files whose outcome was found in the build cache. */
+    int cache_hits;
+    /** Number of files looked up in the build cache but not found. */
+    int cache_misses;
+    /** Time saved by build cache hits, in seconds. */
+    double cache_saved;
+    /** Number of lines replayed from line records. */
+    long lines_reused;
+    /** Number of lines of the files reassembled incrementally. */
+    long lines_total;
+    /** Number of lines looked up in the first pass memo. */
+    long memo_lines;
+    /** Number of those replayed from the memo. */
+    long memo_hits;
+    /** Statistics of the files, summed. */
+    stats_t stats;
+} batch_summary_t;
+
+/**
+ * Prints the summary of a batch.
+ *
+ * @param summary Summary.
+ * @param seconds Time taken by the whole batch, in seconds.
+ */
+void batch_summary_print(const batch_summary_t *summary, double seconds);
+
+/**
+ * Prints the build cache statistics of a batch.
+ *
+ * @param summary Summary.
+ */
+void batch_cache_print(const batch_summary_t *summary);
+
+/**
+ * Prints the incremental reassembly statistics of a batch.
+ *
+ * @param summary Summary.
+ */
+void batch_lines_print(const batch_summary_t *summary);
+
+/**
+ * Prints the first pass memo statistics of a batch.
+ *
+ * @param summary Summary.
+ */
+void batch_memo_print(const batch_summary_t *summary);
+
+/**
+ * Prints the statistics of a batch, summed over its files.
+ *
+ * @param summary Summary.
+ * @param seconds Time taken by the whole batch, in seconds.
+ * @param format Format to print them in, as a JSON object on a line of its
+ *               own or as text.
+ */
+void batch_stats_print(const batch_summary_t *summary, double seconds, diag_format_t format);
+
+/**
+ * Assembles files one after the other.
+ *
+ * @param basenames Basenames of the files to assemble.
+ * @param options Options applying to every file.
+ * @param summary Zero initialized summary, receiving the outcome.
+ * @param js If not null, every thread a file runs beyond the calling one
+ *           must hold a token from this jobserver; a file makes do with
+ *           the tokens free as it starts.
+ * @return Zero if all files were assembled, non-zero on failure.
+ */
+int batch_serial(manifest_t *basenames, const struct job_options *options,
+                 batch_summary_t *summary, struct jobserver *js);
+
+/**
+ * Assembles files using several threads, each assembling whole files.
+ * Messages of each file are printed in one piece.
+ *
+ * @param basenames Basenames of the files to assemble.
+ * @param options Options applying to every file.
+ * @param summary Zero initialized summary, receiving the outcome.
+ * @param jobs Maximum number of files to assemble concurrently.
+ * @param js If not null, every worker but the first must hold a token from
+ *           this jobserver, so the batch shares make's CPU budget, as must
+ *           every thread a file runs beyond its worker.
+ * @return Zero if all files were assembled, non-zero on failure.
+ */
+int batch_parallel(manifest_t *basenames, const struct job_options *options,
+                   batch_summary_t *summary, int jobs, struct jobserver *js);
+
+/**
+ * Assembles files in a pipeline: while one file is encoded the next one is
+ * read and preprocessed and the outputs of the previous one are written.
+ * Files are completed, and their messages printed, in order.
+ *
+ * @param basenames Basenames of the files to assemble.
+ * @param options Options applying to every file.
+ * @param summary Zero initialized summary, receiving the outcome.
+ * @param js If not null, the encode and write stages must each hold a token
+ *           from this jobserver and files run no further threads; the
+ *           files are assembled serially unless both are free at the start.
+ * @return Zero if all files were assembled, non-zero on failure.
+ */
+int batch_pipeline(manifest_t *basenames, const struct job_options *options,
+                   batch_summary_t *summary, struct jobserver *js);
+
+#endif
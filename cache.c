@@ -0,0 +1,188 @@
+/**
+ * @file cache.c
+ * @author Tamir Attias
+ * @brief Build cache implementation.
+ */
+
+#include "cache.h"
+#include "dynstr.h"
+#include "output.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/**
+ * Builds the path of the entry file for a source and key. The name is a
+ * 64 bit hash made of two FNV-1a lanes with different offset bases.
+ *
+ * @param path Buffer of FILENAME_MAX characters receiving the path.
+ * @param dir Cache directory.
+ * @param key Key string.
+ * @param source Source text.
+ * @param len Length of source text in bytes.
+ * @return Zero on success, non-zero if the path is too long.
+ */
+static int entry_path(char *path, const char *dir, const char *key,
+                      const char *source, size_t len)
+{
+    unsigned long lo = FNV1A_BASIS, hi = 3735928559UL; /* Hash lanes. */
+
+    lo = fnv1a(fnv1a(lo, key, strlen(key) + 1), source, len);
+    hi = fnv1a(fnv1a(hi, source, len), key, strlen(key) + 1);
+
+    if (strlen(dir) + 24 >= FILENAME_MAX)
+        return 1;
+    sprintf(path, "%s/%08lx%08lx.cache", dir, hi, lo);
+
+    return 0;
+}
+
+/**
+ * Reads the next section of an entry.
+ *
+ * @param head Read position in the entry, advanced past the section.
+ * @param end End of the entry.
+ * @param section Receives the section.
+ * @return Zero on success, non-zero if the entry is malformed.
+ */
+static int read_entry_section(const char **head, const char *end, cache_section_t *section)
+{
+    const char *newline = memchr(*head, '\n', end - *head); /* End of header. */
+    unsigned long len; /* Length of contents. */
+    char format[16]; /* Header format string. */
+
+    if (!newline)
+        return 1;
+
+    sprintf(format, "%%%ds %%lu", CACHE_MAX_NAME_LENGTH);
+    if (sscanf(*head, format, section->name, &len) != 2 || len > (unsigned long)(end - newline - 1))
+        return 1;
+
+    section->buf = newline + 1;
+    section->len = len;
+    *head = section->buf + len;
+
+    return 0;
+}
+
+int cache_open(const char *dir)
+{
+    return mkdir(dir, 0777) != 0 && errno != EEXIST;
+}
+
+int cache_lookup(const char *dir, const char *key, const char *source, size_t len,
+                 cache_entry_t *entry)
+{
+    char path[FILENAME_MAX]; /* Entry file path. */
+    FILE *fp; /* Entry file. */
+    cache_section_t section; /* Key or source section. */
+    const char *head, *end; /* Read position and end of entry. */
+    int format; /* Format of entry. */
+
+    memset(entry, 0, sizeof(*entry));
+
+    /* Read the entry. */
+    if (entry_path(path, dir, key, source, len) != 0 || (fp = fopen(path, "r")) == 0)
+        return 1;
+    if ((entry->data = dynstr_alloc(4096)) != 0 && dynstr_append_stream(entry->data, fp) != 0) {
+        dynstr_free(entry->data);
+        entry->data = 0;
+    }
+    fclose(fp);
+    if (!entry->data)
+        return 1;
+
+    head = dynstr_pointer(entry->data);
+    end = head + dynstr_size(entry->data);
+
+    /* Check the format. */
+    if (sscanf(head, "asmcache %d", &format) != 1 || format != CACHE_FORMAT ||
+        (head = memchr(head, '\n', end - head)) == 0)
+        goto miss;
+    ++head;
+
+    /* Check that the entry is for this key and source. */
+    if (read_entry_section(&head, end, &section) != 0 ||
+        section.len != strlen(key) || memcmp(section.buf, key, section.len) != 0 ||
+        read_entry_section(&head, end, &section) != 0 ||
+        section.len != len || memcmp(section.buf, source, len) != 0)
+        goto miss;
+
+    /* Read the caller's sections. */
+    while (head < end) {
+        if (entry->count == CACHE_MAX_SECTIONS ||
+            read_entry_section(&head, end, &entry->sections[entry->count]) != 0)
+            goto miss;
+        ++entry->count;
+    }
+
+    return 0;
+
+miss:
+    cache_entry_free(entry);
+    return 1;
+}
+
+const cache_section_t *cache_find(const cache_entry_t *entry, const char *name)
+{
+    int i; /* Counter. */
+
+    for (i = 0; i < entry->count; ++i) {
+        if (strcmp(entry->sections[i].name, name) == 0)
+            return &entry->sections[i];
+    }
+
+    return 0;
+}
+
+void cache_entry_free(cache_entry_t *entry)
+{
+    if (entry->data)
+        dynstr_free(entry->data);
+    memset(entry, 0, sizeof(*entry));
+}
+
+int cache_store(const char *dir, const char *key, const char *source, size_t len,
+                const cache_section_t *sections, int count)
+{
+    char path[FILENAME_MAX]; /* Entry file path. */
+    char temp[FILENAME_MAX]; /* Temporary file path. */
+    FILE *fp; /* Temporary file. */
+    int fd; /* Temporary file descriptor. */
+    int error; /* Return value. */
+    int i; /* Counter. */
+
+    if (entry_path(path, dir, key, source, len) != 0)
+        return 1;
+
+    /* Write a temporary file next to the entry. */
+    sprintf(temp, "%s/tmp.XXXXXX", dir);
+    if ((fd = mkstemp(temp)) < 0)
+        return 1;
+    if ((fp = fdopen(fd, "w")) == 0) {
+        close(fd);
+        unlink(temp);
+        return 1;
+    }
+
+    error = fprintf(fp, "asmcache %d\n", CACHE_FORMAT) < 0 ||
+            write_section(fp, "key", key, strlen(key)) ||
+            write_section(fp, "source", source, len);
+    for (i = 0; i < count && !error; ++i)
+        error = write_section(fp, sections[i].name, sections[i].buf, sections[i].len);
+    error |= fclose(fp) != 0;
+
+    /* Move it into place in one step. */
+    if (error || rename(temp, path) != 0) {
+        unlink(temp);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,114 @@
+/**
+ * @file cache.h
+ * @author Tamir Attias
+ * @brief Build cache declarations.
+ * @details The build cache keeps the outcome of assembling a source on disk,
+ *          keyed by a hash of the source and of a key string describing
+ *          everything else the outcome depends on (assembler version and
+ *          options). An entry is a series of named sections, framed like the
+ *          stream mode output, which the caller fills as it likes. Entries
+ *          also hold the key string and the source, which are compared on
+ *          lookup, so a hash collision can't produce a wrong hit.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h> /* for size_t */
+
+/**
+ * Version of the cache entry format.
+ */
+#define CACHE_FORMAT 1
+
+/**
+ * Maximum number of sections in a cache entry, besides the key and source.
+ */
+#define CACHE_MAX_SECTIONS 8
+
+/**
+ * Maximum length of a section name.
+ */
+#define CACHE_MAX_NAME_LENGTH 15
+
+/* Forward declarations. */
+struct dynstr;
+
+/**
+ * A named section of a cache entry.
+ */
+typedef struct {
+    /** Name. */
+    char name[CACHE_MAX_NAME_LENGTH + 1];
+    /** Contents. */
+    const char *buf;
+    /** Length of contents in bytes. */
+    size_t len;
+} cache_section_t;
+
+/**
+ * A cache entry read from disk.
+ */
+typedef struct cache_entry {
+    /** Entry file contents, which the sections point into. */
+    struct dynstr *data;
+    /** Sections. */
+    cache_section_t sections[CACHE_MAX_SECTIONS];
+    /** Number of sections. */
+    int count;
+} cache_entry_t;
+
+/**
+ * Creates the cache directory if it doesn't exist yet.
+ *
+ * @param dir Cache directory.
+ * @return Zero on success, non-zero on failure.
+ */
+int cache_open(const char *dir);
+
+/**
+ * Looks a source up in the cache.
+ *
+ * @param dir Cache directory.
+ * @param key Key string.
+ * @param source Source text.
+ * @param len Length of source text in bytes.
+ * @param entry Receives the entry on a hit.
+ * @return Zero on a hit, non-zero on a miss.
+ */
+int cache_lookup(const char *dir, const char *key, const char *source, size_t len,
+                 cache_entry_t *entry);
+
+/**
+ * Finds a section of a cache entry.
+ *
+ * @param entry Entry.
+ * @param name Section name.
+ * @return Pointer to the section or null if the entry has none by that name.
+ */
+const cache_section_t *cache_find(const cache_entry_t *entry, const char *name);
+
+/**
+ * Frees the contents of a cache entry filled by cache_lookup.
+ *
+ * @param entry Entry.
+ */
+void cache_entry_free(cache_entry_t *entry);
+
+/**
+ * Stores an entry in the cache, replacing any entry of the same source and
+ * key. The entry is written to a temporary file which is then renamed, so
+ * concurrent lookups never see a partial entry.
+ *
+ * @param dir Cache directory.
+ * @param key Key string.
+ * @param source Source text.
+ * @param len Length of source text in bytes.
+ * @param sections Sections of the entry.
+ * @param count Number of sections.
+ * @return Zero on success, non-zero on failure.
+ */
+int cache_store(const char *dir, const char *key, const char *source, size_t len,
+                const cache_section_t *sections, int count);
+
+#endif
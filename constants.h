@@ -7,6 +7,12 @@
 #ifndef CONSTANTS_H
 #define CONSTANTS_H
 
+/**
+ * Version of the assembler. Keys the entries of the build cache, so it must
+ * change along with anything that affects output files or messages.
+ */
+#define ASSEMBLER_VERSION "1.1"
+
 /**
  * Maximum line length for all source files, in characters.
  */
@@ -27,4 +33,15 @@
  */
 #define MAX_CODE_SEGMENT_LEN 8192
 
+/**
+ * Maximum number of threads working on a single file.
+ */
+#define MAX_THREADS 64
+
+/**
+ * Minimum number of characters per chunk when a stage splits a file across
+ * threads. Smaller files are processed on one thread.
+ */
+#define MIN_CHUNK_SIZE 16384
+
 #endif
\ No newline at end of file
@@ -0,0 +1,254 @@
+/**
+ * @file diag.c
+ * @author Tamir Attias
+ * @brief Diagnostics implementation.
+ */
+
+#include "diag.h"
+#include "hashtable.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Number of diagnostics to pre-allocate in a list. */
+#define DIAGLIST_INITIAL_CAPACITY 16
+
+/* Number of buckets of the table of diagnostics held by a collector. */
+#define DIAGBUF_BUCKET_COUNT 256
+
+/* Size of the key of a diagnostic in the table: severity, line, stage,
+   file and message. */
+#define DIAGBUF_KEY_SIZE (MAX_DIAG_LENGTH + FILENAME_MAX + 64)
+
+struct diaglist {
+    /** Recorded diagnostics. */
+    diag_t *items;
+    /** Number of recorded diagnostics. */
+    int size;
+    /** Number of allocated diagnostics. */
+    int capacity;
+};
+
+diaglist_t *diaglist_alloc()
+{
+    return (diaglist_t*)calloc(1, sizeof(diaglist_t));
+}
+
+/**
+ * Frees the diagnostics held by a list.
+ *
+ * @param list List.
+ */
+static void free_items(diaglist_t *list)
+{
+    int i; /* Counter. */
+
+    for (i = 0; i < list->size; ++i)
+        free(list->items[i].file);
+    free(list->items);
+}
+
+void diaglist_free(diaglist_t *list)
+{
+    free_items(list);
+    free(list);
+}
+
+/**
+ * Appends a diagnostic of any severity to a list.
+ *
+ * @param list List.
+ * @param severity Severity.
+ * @param stage Name of the stage or null.
+ * @param file Path of the included file the line is in, or null.
+ * @param line Source line number or zero.
+ * @param message Message to copy.
+ * @return Zero on success, non-zero if out of memory.
+ */
+static int append(diaglist_t *list, diag_severity_t severity, const char *stage,
+                  const char *file, int line, const char *message)
+{
+    diag_t *items; /* Reallocated items. */
+    int capacity; /* New capacity. */
+    diag_t *diag; /* New diagnostic. */
+    char *copy = 0; /* Copy of the file path. */
+
+    /* Grow the list if full. */
+    if (list->size >= list->capacity) {
+        capacity = list->capacity ? list->capacity * 2 : DIAGLIST_INITIAL_CAPACITY;
+        items = (diag_t*)realloc(list->items, capacity * sizeof(diag_t));
+
+        /* Check if out of memory. The diagnostic is dropped. */
+        if (!items)
+            return 1;
+
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    if (file) {
+        if ((copy = (char*)malloc(strlen(file) + 1)) == 0)
+            return 1;
+        strcpy(copy, file);
+    }
+
+    diag = &list->items[list->size++];
+    diag->severity = severity;
+    diag->stage = stage;
+    diag->file = copy;
+    diag->line = line;
+
+    /* Copy message, truncating if too long. */
+    strncpy(diag->message, message, MAX_DIAG_LENGTH);
+    diag->message[MAX_DIAG_LENGTH] = '\0';
+
+    return 0;
+}
+
+void diaglist_append(void *ctx, const char *stage, const char *file, int line,
+                     const char *message)
+{
+    append((diaglist_t*)ctx, DIAG_ERROR, stage, file, line, message);
+}
+
+int diaglist_size(const diaglist_t *list)
+{
+    return list->size;
+}
+
+const diag_t *diaglist_get(const diaglist_t *list, int index)
+{
+    return &list->items[index];
+}
+
+void diaglist_flush(const diaglist_t *list, diag_func_t func, void *ctx)
+{
+    int i; /* Counter. */
+
+    for (i = 0; i < list->size; ++i) {
+        func(ctx, list->items[i].stage, list->items[i].file, list->items[i].line,
+             list->items[i].message);
+    }
+}
+
+void diag_print(void *ctx, const char *stage, const char *file, int line, const char *message)
+{
+    FILE *fp = ctx ? (FILE*)ctx : stdout; /* Output stream. */
+
+    /* A single call so that messages from concurrent assemblies don't
+       interleave. */
+    fprintf(fp, "%s: error: %s%sline %d: %s\n", stage, file ? file : "", file ? " " : "",
+            line, message);
+}
+
+struct diagbuf {
+    /** Name of the file. */
+    char *file;
+    /** Diagnostics held, in order. */
+    diaglist_t list;
+    /** Keys of the diagnostics held, to drop repeats. */
+    hashtable_t *seen;
+};
+
+/* Callback for the items of the table of diagnostics held, which are only
+   markers. */
+static void keep_item(void *item)
+{
+    (void)item;
+}
+
+diagbuf_t *diagbuf_alloc(const char *file)
+{
+    diagbuf_t *buf = (diagbuf_t*)calloc(1, sizeof(diagbuf_t));
+
+    /* Check if out of memory. */
+    if (!buf)
+        return 0;
+
+    if ((buf->file = (char*)malloc(strlen(file) + 1)) == 0 ||
+        (buf->seen = hashtable_alloc(DIAGBUF_BUCKET_COUNT, keep_item)) == 0) {
+        diagbuf_free(buf);
+        return 0;
+    }
+    strcpy(buf->file, file);
+
+    return buf;
+}
+
+void diagbuf_free(diagbuf_t *buf)
+{
+    if (buf->seen)
+        hashtable_free(buf->seen);
+    free_items(&buf->list);
+    free(buf->file);
+    free(buf);
+}
+
+int diagbuf_add(diagbuf_t *buf, diag_severity_t severity, const char *stage, const char *file,
+                int line, const char *message)
+{
+    char key[DIAGBUF_KEY_SIZE]; /* Key of the diagnostic. */
+
+    /* Drop a repeat. Messages are compared as they would be kept. */
+    sprintf(key, "%d %d %s:%.*s:%.*s", (int)severity, line, stage ? stage : "",
+            FILENAME_MAX, file ? file : "", MAX_DIAG_LENGTH, message);
+    if (hashtable_find(buf->seen, key))
+        return 1;
+
+    if (append(&buf->list, severity, stage, file, line, message) != 0)
+        return 1;
+
+    /* Without its key a repeat would only be kept too. */
+    hashtable_insert(buf->seen, key, buf);
+
+    return 0;
+}
+
+void diagbuf_append(void *ctx, const char *stage, const char *file, int line,
+                    const char *message)
+{
+    diagbuf_add((diagbuf_t*)ctx, DIAG_ERROR, stage, file, line, message);
+}
+
+void diagbuf_write(const diagbuf_t *buf, diag_format_t format, FILE *fp)
+{
+    static const char *const names[] = { "error", "fatal error" }; /* Severity names. */
+    const diag_t *diag; /* Current diagnostic. */
+    int i; /* Counter. */
+
+    for (i = 0; i < buf->list.size; ++i) {
+        diag = &buf->list.items[i];
+
+        if (format == DIAG_FORMAT_JSON) {
+            fputs("{\"file\":", fp);
+            json_write_string(fp, diag->file ? diag->file : buf->file);
+            if (diag->line > 0)
+                fprintf(fp, ",\"line\":%d", diag->line);
+            else
+                fputs(",\"line\":null", fp);
+            fputs(",\"stage\":", fp);
+            if (diag->stage)
+                json_write_string(fp, diag->stage);
+            else
+                fputs("null", fp);
+            fprintf(fp, ",\"severity\":\"%s\",\"message\":",
+                    diag->severity == DIAG_FATAL ? "fatal" : "error");
+            json_write_string(fp, diag->message);
+            fputs("}\n", fp);
+            continue;
+        }
+
+        /* Text as printed by diag_print, the stage and line left out when
+           the diagnostic has none. */
+        if (diag->stage)
+            fprintf(fp, "%s: ", diag->stage);
+        fputs(names[diag->severity], fp);
+        if (diag->file)
+            fprintf(fp, ": %s line %d", diag->file, diag->line);
+        else if (diag->line > 0)
+            fprintf(fp, ": line %d", diag->line);
+        fprintf(fp, ": %s\n", diag->message);
+    }
+}
@@ -0,0 +1,196 @@
+/**
+ * @file diag.h
+ * @author Tamir Attias
+ * @brief Diagnostics declarations.
+ */
+
+#ifndef DIAG_H
+#define DIAG_H
+
+#include <stdio.h> /* for FILE */
+
+/**
+ * Maximum length of a diagnostic message.
+ */
+#define MAX_DIAG_LENGTH 255
+
+/**
+ * Callback receiving a diagnostic.
+ *
+ * @param ctx User supplied context.
+ * @param stage Name of the assembly stage reporting the diagnostic.
+ * @param file Path of the included file the line is in, or null if the line
+ *             is in the source itself.
+ * @param line Source line number the diagnostic refers to.
+ * @param message Null terminated message.
+ */
+typedef void(*diag_func_t)(void *ctx, const char *stage, const char *file, int line,
+                           const char *message);
+
+/**
+ * Severity of a diagnostic.
+ */
+typedef enum {
+    DIAG_ERROR, /* Something is wrong with the source. */
+    DIAG_FATAL /* The file could not be assembled. */
+} diag_severity_t;
+
+/**
+ * Format in which collected diagnostics are written.
+ */
+typedef enum {
+    DIAG_FORMAT_TEXT, /* One line per diagnostic, for people. */
+    DIAG_FORMAT_JSON /* One JSON object per line, for tools. */
+} diag_format_t;
+
+/**
+ * A recorded diagnostic.
+ */
+typedef struct {
+    /** Severity. */
+    diag_severity_t severity;
+    /** Name of the assembly stage that reported the diagnostic, or null if
+        it concerns the file as a whole. */
+    const char *stage;
+    /** Path of the included file the line is in, or null if the line is in
+        the source itself. Owned by the diagnostic. */
+    char *file;
+    /** Source line number, zero if none. */
+    int line;
+    /** Message. */
+    char message[MAX_DIAG_LENGTH + 1];
+} diag_t;
+
+/**
+ * Growable list of recorded diagnostics.
+ */
+typedef struct diaglist diaglist_t;
+
+/**
+ * Allocates an empty list of diagnostics.
+ *
+ * @return Pointer to the list or null if out of memory.
+ */
+diaglist_t *diaglist_alloc();
+
+/**
+ * Frees a list of diagnostics.
+ *
+ * @param list List to free.
+ */
+void diaglist_free(diaglist_t *list);
+
+/**
+ * Appends an error to a list. Has the signature of diag_func_t so that it
+ * can be used as a callback with the list as context.
+ *
+ * @param ctx Pointer to the list.
+ * @param stage Name of the stage. Must be a string literal or otherwise
+ *              outlive the list.
+ * @param file Path of the included file the line is in, copied, or null.
+ * @param line Source line number.
+ * @param message Message to copy. Truncated to MAX_DIAG_LENGTH characters.
+ */
+void diaglist_append(void *ctx, const char *stage, const char *file, int line,
+                     const char *message);
+
+/**
+ * Returns the number of diagnostics in a list.
+ *
+ * @param list Pointer to the list.
+ * @return Number of diagnostics.
+ */
+int diaglist_size(const diaglist_t *list);
+
+/**
+ * Returns a diagnostic from a list.
+ *
+ * @param list Pointer to the list.
+ * @param index Index of the diagnostic, in order of appending.
+ * @return Pointer to the diagnostic.
+ */
+const diag_t *diaglist_get(const diaglist_t *list, int index);
+
+/**
+ * Passes every diagnostic in a list to a callback, in order.
+ *
+ * @param list List of diagnostics.
+ * @param func Callback receiving the diagnostics.
+ * @param ctx Context passed to the callback.
+ */
+void diaglist_flush(const diaglist_t *list, diag_func_t func, void *ctx);
+
+/**
+ * Prints a diagnostic to a stream. Has the signature of diag_func_t.
+ *
+ * @param ctx Stream (FILE pointer) to print to, standard output if null.
+ * @param stage Name of the stage.
+ * @param file Path of the included file the line is in, or null.
+ * @param line Source line number.
+ * @param message Message to print.
+ */
+void diag_print(void *ctx, const char *stage, const char *file, int line, const char *message);
+
+/**
+ * Collector of the diagnostics of one file. Diagnostics are held in the
+ * order reported, a repeat of one already held is dropped, and all of them
+ * are written out together once the file is done, so the messages of files
+ * assembled concurrently don't interleave.
+ */
+typedef struct diagbuf diagbuf_t;
+
+/**
+ * Allocates an empty collector.
+ *
+ * @param file Name of the file the diagnostics are about, copied.
+ * @return Pointer to the collector or null if out of memory.
+ */
+diagbuf_t *diagbuf_alloc(const char *file);
+
+/**
+ * Frees a collector.
+ *
+ * @param buf Collector.
+ */
+void diagbuf_free(diagbuf_t *buf);
+
+/**
+ * Adds a diagnostic to a collector, unless the same one was added before.
+ *
+ * @param buf Collector.
+ * @param severity Severity.
+ * @param stage Name of the stage or null. Must be a string literal or
+ *              otherwise outlive the collector.
+ * @param file Path of the included file the line is in, copied, or null if
+ *             the line is in the collector's file.
+ * @param line Source line number or zero.
+ * @param message Message to copy. Truncated to MAX_DIAG_LENGTH characters.
+ * @return Zero if added, non-zero if dropped as a repeat or out of memory.
+ */
+int diagbuf_add(diagbuf_t *buf, diag_severity_t severity, const char *stage, const char *file,
+                int line, const char *message);
+
+/**
+ * Adds an error to a collector, unless the same one was added before. Has
+ * the signature of diag_func_t so that it can be used as a callback with the
+ * collector as context.
+ *
+ * @param ctx Pointer to the collector.
+ * @param stage Name of the stage, as for diagbuf_add.
+ * @param file Path of the included file the line is in, or null.
+ * @param line Source line number.
+ * @param message Message to copy.
+ */
+void diagbuf_append(void *ctx, const char *stage, const char *file, int line,
+                    const char *message);
+
+/**
+ * Writes the diagnostics held by a collector to a stream, in order.
+ *
+ * @param buf Collector.
+ * @param format Format to write in.
+ * @param fp Stream.
+ */
+void diagbuf_write(const diagbuf_t *buf, diag_format_t format, FILE *fp);
+
+#endif
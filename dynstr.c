@@ -99,24 +99,27 @@ const char *dynstr_pointer(const dynstr_t *str)
 
 int dynstr_append(dynstr_t *str, const char *suffix)
 {
-    int suffix_len; /* Suffix length. */
+    return dynstr_append_len(str, suffix, strlen(suffix));
+}
+
+int dynstr_append_len(dynstr_t *str, const char *buf, int len)
+{
     int new_len; /* Expanded string length. */
     int new_capacity; /* New capacity. */
     char *new_buf; /* Rellocated buffer. */
 
-    /* Find length of suffix. */
-    suffix_len = strlen(suffix);
-
     /* Find new length of expanded string. */
-    new_len = str->size + suffix_len;
+    new_len = str->size + len;
 
     /* Check if we would overflow the buffer. */
     if (new_len > str->capacity) {
-        /* Double capacity. */
-        new_capacity = str->capacity * 2;
+        /* Double capacity until the suffix fits. */
+        new_capacity = str->capacity > 0 ? str->capacity : 1;
+        while (new_capacity < new_len)
+            new_capacity *= 2;
 
         /* Expand the string. */
-        new_buf = realloc(str->buf, str->capacity + 1);
+        new_buf = realloc(str->buf, new_capacity + 1);
 
         /* Check if out of memory. */
         if (!new_buf)
@@ -128,7 +131,7 @@ int dynstr_append(dynstr_t *str, const char *suffix)
     }
 
     /* Copy suffix to end of string. */
-    memcpy(str->buf + str->size, suffix, suffix_len);
+    memcpy(str->buf + str->size, buf, len);
     
     str->size = new_len; /* Update size. */
     str->buf[str->size] = '\0'; /* Add null terminator. */
@@ -136,6 +139,20 @@ int dynstr_append(dynstr_t *str, const char *suffix)
     return 0;
 }
 
+int dynstr_append_stream(dynstr_t *str, FILE *fp)
+{
+    char buf[4096]; /* Read buffer. */
+    size_t n; /* Number of characters read. */
+
+    /* Read in blocks until end of file. */
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        if (dynstr_append_len(str, buf, (int)n))
+            return 1; /* Out of memory. */
+    }
+
+    return ferror(fp) ? 1 : 0;
+}
+
 void dynstr_clear(dynstr_t *str)
 {
     /* Set size to zero and null terminate. */
@@ -9,6 +9,8 @@
 #ifndef DYNSTR_H
 #define DYNSTR_H
 
+#include <stdio.h> /* for FILE */
+
 typedef struct dynstr dynstr_t;
 
 /**
@@ -65,6 +67,28 @@ const char *dynstr_pointer(const dynstr_t *str);
  */
 int dynstr_append(dynstr_t *str, const char *suffix);
 
+/**
+ * Appends a number of characters to the string, reallocating the string if
+ * necessary.
+ *
+ * @param str Pointer to the dynamic string object to append to.
+ * @param buf Characters to append. Need not be null terminated.
+ * @param len Number of characters to append.
+ * @return Zero on success, non-zero if error (e.g., out of memory.)
+ * @note When out of memory a non-zero value is returned and the string stays
+ *       the same as before.
+ */
+int dynstr_append_len(dynstr_t *str, const char *buf, int len);
+
+/**
+ * Appends the remaining contents of a stream to the string.
+ *
+ * @param str Pointer to the dynamic string object to append to.
+ * @param fp Stream to read until end of file. Need not be seekable.
+ * @return Zero on success, non-zero on read error or if out of memory.
+ */
+int dynstr_append_stream(dynstr_t *str, FILE *fp);
+
 /**
  * Empties a previously allocated dynamic string.
  *
@@ -0,0 +1,244 @@
+/**
+ * @file filecache.c
+ * @author Tamir Attias
+ * @brief File cache implementation.
+ */
+
+#include "filecache.h"
+#include "dynstr.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/**
+ * Item of a file in the cache.
+ */
+typedef struct entry {
+    /** Path of the file. */
+    char *path;
+    /** Status of the file when it was read. */
+    struct stat st;
+    /** Item. */
+    void *item;
+    /** Number of callers holding the item. */
+    int refs;
+    /** Non-zero once the file changed, so the item is only kept until the
+        last caller releases it. */
+    int stale;
+    /** Next entry in the cache. */
+    struct entry *next;
+} entry_t;
+
+struct filecache {
+    /** Callback freeing items. */
+    filecache_free_func_t free_item;
+    /** Entries, newest first. */
+    entry_t *head;
+    /** Guards the entries. */
+    pthread_mutex_t lock;
+};
+
+filecache_t *filecache_alloc(filecache_free_func_t free_item)
+{
+    filecache_t *cache = (filecache_t*)calloc(1, sizeof(filecache_t));
+
+    /* Check if out of memory. */
+    if (!cache)
+        return 0;
+
+    cache->free_item = free_item;
+    pthread_mutex_init(&cache->lock, 0);
+
+    return cache;
+}
+
+/**
+ * Frees an entry and its item.
+ *
+ * @param cache Cache.
+ * @param entry Entry, no longer in the cache.
+ */
+static void free_entry(filecache_t *cache, entry_t *entry)
+{
+    cache->free_item(entry->item);
+    free(entry->path);
+    free(entry);
+}
+
+void filecache_free(filecache_t *cache)
+{
+    entry_t *entry, *next; /* Current and next entries. */
+
+    /* Detach the entries first; freeing an item releases the items it
+       holds, which must find nothing. */
+    entry = cache->head;
+    cache->head = 0;
+    for (; entry; entry = next) {
+        next = entry->next;
+        free_entry(cache, entry);
+    }
+
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+/**
+ * Checks whether a file has the status it had when read.
+ *
+ * @param a Status when read.
+ * @param b Current status.
+ * @return Non-zero if the file is unchanged.
+ */
+static int same_status(const struct stat *a, const struct stat *b)
+{
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/**
+ * Finds the entry of a file holding the given status, taking a reference
+ * to its item. Entries of the file with another status are marked stale.
+ * Must be called with the cache locked.
+ *
+ * @param cache Cache.
+ * @param path Path of the file.
+ * @param st Current status of the file.
+ * @param unused Receives the stale entries no caller holds, unlinked from
+ *               the cache, to be freed once it is unlocked.
+ * @return Item or null if not cached.
+ */
+static void *find_entry(filecache_t *cache, const char *path, const struct stat *st,
+                        entry_t **unused)
+{
+    entry_t **link = &cache->head; /* Link to current entry. */
+    entry_t *entry; /* Current entry. */
+    void *item = 0; /* Return value. */
+
+    while ((entry = *link) != 0) {
+        if (!entry->stale && strcmp(entry->path, path) == 0) {
+            if (same_status(&entry->st, st)) {
+                ++entry->refs;
+                item = entry->item;
+            } else {
+                entry->stale = 1;
+            }
+        }
+        if (entry->stale && entry->refs == 0) {
+            *link = entry->next;
+            entry->next = *unused;
+            *unused = entry;
+        } else {
+            link = &entry->next;
+        }
+    }
+
+    return item;
+}
+
+/**
+ * Frees entries unlinked from a cache.
+ *
+ * @param cache Cache, unlocked.
+ * @param entry First entry.
+ */
+static void free_unused(filecache_t *cache, entry_t *entry)
+{
+    entry_t *next; /* Next entry. */
+
+    for (; entry; entry = next) {
+        next = entry->next;
+        free_entry(cache, entry);
+    }
+}
+
+void *filecache_get(filecache_t *cache, const char *path, filecache_build_func_t build, void *ctx)
+{
+    struct stat st; /* Status of the file. */
+    entry_t *unused = 0; /* Stale entries to free. */
+    entry_t *entry; /* New entry. */
+    dynstr_t *text; /* Contents of the file. */
+    FILE *fp; /* File. */
+    void *item; /* Return value. */
+
+    /* Read the status before the contents, so a change made in between
+       gives the entry an outdated status rather than outdated contents. */
+    if (stat(path, &st) != 0)
+        return 0;
+
+    /* Look for a current item. */
+    pthread_mutex_lock(&cache->lock);
+    item = find_entry(cache, path, &st, &unused);
+    pthread_mutex_unlock(&cache->lock);
+    free_unused(cache, unused);
+    if (item)
+        return item;
+
+    /* Read the file and build its item. */
+    if ((fp = fopen(path, "r")) == 0)
+        return 0;
+    if ((text = dynstr_alloc(4096)) != 0 && dynstr_append_stream(text, fp) != 0) {
+        dynstr_free(text);
+        text = 0;
+    }
+    fclose(fp);
+    if (!text)
+        return 0;
+    if ((item = build(ctx, path, text)) == 0)
+        return 0;
+
+    /* Allocate its entry. */
+    if ((entry = (entry_t*)calloc(1, sizeof(entry_t))) == 0 ||
+        (entry->path = (char*)malloc(strlen(path) + 1)) == 0) {
+        free(entry);
+        cache->free_item(item);
+        return 0;
+    }
+    strcpy(entry->path, path);
+    entry->st = st;
+    entry->item = item;
+    entry->refs = 1;
+
+    /* Another caller may have built the same file meanwhile, in which case
+       its item is used and ours dropped. */
+    unused = 0;
+    pthread_mutex_lock(&cache->lock);
+    if ((item = find_entry(cache, path, &st, &unused)) == 0) {
+        entry->next = cache->head;
+        cache->head = entry;
+        item = entry->item;
+        entry = 0;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    free_unused(cache, unused);
+    if (entry)
+        free_entry(cache, entry);
+
+    return item;
+}
+
+void filecache_release(filecache_t *cache, void *item)
+{
+    entry_t **link; /* Link to current entry. */
+    entry_t *entry; /* Current entry. */
+
+    pthread_mutex_lock(&cache->lock);
+    for (link = &cache->head; (entry = *link) != 0; link = &entry->next) {
+        if (entry->item == item) {
+            /* Unlink the entry if it is the last reference to a stale
+               item. */
+            if (--entry->refs == 0 && entry->stale)
+                *link = entry->next;
+            else
+                entry = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if (entry)
+        free_entry(cache, entry);
+}
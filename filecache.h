@@ -0,0 +1,79 @@
+/**
+ * @file filecache.h
+ * @author Tamir Attias
+ * @brief File cache declarations.
+ * @details A file cache holds an item built from the contents of each file
+ *          asked for, such as an included file after preprocessing, keyed
+ *          by the path of the file and its modification time and size. The
+ *          item is built once and handed to every caller until the file
+ *          changes, when it is built again. Items are reference counted, so
+ *          one replaced while in use stays valid until released. The cache
+ *          may be used by several threads at once.
+ */
+
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+/* Forward declarations. */
+struct dynstr;
+
+/**
+ * Callback building the item of a file.
+ *
+ * @param ctx Context given to filecache_get.
+ * @param path Path of the file.
+ * @param text Contents of the file. The callback takes ownership of it, so
+ *             the item may keep it rather than copy what it needs.
+ * @return Item, or null on failure.
+ */
+typedef void *(*filecache_build_func_t)(void *ctx, const char *path, struct dynstr *text);
+
+/**
+ * Callback freeing an item.
+ */
+typedef void(*filecache_free_func_t)(void *item);
+
+/**
+ * File cache.
+ */
+typedef struct filecache filecache_t;
+
+/**
+ * Allocates an empty file cache.
+ *
+ * @param free_item Callback freeing items.
+ * @return Pointer to the cache or null if out of memory.
+ */
+filecache_t *filecache_alloc(filecache_free_func_t free_item);
+
+/**
+ * Frees a file cache and all its items. No item may be in use.
+ *
+ * @param cache Cache.
+ */
+void filecache_free(filecache_t *cache);
+
+/**
+ * Gets the item of a file, building it if the file isn't cached or changed
+ * since. The build runs without holding the cache, so it may get items of
+ * other files.
+ *
+ * @param cache Cache.
+ * @param path Path of the file.
+ * @param build Callback building the item.
+ * @param ctx Context passed to the callback.
+ * @return Item, which must be released, or null if the file could not be
+ *         read, out of memory, or the build failed.
+ */
+void *filecache_get(filecache_t *cache, const char *path, filecache_build_func_t build, void *ctx);
+
+/**
+ * Releases an item got from a cache. Releasing an item the cache doesn't
+ * hold, as happens while it is freed, does nothing.
+ *
+ * @param cache Cache.
+ * @param item Item.
+ */
+void filecache_release(filecache_t *cache, void *item);
+
+#endif
@@ -10,6 +10,8 @@
 #include "shared.h"
 #include "instset.h"
 #include "symtable.h"
+#include "lines.h"
+#include "hashtable.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,6 +19,11 @@
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+
+/* Number of buckets in the table of macro bodies. */
+#define BODY_TABLE_BUCKET_COUNT 256
 
 /**
  * Node in a linked list of data symbols.
@@ -28,6 +35,54 @@ typedef struct datasym {
     struct datasym *next;
 } datasym_t;
 
+/**
+ * Kinds of symbol events recorded while parsing a chunk.
+ */
+typedef enum {
+    SYMEVENT_CHECK,  /**< Label must not already be defined. */
+    SYMEVENT_CODE,   /**< Define symbol at a code address. */
+    SYMEVENT_DATA,   /**< Define symbol at a data segment address. */
+    SYMEVENT_EXTERN  /**< Define external symbol. */
+} symevent_kind_t;
+
+/**
+ * Symbol definition or duplicate check recorded while parsing a chunk, to be
+ * completed once the chunk's position in the file is known.
+ */
+typedef struct symevent {
+    /** Kind of event. */
+    symevent_kind_t kind;
+    /** Name of checked label. */
+    char name[MAX_LABEL_LENGTH + 1];
+    /** Position of the line in the text. */
+    long order;
+    /** Defined symbol, holding a chunk relative address. */
+    symbol_t *sym;
+    /** Address relative to the beginning of the chunk's segment. */
+    int address;
+    /** Next event in source order. */
+    struct symevent *next;
+} symevent_t;
+
+/**
+ * Macro body, or line when memoizing lines, met in the text, encoded by the
+ * first pass when it was first met.
+ */
+typedef struct body {
+    /** Text of the body where it was first met; a line's without its
+        surrounding whitespace. */
+    const char *text;
+    /** Length of the body. */
+    int len;
+    /** Index of the record of its first line. */
+    int first;
+    /** Number of lines, or -1 if the body can't be replayed because it
+        defines labels, has errors, or its records ran out of memory. */
+    int count;
+    /** Next body with the same hash. */
+    struct body *next;
+} body_t;
+
 /**
  * Internal state for first pass.
  */
@@ -36,6 +91,15 @@ typedef struct {
     int ic;
     /** Current line number. */
     int line_no;
+    /** Path of the included file holding the current line, or null if the
+        source holds it. Kept by the shared state. */
+    const char *file;
+    /** Position of the current line in the text, ordering the definitions
+        of symbols. */
+    long offset;
+    /** Symbol table receiving the symbols; the file's one even when parsing
+        a chunk. */
+    symtable_t *symtable;
     /** Pointer to next character to process. */
     char *line_head;
     /** Last read field. */
@@ -50,6 +114,34 @@ typedef struct {
     int label_len;
     /** Head of linked list of data symbols. */
     datasym_t *data_symbols;
+    /** Shared state, for reporting errors. */
+    shared_t *shared;
+    /** If set, symbol addresses are chunk relative and duplicate labels
+        can't be detected yet, so both are recorded as events. */
+    int deferred;
+    /** Head of recorded symbol events, in source order. */
+    symevent_t *events;
+    /** Next pointer of the last recorded event. */
+    symevent_t **events_tail;
+    /** Next pointer of the last recorded .entry directive. */
+    entryref_t **entryrefs_tail;
+    /** Record of the current line, or null if lines aren't recorded. */
+    linerec_t *rec;
+    /** Records receiving the record of every line, or null. */
+    lines_t *lines;
+    /** Spans of the macro bodies in the text, or null if unknown. */
+    const expansions_t *expansions;
+    /** Index of the next span not yet reached. */
+    int expansion;
+    /** Non-zero to memoize lines along with macro bodies. */
+    int memo;
+    /** Table of the macro bodies and memoized lines met, by hash, or null
+        before the first. */
+    hashtable_t *bodies;
+    /** Records of the lines of the macro bodies and memoized lines. */
+    lines_t *body_lines;
+    /** Number of diagnostics reported. */
+    int diag_count;
 } state_t;
 
 /**
@@ -85,10 +177,9 @@ static void print_error(state_t *st, const char *fmt, ...)
 {
     va_list args;
     va_start(args, fmt);
-    printf("firstpass: error: line %d: ", st->line_no);
-    vprintf(fmt, args);
-    putchar('\n'); /* Newline at end. */
+    report_error(st->shared, "firstpass", st->file, st->line_no, fmt, args);
     va_end(args);
+    ++st->diag_count;
 }
 
 /**
@@ -102,12 +193,192 @@ static void next_field(state_t *st)
 }
 
 /**
- * Processes the first field of a labeled line.
+ * Inserts a symbol at the head of a linked list of data symbols.
+ *
+ * @param head Pointer to head node in list. Will be modified.
+ * @param sym Symbol to insert.
+ */
+static void insert_data_symbol(datasym_t **head, symbol_t *sym)
+{
+    /* Allocate data symbol. */
+    datasym_t *node = malloc(sizeof(datasym_t));
+
+    /* Set symbol. */
+    node->sym = sym;
+
+    /* Make next pointer point to old head and replace head with new node. */
+    node->next = *head;
+    *head = node;
+}
+
+/**
+ * Frees a linked list of data symbols.
+ *
+ * @param head Head node.
+ */
+static void free_data_symbols(datasym_t *head)
+{
+    datasym_t *cur, *next;
+
+    for (cur = head; cur; cur = next) {
+        next = cur->next;
+        free(cur);
+    }
+}
+
+/**
+ * Records a symbol event at the end of the event list.
+ *
+ * @param st Internal state.
+ * @param kind Kind of event.
+ * @param name Name of checked label, or null.
+ * @param sym Defined symbol, or null.
+ * @param address Chunk relative address.
+ * @return Zero on success, non-zero if out of memory.
+ */
+static int record_symevent(state_t *st, symevent_kind_t kind, const char *name, symbol_t *sym, int address)
+{
+    symevent_t *ev = (symevent_t*)malloc(sizeof(symevent_t));
+
+    /* Check if out of memory. */
+    if (!ev) {
+        print_error(st, "out of memory.");
+        return 1;
+    }
+
+    ev->kind = kind;
+    if (name)
+        strcpy(ev->name, name);
+    ev->order = st->offset;
+    ev->sym = sym;
+    ev->address = address;
+    ev->next = 0;
+
+    /* Append to list. */
+    *st->events_tail = ev;
+    st->events_tail = &ev->next;
+
+    return 0;
+}
+
+/**
+ * Frees a list of symbol events.
+ *
+ * @param head Head node.
+ */
+static void free_symevents(symevent_t *head)
+{
+    symevent_t *cur, *next;
+
+    for (cur = head; cur; cur = next) {
+        next = cur->next;
+        free(cur);
+    }
+}
+
+/**
+ * Records a .entry directive for the second pass.
  *
  * @param st Internal state.
  * @param shared Shared state.
+ * @param label Name of referenced symbol, empty if missing.
+ * @return Zero on success, non-zero if out of memory.
+ */
+static int record_entryref(state_t *st, shared_t *shared, const char *label)
+{
+    entryref_t *ref = (entryref_t*)malloc(sizeof(entryref_t));
+
+    /* Check if out of memory. */
+    if (!ref) {
+        print_error(st, "out of memory.");
+        return 1;
+    }
+
+    strcpy(ref->label, label);
+    ref->line_no = st->line_no;
+    ref->file = st->file;
+    if (st->rec)
+        st->rec->entry = lines_add_name(st->lines, label);
+    ref->instruction_index = shared->instruction_count;
+    ref->next = 0;
+
+    /* Append to list. */
+    *st->entryrefs_tail = ref;
+    st->entryrefs_tail = &ref->next;
+
+    return 0;
+}
+
+/**
+ * Sets the address of a symbol.
+ *
+ * @param sym Symbol.
+ * @param address Code address or data segment address.
+ */
+static void set_symbol_address(symbol_t *sym, int address)
+{
+    sym->base_addr = SYMBOL_BASE_ADDR(address);
+    sym->offset = SYMBOL_OFFSET(address);
+}
+
+/**
+ * Defines a symbol. If symbols are deferred, the definition is recorded so
+ * its address can be relocated later.
+ *
+ * @param st Internal state.
+ * @param kind SYMEVENT_CODE, SYMEVENT_DATA or SYMEVENT_EXTERN.
+ * @param name Symbol name.
+ * @param address Code address or data segment address of the symbol.
+ * @return Zero on success, non-zero if out of memory.
+ */
+static int define_symbol(state_t *st, symevent_kind_t kind, const char *name, int address)
+{
+    symbol_t *sym; /* New symbol. */
+
+    if (st->rec) {
+        st->rec->define_kind = kind == SYMEVENT_CODE ? LINE_DEFINE_CODE :
+                               kind == SYMEVENT_DATA ? LINE_DEFINE_DATA : LINE_DEFINE_EXTERN;
+        st->rec->define = lines_add_name(st->lines, name);
+    }
+
+    /* An .extern name too long for a label can never be referenced, so
+       there is no point entering it (nor room in a symbol for it). */
+    if (strlen(name) > MAX_LABEL_LENGTH)
+        return 0;
+
+    /* Enter symbol at the position of the line, other chunks may be doing
+       the same. */
+    if ((sym = symtable_define(st->symtable, name, st->offset)) == 0) {
+        print_error(st, "out of memory.");
+        return 1;
+    }
+
+    if (kind == SYMEVENT_EXTERN) {
+        /* External symbols have address and offset set to zero. */
+        sym->ext = 1;
+        sym->base_addr = 0;
+        sym->offset = 0;
+        return 0;
+    }
+
+    set_symbol_address(sym, address);
+
+    if (st->deferred)
+        return record_symevent(st, kind, 0, sym, address);
+
+    /* Data symbols are relocated after the code segment at the end. */
+    if (kind == SYMEVENT_DATA)
+        insert_data_symbol(&st->data_symbols, sym);
+
+    return 0;
+}
+
+/**
+ * Processes the first field of a labeled line.
+ *
+ * @param st Internal state.
  */
-static int process_label_field(state_t *st, shared_t *shared)
+static int process_label_field(state_t *st)
 {
     const char *head = st->field;
 
@@ -138,47 +409,21 @@ static int process_label_field(state_t *st, shared_t *shared)
     /* Overwrite ':' with a null terminator. */
     st->label[st->label_len - 1] = '\0';
 
-    /* Check if duplicate. */
-    if (symtable_find(shared->symtable, st->label)) {
+    /* Check if duplicate. When deferred, preceding chunks may not have
+       defined their symbols yet, so the check is recorded and done when the
+       chunk is merged. */
+    if (st->deferred) {
+        if (record_symevent(st, SYMEVENT_CHECK, st->label, 0, 0))
+            return 1;
+    } else if (symtable_find(st->symtable, st->label)) {
         print_error(st, "label %s already defined.", st->label);
         return 1;
     }
 
-    return 0;
-}
-
-/**
- * Inserts a symbol at the head of a linked list of data symbols.
- *
- * @param head Pointer to head node in list. Will be modified.
- * @param sym Symbol to insert.
- */
-static void insert_data_symbol(datasym_t **head, symbol_t *sym)
-{
-    /* Allocate data symbol. */
-    datasym_t *node = malloc(sizeof(datasym_t));
-
-    /* Set symbol. */
-    node->sym = sym;
-
-    /* Make next pointer point to old head and replace head with new node. */
-    node->next = *head;
-    *head = node;
-}
-
-/**
- * Frees a linked list of data symbols.
- *
- * @param head Head node.
- */
-static void free_data_symbols(datasym_t *head)
-{
-    datasym_t *cur, *next;
+    if (st->rec)
+        st->rec->check = lines_add_name(st->lines, st->label);
 
-    for (cur = head; cur; cur = next) {
-        next = cur->next;
-        free(cur);
-    }
+    return 0;
 }
 
 /**
@@ -219,15 +464,17 @@ static void update_data_symbols(datasym_t *head, word_t offset)
 static int parse_data_array(const char *input, word_t *data, int max_len)
 {
     char tmpstr[MAX_LINE_LENGTH + 1]; /* Copy of input for tokenization. */
+    char *head = tmpstr; /* Tokenization position. */
     char *tok; /* Current token. */
     word_t nval; /* Integer parsed from current token. */
     int count = 0; /* Tokens read successfully so far. */
     
     /* Make a copy of the input for tokenization. */
     strncpy(tmpstr, input, MAX_LINE_LENGTH);
+    tmpstr[MAX_LINE_LENGTH] = '\0';
 
     /* Begin tokenization. */
-    tok = strtok(tmpstr, ",");
+    tok = next_token(&head, ',');
     while (tok) {
         /* Read integer from token. */
         if (parse_number(tok, &nval) != 0)
@@ -241,7 +488,7 @@ static int parse_data_array(const char *input, word_t *data, int max_len)
         data[count++] = MAKE_DATA_WORD(nval);
 
         /* Get next token. */
-        tok = strtok(NULL, ",");
+        tok = next_token(&head, ',');
     }
     
     return count;
@@ -257,7 +504,6 @@ static int process_data_directive(state_t *st, shared_t *shared)
 {
     char c; /* Current character. */
     int len; /* Number of words read. */
-    symbol_t *sym; /* Symbol. */
 
     /* Skip whitespace. */
     while ((c = *st->line_head++) != '\0' && isspace(c))
@@ -297,15 +543,8 @@ static int process_data_directive(state_t *st, shared_t *shared)
     }
 
     /* Add symbol if labeled. */
-    if (st->labeled) {
-        sym = symtable_new(shared->symtable, st->label);
-        assert(sym);
-        sym->base_addr = SYMBOL_BASE_ADDR(shared->data_seg_len);
-        sym->offset = SYMBOL_OFFSET(shared->data_seg_len);
-
-        /* Insert to linked list of data symbols. */
-        insert_data_symbol(&st->data_symbols, sym);
-    }
+    if (st->labeled && define_symbol(st, SYMEVENT_DATA, st->label, shared->data_seg_len))
+        return 1;
 
     /* Increment data segment size by the amount of words added. */
     shared->data_seg_len += len;
@@ -324,7 +563,6 @@ static int process_string_directive(state_t *st, shared_t *shared)
 {
     char c; /* Last read string directive character. */
     const int addr = shared->data_seg_len; /* Address of string. */
-    symbol_t *sym; /* Symbol. */
 
     /* Skip whitespace. */
     while ((c = *st->line_head++) != '\0' && isspace(c))
@@ -368,15 +606,8 @@ static int process_string_directive(state_t *st, shared_t *shared)
     shared->data_seg[shared->data_seg_len++] = MAKE_DATA_WORD('\0');
 
     /* Add symbol if labeled. */
-    if (st->labeled) {
-        sym = symtable_new(shared->symtable, st->label);
-        assert(sym);
-        sym->base_addr = SYMBOL_BASE_ADDR(addr);
-        sym->offset = SYMBOL_OFFSET(addr);
-
-        /* Insert to linked list of data symbols. */
-        insert_data_symbol(&st->data_symbols, sym);
-    }
+    if (st->labeled && define_symbol(st, SYMEVENT_DATA, st->label, addr))
+        return 1;
 
     return 0;
 }
@@ -523,7 +754,7 @@ static int process_operands(state_t *st, operand_t ops[])
     int parse_result; /* Result returned from parse_operand. */
 
     /* First token. */
-    tok = strtok(st->line_head, ",");
+    tok = next_token(&st->line_head, ',');
 
     while (tok) {
         /* Check if too many operands. */
@@ -540,7 +771,7 @@ static int process_operands(state_t *st, operand_t ops[])
             return -1;
 
         /* See if there is another token. */
-        tok = strtok(NULL, ",");
+        tok = next_token(&st->line_head, ',');
 
         if (parse_result == PARSE_OPERAND_EMPTY) {
             /* If there is another operand but this one was empty then this is
@@ -651,7 +882,6 @@ static int process_instruction(state_t *st, shared_t *shared)
     const inst_desc_t *desc; /* Instruction code. */
     operand_t ops[MAX_OPERANDS]; /* Operands. */
     int nops; /* Number of operands. */
-    symbol_t *sym; /* Symbol. */
     inst_data_t *data; /* Pointer to data object in shared state for use by second pass. */
     int i; /* Counter. */
     int src_reg, dst_reg; /* Source and destination register numbers for encoding second instruction. */
@@ -684,8 +914,10 @@ static int process_instruction(state_t *st, shared_t *shared)
     /* Get data pointer and increment instruction count. */
     data = &shared->instructions[shared->instruction_count++];
     
-    /* Store number of operands. */
+    /* Store number of operands and line number. */
     data->num_operands = desc->noperands;
+    data->line_no = st->line_no;
+    data->file = st->file;
 
     /* Store instruction address before incrementing IC. */
     data->address = st->ic;
@@ -790,13 +1022,60 @@ static int process_instruction(state_t *st, shared_t *shared)
                 return 1; /* No room in code segment. */
     }
 
-    if (st->labeled) {
-        /* Make a symbol for the instruction. */
-        sym = symtable_new(shared->symtable, st->label);
-        assert(sym);
-        sym->base_addr = SYMBOL_BASE_ADDR(data->address);
-        sym->offset = SYMBOL_OFFSET(data->address);
-    }
+    /* Make a symbol for the instruction. */
+    if (st->labeled && define_symbol(st, SYMEVENT_CODE, st->label, data->address))
+        return 1;
+
+    return 0;
+}
+
+/**
+ * Checks if a line of a text is a line marker.
+ *
+ * @param text Start of the line.
+ * @return Non-zero if the line is a marker.
+ */
+static int is_marker(const char *text)
+{
+    while (*text == ' ' || *text == '\t')
+        ++text;
+
+    return text[0] == ';' && text[1] == '#';
+}
+
+/**
+ * Reads a line marker inserted by the preprocessor: the number of the line
+ * preceding the next one and, if the next line is in an included file, the
+ * path of the file. The path may be longer than a line, so the marker is
+ * read from the text rather than a line buffer.
+ *
+ * @param st Internal state, receiving the line number and file.
+ * @param text Start of the marker line.
+ * @return Zero if the marker was read, non-zero if it holds no number, in
+ *         which case it is a mere comment.
+ */
+static int read_marker(state_t *st, const char *text)
+{
+    const char *path, *end; /* Start and end of the path. */
+    char *num_end; /* End of the line number. */
+    long line_no; /* Line number. */
+
+    while (*text == ' ' || *text == '\t')
+        ++text;
+    line_no = strtol(text + 2, &num_end, 10);
+    if (num_end == text + 2)
+        return 1;
+
+    /* The path runs to the end of the line. */
+    for (path = num_end; *path == ' ' || *path == '\t'; ++path)
+        ;
+    for (end = path; *end != '\0' && *end != '\n'; ++end)
+        ;
+    while (end > path && isspace((unsigned char)end[-1]))
+        --end;
+
+    st->line_no = (int)line_no;
+    st->file = end > path ? shared_file(st->shared, path, end - path) : 0;
 
     return 0;
 }
@@ -806,12 +1085,12 @@ static int process_instruction(state_t *st, shared_t *shared)
  *
  * @param st Internal state.
  * @param shared Shared state.
+ * @param start Start of the line in the text.
  * @param line Line to process.
  * @return Zero on success, non-zero on failure.
  */
-static int process_line(state_t *st, shared_t *shared, char *line)
+static int process_line(state_t *st, shared_t *shared, const char *start, char *line)
 {
-    symbol_t *sym;
 
     /* Increment line counter. */
     ++st->line_no;
@@ -830,7 +1109,8 @@ static int process_line(state_t *st, shared_t *shared, char *line)
         /* Check if line number reset generated by preprocessor. */
         if (st->field[1] == '#') {
             /* Reset line number to value after pound sign. */
-            sscanf(st->field + 2, "%d", &st->line_no);
+            if (read_marker(st, start) == 0 && st->rec)
+                st->rec->marker = st->line_no;
         }
         return 0; /* Skip comment line. */
     }
@@ -838,7 +1118,7 @@ static int process_line(state_t *st, shared_t *shared, char *line)
     /* Check if first field is a label. */
     if (st->field[st->field_len - 1] == ':') {
         /* Try to read as label. */
-        if (process_label_field(st, shared) != 0)
+        if (process_label_field(st) != 0)
             return 1;
 
         /* Labeled. */
@@ -868,15 +1148,15 @@ static int process_line(state_t *st, shared_t *shared, char *line)
                 return 1;
             }
 
-            /* Insert a symbol with external flag  and address and offset
-            set to zero. */
-            sym = symtable_new(shared->symtable, st->field);
-            assert(sym);
-            sym->ext = 1;
-            sym->base_addr = 0;
-            sym->offset = 0;
+            /* Insert a symbol with external flag. */
+            if (define_symbol(st, SYMEVENT_EXTERN, st->field, 0))
+                return 1;
         } else if (strcmp(st->field + 1, "entry") == 0) {
-            /* Entry directives ignored in first pass. */
+            /* Entry directives are resolved by the second pass once all
+               symbols are known; record the referenced symbol for it. */
+            next_field(st);
+            if (record_entryref(st, shared, st->field))
+                return 1;
         }  else {
             /* Unknown directive. */
             print_error(st, "unrecognized directive %s", st->field + 1);
@@ -889,47 +1169,997 @@ static int process_line(state_t *st, shared_t *shared, char *line)
         /* End of line after first field, must be empty label. */
         assert(st->labeled);
 
-        if (st->labeled) {
-            /* Try to allocate a symbol. */
-            sym = symtable_new(shared->symtable, st->label);
-            assert(sym);
-            sym->base_addr = SYMBOL_BASE_ADDR(st->ic);
-            sym->offset = SYMBOL_OFFSET(st->ic);
-        }
+        if (st->labeled && define_symbol(st, SYMEVENT_CODE, st->label, st->ic))
+            return 1;
     }
 
     return 0;
 }
 
-int firstpass(const char *filename, struct shared *shared)
+/**
+ * Processes a line, recording what the first pass made of it.
+ *
+ * @param st Internal state, holding the records.
+ * @param shared Shared state.
+ * @param start Start of the line in the text.
+ * @param end Start of the next line.
+ * @param line Line to process, as read from the text.
+ * @return Zero on success, non-zero on failure. The line is processed even
+ *         if recording it runs out of memory, which sets the records' error
+ *         flag instead.
+ */
+static int record_line(state_t *st, shared_t *shared, const char *start, const char *end, char *line)
+{
+    const int code_len = shared->code_seg_len; /* Code position of the line. */
+    const int data_len = shared->data_seg_len; /* Data position of the line. */
+    const int inst_count = shared->instruction_count; /* Instructions before the line. */
+    const inst_data_t *data; /* Instruction of the line. */
+    int error; /* Return value. */
+    int i; /* Counter. */
+
+    st->rec = lines_add(st->lines, start, end - start);
+    error = process_line(st, shared, start, line);
+    if (!st->rec)
+        return error;
+
+    /* Record the words emitted, code first. */
+    st->rec->code_len = shared->code_seg_len - code_len;
+    st->rec->data_len = shared->data_seg_len - data_len;
+    st->rec->words = lines_add_words(st->lines, shared->code_seg + code_len, st->rec->code_len);
+    lines_add_words(st->lines, shared->data_seg + data_len, st->rec->data_len);
+
+    /* Record the symbols the instruction references. */
+    if (shared->instruction_count > inst_count) {
+        data = &shared->instructions[inst_count];
+        st->rec->num_operands = data->num_operands;
+        for (i = 0; i < data->num_operands; ++i)
+            st->rec->operand_symbols[i] = lines_add_name(st->lines, data->operand_symbols[i]);
+    }
+    st->rec = 0;
+
+    return error;
+}
+
+/**
+ * Replays the record of a line at the current position, as if the line was
+ * processed again.
+ *
+ * @param st Internal state.
+ * @param shared Shared state.
+ * @param lines Records holding the record.
+ * @param rec Record of the line.
+ * @return Zero on success, non-zero if the line conflicts with the ones
+ *         before it (overflow or duplicate label).
+ */
+static int replay_line(state_t *st, shared_t *shared, const lines_t *lines, const linerec_t *rec)
 {
-    FILE *in; /* Input file pointer. */
-    char line[MAX_LINE_LENGTH + 1]; /* Line buffer. */
-    state_t st; /* Internal state. */
-    int error = 0; /* Error flag. */
+    const word_t *words = lines->words + rec->words; /* Emitted words. */
+    inst_data_t *data; /* Replayed instruction. */
+    int i; /* Counter. */
+
+    /* Increment line counter, or reset it and the file from the marker. */
+    ++st->line_no;
+    if (rec->marker >= 0)
+        read_marker(st, lines_string(lines, rec->text));
 
-    /* Try to open input file. */
-    if ((in = fopen(filename, "r")) == 0) {
-        printf("error: firstpass: could not open input file %s.\n", filename);
+    /* The line was valid on its own, but may not be after other lines. */
+    if (rec->check >= 0 && symtable_find(st->symtable, lines_string(lines, rec->check)))
         return 1;
+    if (shared->code_seg_len + rec->code_len > MAX_CODE_SEGMENT_LEN ||
+        shared->data_seg_len + rec->data_len > MAX_DATA_SEGMENT_LEN ||
+        (rec->num_operands >= 0 && shared->instruction_count >= MAX_CODE_SEGMENT_LEN))
+        return 1;
+
+    if (rec->entry >= 0 && record_entryref(st, shared, lines_string(lines, rec->entry)))
+        return 1;
+
+    /* Define the symbol at the line's position. */
+    switch (rec->define_kind) {
+    case LINE_DEFINE_CODE:
+        if (define_symbol(st, SYMEVENT_CODE, lines_string(lines, rec->define), st->ic))
+            return 1;
+        break;
+    case LINE_DEFINE_DATA:
+        if (define_symbol(st, SYMEVENT_DATA, lines_string(lines, rec->define), shared->data_seg_len))
+            return 1;
+        break;
+    case LINE_DEFINE_EXTERN:
+        if (define_symbol(st, SYMEVENT_EXTERN, lines_string(lines, rec->define), 0))
+            return 1;
+        break;
+    case LINE_DEFINE_NONE:
+        break;
     }
 
-    /* Zero initialize internal state. */
-    memset(&st, 0, sizeof(st));
+    /* Add the instruction at the line's address. */
+    if (rec->num_operands >= 0) {
+        data = &shared->instructions[shared->instruction_count++];
+        data->num_operands = rec->num_operands;
+        data->line_no = st->line_no;
+        data->file = st->file;
+        data->address = st->ic;
+        for (i = 0; i < rec->num_operands; ++i)
+            strcpy(data->operand_symbols[i], lines_string(lines, rec->operand_symbols[i]));
+    }
 
-    /* Code segment is loaded at 100 so initialize IC to 100. */
-    st.ic = 100;
+    /* Append the words. */
+    memcpy(shared->code_seg + shared->code_seg_len, words, rec->code_len * sizeof(word_t));
+    memcpy(shared->data_seg + shared->data_seg_len, words + rec->code_len, rec->data_len * sizeof(word_t));
+    shared->code_seg_len += rec->code_len;
+    shared->data_seg_len += rec->data_len;
+    st->ic += rec->code_len;
+
+    return 0;
+}
+
+/**
+ * Finds the start of the next line of a text, where read_line would stop
+ * reading a line into a buffer of MAX_LINE_LENGTH + 1 characters. A line
+ * marker is taken in whole, since the path it holds may be longer.
+ *
+ * @param text Start of a line.
+ * @return Start of the next line.
+ */
+static const char *next_line(const char *text)
+{
+    int size = MAX_LINE_LENGTH + 1; /* Room left in the buffer. */
 
-    /* Process file line by line. */
-    while (fgets(line, sizeof(line), in))
-        error |= process_line(&st, shared, line);
+    if (is_marker(text))
+        size = INT_MAX;
 
-    /* Close input file. */
-    fclose(in);
+    while (--size > 0 && *text != '\0') {
+        if (*text++ == '\n')
+            break;
+    }
 
-    /* Update data symbol addresses and free the list of data symbols. */
-    update_data_symbols(st.data_symbols, st.ic);
-    free_data_symbols(st.data_symbols);
+    return text;
+}
 
-    return error;
+/**
+ * Reads a line of a text into a buffer of MAX_LINE_LENGTH + 1 characters,
+ * moving past it as next_line does.
+ *
+ * @param head Read position, advanced to the next line.
+ * @param line Buffer receiving the line, truncated if it is a longer marker.
+ * @return The buffer, or null at the end of the text.
+ */
+static char *read_text_line(const char **head, char *line)
+{
+    const char *next = next_line(*head); /* Start of next line. */
+
+    if (!read_line(head, line, MAX_LINE_LENGTH + 1))
+        return 0;
+    *head = next;
+
+    return line;
+}
+
+/**
+ * Callback for freeing the macro bodies stored in a hash table.
+ */
+static void free_body(void *item)
+{
+    body_t *body = (body_t*)item;
+    body_t *next; /* Next body with the same hash. */
+
+    for (; body; body = next) {
+        next = body->next;
+        free(body);
+    }
 }
+
+/**
+ * Frees the macro bodies met in a text.
+ *
+ * @param st Internal state.
+ */
+static void free_bodies(state_t *st)
+{
+    if (st->bodies)
+        hashtable_free(st->bodies);
+    if (st->body_lines)
+        lines_free(st->body_lines);
+    st->bodies = 0;
+    st->body_lines = 0;
+}
+
+/**
+ * Finds the length of the macro body starting at the current position,
+ * passing over the spans left behind.
+ *
+ * @param st Internal state.
+ * @param text Current position in the text, at the start of a line.
+ * @param end Position to stop at, or null to run to the end of the text.
+ * @return Length of the body, or zero if no whole body starts here.
+ */
+static int body_at(state_t *st, const char *text, const char *end)
+{
+    const expansion_t *span; /* Next span. */
+
+    if (!st->expansions)
+        return 0;
+
+    /* Spans before the position are gone for good. */
+    while (st->expansion < st->expansions->count &&
+           st->expansions->items[st->expansion].offset < st->offset)
+        ++st->expansion;
+    if (st->expansion == st->expansions->count)
+        return 0;
+
+    /* The body must be made of whole lines within reach. */
+    span = &st->expansions->items[st->expansion];
+    if (span->offset != st->offset || (end && text + span->len > end) ||
+        text[span->len - 1] != '\n')
+        return 0;
+
+    ++st->expansion;
+    return span->len;
+}
+
+/**
+ * Finds a macro body met earlier, or adds it as a body yet to be encoded.
+ *
+ * @param st Internal state.
+ * @param text Text of the body.
+ * @param len Length of the body.
+ * @return Pointer to the body, or null if out of memory.
+ */
+static body_t *find_body(state_t *st, const char *text, int len)
+{
+    char key[16]; /* Hash formatted as a table key. */
+    body_t *head; /* First body with the same hash. */
+    body_t *body; /* Current body. */
+
+    /* Allocate the table along with the first body. */
+    if (!st->bodies) {
+        st->bodies = hashtable_alloc(BODY_TABLE_BUCKET_COUNT, free_body);
+        st->body_lines = lines_alloc();
+        if (!st->bodies || !st->body_lines) {
+            free_bodies(st);
+            return 0;
+        }
+    }
+
+    sprintf(key, "%08lx", fnv1a(FNV1A_BASIS, text, len) & 0xffffffffUL);
+    head = (body_t*)hashtable_find(st->bodies, key);
+    for (body = head; body; body = body->next) {
+        if (body->len == len && memcmp(body->text, text, len) == 0)
+            return body;
+    }
+
+    /* First time it's met. */
+    if ((body = (body_t*)malloc(sizeof(body_t))) == 0)
+        return 0;
+    body->text = text;
+    body->len = len;
+    body->first = -1;
+    body->count = -1;
+    if (head) {
+        /* Keep the table pointing to the same item. */
+        body->next = head->next;
+        head->next = body;
+    } else {
+        body->next = 0;
+        if (hashtable_insert(st->bodies, key, body) != 0) {
+            free(body);
+            return 0;
+        }
+    }
+
+    return body;
+}
+
+/**
+ * Encodes a macro body or line met for the first time, processing its lines
+ * while recording them. The records are kept for replaying the body if it
+ * defines no labels and has no errors, whatever its position.
+ *
+ * @param st Internal state.
+ * @param shared Shared state.
+ * @param body Body.
+ * @param text Text to process, made of whole lines.
+ * @param end End of text.
+ * @return Zero on success, non-zero on failure.
+ */
+static int encode_body(state_t *st, shared_t *shared, body_t *body, const char *text, const char *end)
+{
+    char line[MAX_LINE_LENGTH + 1]; /* Line buffer. */
+    const char *next; /* Start of next line. */
+    const char *head; /* Read position. */
+    lines_t *lines = st->lines; /* Records of the text's lines. */
+    const int diag_count = st->diag_count; /* Diagnostics before the body. */
+    const linerec_t *rec; /* Current record. */
+    int error = 0; /* Error flag. */
+    int i; /* Counter. */
+
+    body->first = st->body_lines->count;
+    st->lines = st->body_lines;
+    while (text < end) {
+        next = next_line(text);
+        head = text;
+        read_line(&head, line, sizeof(line));
+        error |= record_line(st, shared, text, next, line);
+
+        /* Advance position to the next line. */
+        st->offset += next - text;
+        text = next;
+    }
+    st->lines = lines;
+
+    if (error || st->diag_count > diag_count || st->body_lines->error)
+        return error;
+
+    /* Labels would be defined again by each replay. */
+    for (i = body->first; i < st->body_lines->count; ++i) {
+        rec = &st->body_lines->recs[i];
+        if (rec->check >= 0 || rec->define_kind != LINE_DEFINE_NONE)
+            return 0;
+    }
+    body->count = st->body_lines->count - body->first;
+
+    return 0;
+}
+
+/**
+ * Processes a macro body, replaying its records if it was encoded and
+ * encoding it if met for the first time.
+ *
+ * @param st Internal state.
+ * @param shared Shared state.
+ * @param text Text of the body, made of whole lines.
+ * @param len Length of the body.
+ * @param error Set if processing failed.
+ * @return Length of the text processed, the rest of the body being left to
+ *         parse as usual: none if the body can't be replayed, or the lines
+ *         from one that conflicts with the ones before it.
+ */
+static int process_body(state_t *st, shared_t *shared, const char *text, int len, int *error)
+{
+    body_t *body; /* Body. */
+    const linerec_t *rec; /* Current record. */
+    int line_no; /* Line number before the current line. */
+    int done = 0; /* Length of the text processed. */
+    int i; /* Counter. */
+
+    if ((body = find_body(st, text, len)) == 0)
+        return 0;
+
+    /* Met for the first time. */
+    if (body->first < 0) {
+        *error |= encode_body(st, shared, body, text, text + len);
+        return len;
+    }
+
+    for (i = 0; i < body->count; ++i) {
+        rec = &st->body_lines->recs[body->first + i];
+        line_no = st->line_no;
+        if (replay_line(st, shared, st->body_lines, rec) != 0) {
+            /* Parse the line instead, reporting the conflict. */
+            st->line_no = line_no;
+            break;
+        }
+
+        /* Advance position to the next line. */
+        st->offset += rec->text_len;
+        done += rec->text_len;
+    }
+
+    return done;
+}
+
+/**
+ * Processes a line, replaying its record if an identical line was met
+ * before and encoding it if not. Lines are told apart by their text without
+ * surrounding whitespace, which the parse ignores.
+ *
+ * @param st Internal state.
+ * @param shared Shared state.
+ * @param start Start of the line in the text.
+ * @param end Start of the next line.
+ * @param error Set if processing failed.
+ * @return Non-zero if the line was processed, zero if it must be parsed as
+ *         usual.
+ */
+static int process_memo(state_t *st, shared_t *shared, const char *start, const char *end, int *error)
+{
+    const char *key = start; /* Start of line text. */
+    const char *key_end = end; /* End of line text. */
+    body_t *body; /* Memoized line. */
+    int line_no = st->line_no; /* Line number before the line. */
+
+    /* Blank and comment lines take no parsing. */
+    while (key < key_end && isspace((unsigned char)*key))
+        ++key;
+    while (key_end > key && isspace((unsigned char)key_end[-1]))
+        --key_end;
+    if (key == key_end || *key == ';')
+        return 0;
+
+    ++shared->memo_lines;
+    if ((body = find_body(st, key, key_end - key)) == 0)
+        return 0;
+
+    /* Met for the first time. */
+    if (body->first < 0) {
+        *error |= encode_body(st, shared, body, start, end);
+        return 1;
+    }
+
+    /* Parse the line instead if it conflicts with the ones before it. */
+    if (body->count != 1 ||
+        replay_line(st, shared, st->body_lines, &st->body_lines->recs[body->first]) != 0) {
+        st->line_no = line_no;
+        return 0;
+    }
+
+    st->offset += end - start;
+    ++shared->memo_hits;
+    return 1;
+}
+
+/**
+ * State of a first pass fed with text piece by piece.
+ */
+struct firstpass {
+    /** Internal state. */
+    state_t st;
+    /** Error flag. */
+    int error;
+};
+
+/**
+ * Initializes internal state for processing a text from its start.
+ *
+ * @param st Internal state.
+ * @param shared Shared state.
+ */
+static void init_state(state_t *st, shared_t *shared)
+{
+    /* Zero initialize internal state. */
+    memset(st, 0, sizeof(*st));
+    st->shared = shared;
+    st->symtable = shared->symtable;
+    st->entryrefs_tail = &shared->entryrefs;
+    st->expansions = &shared->expansions;
+    st->memo = shared->memo;
+
+    /* Code segment is loaded at 100 so initialize IC to 100. */
+    st->ic = 100;
+}
+
+/**
+ * Processes the lines of a text.
+ *
+ * @param st Internal state.
+ * @param shared Shared state.
+ * @param text Text made of whole lines.
+ * @param end Position to stop at, at the start of a line, or null to run to
+ *            the end of the text.
+ * @return Zero on success, non-zero on failure.
+ */
+static int process_text(state_t *st, shared_t *shared, const char *text, const char *end)
+{
+    char line[MAX_LINE_LENGTH + 1]; /* Line buffer. */
+    const char *start = text; /* Start of current line. */
+    int error = 0; /* Error flag. */
+    int len; /* Length of a macro body. */
+
+    /* Process text line by line, unless told to stop. */
+    while (!end || text < end) {
+        if (shared->stop) {
+            error = 1;
+            break;
+        }
+
+        /* Take a macro body in one go when its encoding can be replayed. */
+        if ((len = body_at(st, text, end)) > 0) {
+            text += process_body(st, shared, text, len, &error);
+            start = text;
+            continue;
+        }
+
+        if (!read_text_line(&text, line))
+            break;
+
+        /* Replay the line if an identical one was met before. */
+        if (st->memo && process_memo(st, shared, start, text, &error)) {
+            start = text;
+            continue;
+        }
+
+        error |= process_line(st, shared, start, line);
+
+        /* Advance position to the next line. */
+        st->offset += text - start;
+        start = text;
+    }
+
+    return error;
+}
+
+/**
+ * Completes the first pass once all text was processed.
+ *
+ * @param st Internal state.
+ */
+static void finish_state(state_t *st)
+{
+    /* Update data symbol addresses and free the list of data symbols. */
+    update_data_symbols(st->data_symbols, st->ic);
+    free_data_symbols(st->data_symbols);
+    st->data_symbols = 0;
+
+    free_bodies(st);
+}
+
+/**
+ * Runs the first pass over a text on the calling thread.
+ *
+ * @param text Null terminated macro expanded source.
+ * @param shared Shared state.
+ * @return Zero on success, non-zero on failure.
+ */
+static int firstpass_serial(const char *text, shared_t *shared)
+{
+    state_t st; /* Internal state. */
+    int error; /* Error flag. */
+
+    init_state(&st, shared);
+    error = process_text(&st, shared, text, 0);
+    finish_state(&st);
+
+    return error;
+}
+
+/**
+ * Finds the line number the first pass would have reached at a position in
+ * a text, by looking back for the nearest line marker.
+ *
+ * @param text Null terminated macro expanded source.
+ * @param pos Start of a line in the text.
+ * @param marker Set to the start of the marker found, which names the file
+ *               holding the line, or null if there is none.
+ * @return Line number of the line preceding the position.
+ */
+static int line_no_at(const char *text, const char *pos, const char **marker)
+{
+    const char *num; /* Start of the marker's line number. */
+    char *num_end; /* End of the line number. */
+    int count = 0; /* Number of lines between the marker and the position. */
+    long line_no; /* Line number held by the marker. */
+
+    *marker = 0;
+    while (pos > text) {
+        /* Move to start of previous line. */
+        for (--pos; pos > text && pos[-1] != '\n'; --pos)
+            ;
+
+        /* Check for a marker, the way read_marker does. */
+        if (is_marker(pos)) {
+            for (num = pos; *num != ';'; ++num)
+                ;
+            line_no = strtol(num + 2, &num_end, 10);
+            if (num_end != num + 2) {
+                *marker = pos;
+                return (int)line_no + count;
+            }
+        }
+
+        ++count;
+    }
+
+    /* No marker, count from the start. */
+    return count;
+}
+
+firstpass_t *firstpass_begin(struct shared *shared)
+{
+    firstpass_t *fp = (firstpass_t*)malloc(sizeof(firstpass_t));
+
+    /* Check if out of memory. */
+    if (!fp)
+        return 0;
+
+    init_state(&fp->st, shared);
+    fp->error = 0;
+
+    return fp;
+}
+
+void firstpass_feed(firstpass_t *fp, const char *text)
+{
+    fp->error |= process_text(&fp->st, fp->st.shared, text, 0);
+
+    /* Memoized lines point into the text, which goes away. */
+    free_bodies(&fp->st);
+}
+
+int firstpass_end(firstpass_t *fp)
+{
+    int error = fp->error; /* Return value. */
+
+    finish_state(&fp->st);
+    free(fp);
+
+    return error;
+}
+
+/**
+ * A range of the source parsed independently by the parallel first pass.
+ */
+typedef struct {
+    /** First character of the chunk. */
+    const char *begin;
+    /** One past the last character of the chunk, just after a newline. */
+    const char *end;
+    /** Number of the line preceding the chunk. */
+    int line_no;
+    /** Nearest line marker before the chunk, naming the file holding its
+        first line, or null. */
+    const char *marker;
+    /** Position of the chunk in the text. */
+    long offset;
+    /** Symbol table of the file, shared by all chunks. */
+    symtable_t *symtable;
+    /** Spans of the macro bodies in the file's text. */
+    const expansions_t *expansions;
+    /** Segments and instructions, with addresses as if the chunk started the
+        file. */
+    shared_t *local;
+    /** Parsing state, holding the recorded symbol events. */
+    state_t st;
+    /** Number of diagnostics reported while parsing. */
+    int diag_count;
+    /** Non-zero if parsing failed. */
+    int error;
+} chunk_t;
+
+/**
+ * Diagnostics callback counting the diagnostics into an int. Used where any
+ * diagnostic makes the whole file fall back to the serial first pass, which
+ * reports them with correct line numbers and in order.
+ */
+static void count_diag(void *ctx, const char *stage, const char *file, int line,
+                       const char *message)
+{
+    (void)stage;
+    (void)file;
+    (void)line;
+    (void)message;
+    ++*(int*)ctx;
+}
+
+/**
+ * Parses a chunk. Thread entry point.
+ *
+ * @param arg Pointer to the chunk.
+ * @return Null pointer.
+ */
+static void *parse_chunk(void *arg)
+{
+    chunk_t *chunk = (chunk_t*)arg;
+
+    /* Chunk relative addresses start where the file's would; line numbers
+       and positions are absolute. Symbols go straight to the file's table,
+       concurrently with the other chunks. */
+    init_state(&chunk->st, chunk->local);
+    if (chunk->marker)
+        read_marker(&chunk->st, chunk->marker);
+    chunk->st.line_no = chunk->line_no;
+    chunk->st.offset = chunk->offset;
+    chunk->st.symtable = chunk->symtable;
+    chunk->st.expansions = chunk->expansions;
+    chunk->st.deferred = 1;
+    chunk->st.events_tail = &chunk->st.events;
+
+    /* Lines never straddle the chunk's end since it follows a newline. */
+    chunk->error = process_text(&chunk->st, chunk->local, chunk->begin, chunk->end);
+    free_bodies(&chunk->st);
+
+    return 0;
+}
+
+/**
+ * Appends a parsed chunk to the shared state. The chunk's position in the
+ * file is given by the running lengths of the segments (a prefix sum of the
+ * preceding chunks' lengths), which relocates its instructions and symbols.
+ * Must be called once all chunks were parsed, so that every definition is in
+ * the symbol table when duplicate labels are checked.
+ *
+ * @param st State holding the file's data symbols.
+ * @param shared Shared state.
+ * @param chunk Parsed chunk.
+ * @return Zero on success, non-zero if the chunk conflicts with the
+ *         preceding ones (overflow or duplicate label).
+ */
+static int merge_chunk(state_t *st, shared_t *shared, chunk_t *chunk)
+{
+    shared_t *local = chunk->local; /* Chunk's segments. */
+    const int code_offset = shared->code_seg_len; /* Chunk's code position. */
+    const int data_offset = shared->data_seg_len; /* Chunk's data position. */
+    const int inst_offset = shared->instruction_count; /* Chunk's first instruction. */
+    const symevent_t *ev; /* Current symbol event. */
+    entryref_t *ref; /* Current entry directive. */
+    inst_data_t *data; /* Relocated instruction. */
+    int i; /* Counter. */
+
+    /* Check if the segments would overflow. */
+    if (code_offset + local->code_seg_len > MAX_CODE_SEGMENT_LEN ||
+        data_offset + local->data_seg_len > MAX_DATA_SEGMENT_LEN ||
+        shared->instruction_count + local->instruction_count > MAX_CODE_SEGMENT_LEN)
+        return 1;
+
+    /* Append segments. */
+    memcpy(shared->code_seg + code_offset, local->code_seg, local->code_seg_len * sizeof(word_t));
+    memcpy(shared->data_seg + data_offset, local->data_seg, local->data_seg_len * sizeof(word_t));
+    shared->code_seg_len += local->code_seg_len;
+    shared->data_seg_len += local->data_seg_len;
+
+    /* Append instructions at their absolute addresses. The paths of the
+       files holding them are kept by the chunk, which goes away. */
+    for (i = 0; i < local->instruction_count; ++i) {
+        data = &shared->instructions[shared->instruction_count++];
+        *data = local->instructions[i];
+        data->address += code_offset;
+        if (data->file)
+            data->file = shared_file(shared, data->file, strlen(data->file));
+    }
+
+    /* Move entry directives over, counting the preceding instructions. */
+    for (ref = local->entryrefs; ref; ref = ref->next) {
+        ref->instruction_index += inst_offset;
+        if (ref->file)
+            ref->file = shared_file(shared, ref->file, strlen(ref->file));
+        *st->entryrefs_tail = ref;
+        st->entryrefs_tail = &ref->next;
+    }
+    local->entryrefs = 0;
+
+    /* Check labels and relocate symbols. A label is a duplicate if any
+       chunk defined the name at an earlier position, whichever thread got
+       there first. */
+    for (ev = chunk->st.events; ev; ev = ev->next) {
+        switch (ev->kind) {
+        case SYMEVENT_CHECK:
+            if (symtable_defined_before(shared->symtable, ev->name, ev->order))
+                return 1; /* Duplicate label. */
+            break;
+        case SYMEVENT_CODE:
+            set_symbol_address(ev->sym, ev->address + code_offset);
+            break;
+        case SYMEVENT_DATA:
+            set_symbol_address(ev->sym, ev->address + data_offset);
+            insert_data_symbol(&st->data_symbols, ev->sym);
+            break;
+        case SYMEVENT_EXTERN:
+            break; /* Never recorded, external symbols have no address. */
+        }
+    }
+
+    /* Advance instruction counter past the chunk. */
+    st->ic += local->code_seg_len;
+
+    shared->memo_hits += local->memo_hits;
+    shared->memo_lines += local->memo_lines;
+
+    return 0;
+}
+
+/**
+ * Runs the first pass over a text on several threads. The text is split into
+ * chunks at line boundaries which are parsed concurrently, each into its own
+ * segments, and then merged in order.
+ *
+ * @param text Null terminated macro expanded source.
+ * @param shared Shared state. Left untouched if the text is not split, and
+ *               reset if merging fails.
+ * @return Zero on success, positive if the serial first pass must be run
+ *         instead (text too small, errors in the source, out of memory),
+ *         negative if a partial merge couldn't be undone, which fails the
+ *         pass.
+ */
+static int firstpass_parallel(const char *text, shared_t *shared)
+{
+    chunk_t chunks[MAX_THREADS]; /* Chunks. */
+    pthread_t threads[MAX_THREADS]; /* Thread parsing each chunk. */
+    int started[MAX_THREADS]; /* Was a thread started for the chunk? */
+    const int len = strlen(text); /* Length of text. */
+    const char *begin = text; /* Beginning of next chunk. */
+    int nchunks; /* Number of chunks. */
+    int error = 0; /* Return value. */
+    state_t st; /* Merge state. */
+    int i; /* Counter. */
+
+    /* Decide on the number of chunks. */
+    nchunks = len / MIN_CHUNK_SIZE;
+    if (nchunks > shared->threads)
+        nchunks = shared->threads;
+    if (nchunks > MAX_THREADS)
+        nchunks = MAX_THREADS;
+    if (nchunks < 2)
+        return 1;
+
+    /* Split the text into chunks of roughly equal size ending after a
+       newline. */
+    memset(chunks, 0, sizeof(chunks));
+    for (i = 0; i < nchunks; ++i) {
+        chunks[i].begin = begin;
+        chunks[i].end = begin + (len - (begin - text)) / (nchunks - i);
+        while (*chunks[i].end != '\0' && chunks[i].end[-1] != '\n')
+            ++chunks[i].end;
+        chunks[i].line_no = line_no_at(text, begin, &chunks[i].marker);
+        chunks[i].offset = begin - text;
+        chunks[i].symtable = shared->symtable;
+        chunks[i].expansions = &shared->expansions;
+        begin = chunks[i].end;
+
+        /* Allocate the chunk's segments. */
+        if ((chunks[i].local = shared_alloc()) == 0) {
+            error = 1;
+            break;
+        }
+        chunks[i].local->diag = count_diag;
+        chunks[i].local->diag_ctx = &chunks[i].diag_count;
+        chunks[i].local->memo = shared->memo;
+    }
+
+    /* Parse the chunks, the first one on this thread. */
+    if (!error) {
+        for (i = 1; i < nchunks; ++i)
+            started[i] = pthread_create(&threads[i], 0, parse_chunk, &chunks[i]) == 0;
+        parse_chunk(&chunks[0]);
+        for (i = 1; i < nchunks; ++i) {
+            if (started[i])
+                pthread_join(threads[i], 0);
+            else
+                parse_chunk(&chunks[i]);
+        }
+    }
+
+    /* Merge chunks in order while all is well. */
+    init_state(&st, shared);
+    for (i = 0; i < nchunks && !error; ++i) {
+        error = chunks[i].error || chunks[i].diag_count > 0 ||
+                merge_chunk(&st, shared, &chunks[i]);
+    }
+
+    /* Relocate data symbols after the code segment. */
+    if (!error)
+        update_data_symbols(st.data_symbols, st.ic);
+    free_data_symbols(st.data_symbols);
+
+    /* Free chunks. */
+    for (i = 0; i < nchunks; ++i) {
+        if (chunks[i].local)
+            shared_free(chunks[i].local);
+        free_symevents(chunks[i].st.events);
+    }
+
+    /* Undo a partial merge. */
+    if (error && shared_reset_passes(shared) != 0)
+        return -1;
+
+    return error;
+}
+
+/**
+ * Checks whether a line of a text is the line of a record.
+ *
+ * @param lines Records.
+ * @param index Index of the record.
+ * @param start Start of the line in the text.
+ * @param end Start of the next line.
+ * @return Non-zero if the texts are the same.
+ */
+static int same_line(const lines_t *lines, int index, const char *start, const char *end)
+{
+    const linerec_t *rec = &lines->recs[index]; /* Record. */
+
+    return rec->text_len == end - start &&
+           memcmp(lines_string(lines, rec->text), start, rec->text_len) == 0;
+}
+
+int firstpass_incremental(const char *text, struct shared *shared, const struct lines *old,
+                          struct lines *lines, int *reused, int *total)
+{
+    char line[MAX_LINE_LENGTH + 1]; /* Line buffer. */
+    const char **starts = 0; /* Start of each line, then the end of the text. */
+    const char **grown; /* Grown array of starts. */
+    const char *head = text; /* Read position. */
+    int count = 0; /* Number of lines. */
+    int capacity = 0; /* Number of starts that fit in the array. */
+    int prefix = 0, suffix = 0; /* Number of unchanged lines at either end. */
+    int limit; /* Number of lines in the shorter of the texts. */
+    diag_func_t diag = shared->diag; /* Diagnostics callback of the file. */
+    void *diag_ctx = shared->diag_ctx; /* Its context. */
+    int diag_count = 0; /* Number of diagnostics. */
+    int copy; /* Copy the replayed records? */
+    state_t st; /* Internal state. */
+    int error = 0; /* Error flag. */
+    int i, j; /* Counters. */
+
+    *reused = 0;
+    lines_clear(lines);
+
+    /* Find the lines, as process_text reads them. */
+    for (;;) {
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            if ((grown = (const char**)realloc((void*)starts, capacity * sizeof(*starts))) == 0) {
+                error = 1;
+                break;
+            }
+            starts = grown;
+        }
+        starts[count] = head;
+        if (*head == '\0')
+            break;
+        head = next_line(head);
+        ++count;
+    }
+    *total = count;
+
+    /* Find the lines that didn't change at the start and end of the text. */
+    if (old && !error) {
+        limit = count < old->count ? count : old->count;
+        while (prefix < limit && same_line(old, prefix, starts[prefix], starts[prefix + 1]))
+            ++prefix;
+        while (suffix < limit - prefix &&
+               same_line(old, old->count - 1 - suffix, starts[count - 1 - suffix], starts[count - suffix]))
+            ++suffix;
+    }
+
+    /* Replay those and record the others as they are processed. Any
+       diagnostic makes the file fall back to a clean first pass. If all
+       lines are replayed, the earlier records hold for the text as they are
+       and aren't copied. */
+    init_state(&st, shared);
+    st.lines = lines;
+    copy = prefix + suffix < count;
+    shared->diag = count_diag;
+    shared->diag_ctx = &diag_count;
+    for (i = 0; i < count && !error; ++i) {
+        if (i < prefix || i >= count - suffix) {
+            j = i < prefix ? i : old->count - (count - i);
+            error = (copy && lines_copy(lines, old, j)) || replay_line(&st, shared, old, &old->recs[j]);
+            ++*reused;
+        } else {
+            head = starts[i];
+            read_line(&head, line, sizeof(line));
+            error = record_line(&st, shared, starts[i], starts[i + 1], line) || lines->error;
+        }
+
+        /* Advance position to the next line. */
+        st.offset += starts[i + 1] - starts[i];
+    }
+    shared->diag = diag;
+    shared->diag_ctx = diag_ctx;
+    free((void*)starts);
+
+    if (!error && diag_count == 0) {
+        finish_state(&st);
+        return 0;
+    }
+
+    /* Start over, reporting the diagnostics. No records are kept for a file
+       with errors. */
+    free_data_symbols(st.data_symbols);
+    lines->error = 1;
+    *reused = 0;
+    if (shared_reset_passes(shared) != 0)
+        return 1;
+
+    return firstpass_serial(text, shared);
+}
+
+int firstpass(const char *text, struct shared *shared)
+{
+    int error; /* Outcome of the parallel pass. */
+
+    /* Try splitting the work across threads first. The serial pass can't
+       run over what's left of a merge that couldn't be undone. */
+    if (shared->threads > 1 && (error = firstpass_parallel(text, shared)) <= 0)
+        return error != 0;
+
+    return firstpass_serial(text, shared);
+}
\ No newline at end of file
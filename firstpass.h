@@ -9,14 +9,65 @@
 
 /* Forward declarations. */
 struct shared;
+struct lines;
+
+/**
+ * First pass fed with text piece by piece.
+ */
+typedef struct firstpass firstpass_t;
 
 /**
  * Execute first pass of the assembler.
  *
- * @param filename Input file to process.
+ * @param text Null terminated macro expanded source to process.
  * @param shared Shared state.
- * @return Non-zero on success, zero on failure.
+ * @return Zero on success, non-zero on failure.
+ */
+int firstpass(const char *text, struct shared *shared);
+
+/**
+ * Executes the first pass, reusing what an earlier first pass made of the
+ * lines that didn't change since. Lines matching the earlier records at the
+ * start and end of the text are replayed at their new addresses; the others
+ * are processed. Falls back to a clean first pass if any line has
+ * errors or conflicts with the replayed ones. Runs on the calling thread.
+ *
+ * @param text Null terminated macro expanded source to process.
+ * @param shared Shared state.
+ * @param old Records of the earlier first pass, or null.
+ * @param lines Receives the records of the lines of the text, or has its
+ *              error flag set if the text has errors. Left empty if every
+ *              line was replayed, since the earlier records then hold.
+ * @param reused Receives the number of lines replayed.
+ * @param total Receives the number of lines of the text.
+ * @return Zero on success, non-zero on failure.
+ */
+int firstpass_incremental(const char *text, struct shared *shared, const struct lines *old,
+                          struct lines *lines, int *reused, int *total);
+
+/**
+ * Starts a first pass over text that is fed piece by piece, as it becomes
+ * available.
+ *
+ * @param shared Shared state.
+ * @return Pointer to the first pass state or null if out of memory.
+ */
+firstpass_t *firstpass_begin(struct shared *shared);
+
+/**
+ * Processes the next piece of text.
+ *
+ * @param fp First pass state.
+ * @param text Null terminated macro expanded source made of whole lines.
+ */
+void firstpass_feed(firstpass_t *fp, const char *text);
+
+/**
+ * Completes a first pass and frees its state.
+ *
+ * @param fp First pass state.
+ * @return Zero on success, non-zero if any piece failed.
  */
-int firstpass(const char *filename, struct shared *shared);
+int firstpass_end(firstpass_t *fp);
 
 #endif
\ No newline at end of file
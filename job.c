@@ -0,0 +1,1139 @@
+/**
+ * @file job.c
+ * @author Tamir Attias
+ * @brief Assembly job implementation.
+ */
+
+#include "job.h"
+#include "preprocessor.h"
+#include "firstpass.h"
+#include "secondpass.h"
+#include "output.h"
+#include "shared.h"
+#include "dynstr.h"
+#include "diag.h"
+#include "ring.h"
+#include "util.h"
+#include "cache.h"
+#include "lines.h"
+#include "maclib.h"
+#include "filecache.h"
+#include "symtable.h"
+#include "constants.h"
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+
+/**
+ * Number of batches of expanded text that may wait between the preprocessor
+ * and the first pass of a streamed job.
+ */
+#define STREAM_RING_CAPACITY 8
+
+/**
+ * Build cache key of every job. Most options change neither the outputs nor
+ * the messages of a file, so entries are shared by all ways of running the
+ * assembler. The options that do are appended by cache_key: a macro
+ * library's stamp, the format of the messages and the cap on errors, which
+ * --fail-fast sets too.
+ */
+#define JOB_CACHE_KEY "assembler " ASSEMBLER_VERSION
+
+/**
+ * Size of a buffer holding the build cache key of a job.
+ */
+#define JOB_CACHE_KEY_SIZE 96
+
+/**
+ * Extensions of the output files, indexed by job_output_t. Without the dot,
+ * they also name the sections holding the outputs in build cache entries.
+ */
+static const char *const output_exts[JOB_OUTPUTS] = { ".am", ".ob", ".ent", ".ext" };
+
+/**
+ * Preprocessor and first pass of a streamed job, connected by a ring of
+ * expanded text batches.
+ */
+typedef struct {
+    /** Job. */
+    job_t *job;
+    /** Batches on their way from the preprocessor to the first pass. */
+    ring_t *ring;
+    /** First pass fed with the batches. */
+    firstpass_t *fp;
+    /** Macro expanded file receiving the batches, may be null. */
+    FILE *am;
+    /** Preprocessor errors. */
+    diaglist_t *diags;
+    /** Non-zero if preprocessing failed. */
+    int error;
+    /** Time the preprocessor took, in seconds. */
+    double seconds;
+} stream_t;
+
+/**
+ * Reads an entire file into a dynamic string.
+ *
+ * @param filename Path of the file to read.
+ * @return Dynamic string holding the file contents or null on failure.
+ */
+static dynstr_t *read_source_file(const char *filename)
+{
+    FILE *fp; /* Input file pointer. */
+    dynstr_t *str; /* File contents. */
+
+    /* Try to open the file. */
+    if ((fp = fopen(filename, "r")) == 0)
+        return 0;
+
+    /* Read the file. */
+    if ((str = dynstr_alloc(4096)) != 0 && dynstr_append_stream(str, fp) != 0) {
+        dynstr_free(str);
+        str = 0;
+    }
+
+    fclose(fp);
+
+    return str;
+}
+
+/**
+ * Builds the build cache key of a job.
+ *
+ * @param job Job.
+ * @param key Buffer of JOB_CACHE_KEY_SIZE characters receiving the key.
+ * @return The key.
+ */
+static const char *cache_key(const job_t *job, char *key)
+{
+    strcpy(key, JOB_CACHE_KEY);
+    if (job->options.macros) {
+        strcat(key, " macros ");
+        strcat(key, maclib_stamp(job->options.macros));
+    }
+    if (job->options.diag_format == DIAG_FORMAT_JSON)
+        strcat(key, " json");
+    if (job->options.max_errors)
+        sprintf(key + strlen(key), " max-errors %d", job->options.max_errors);
+
+    return key;
+}
+
+/**
+ * Builds the path of an output file of a job.
+ *
+ * @param job Job.
+ * @param output Output file.
+ * @param filename Buffer of FILENAME_MAX characters receiving the path.
+ */
+static void output_path(const job_t *job, job_output_t output, char *filename)
+{
+    /* Set filename to basename with the extension. */
+    strcpy(filename, job->basename);
+    strcat(filename, output_exts[output]);
+}
+
+/**
+ * Adds a message about a job as a whole to its diagnostics.
+ *
+ * @param job Job.
+ * @param severity Severity.
+ * @param stage Name of the stage the message comes from, or null.
+ * @param fmt printf style format string.
+ */
+static void report(job_t *job, diag_severity_t severity, const char *stage, const char *fmt, ...)
+{
+    char message[MAX_DIAG_LENGTH + 1]; /* Formatted message. */
+    va_list args; /* Format arguments. */
+
+    va_start(args, fmt);
+    vsnprintf(message, sizeof(message), fmt, args);
+    va_end(args);
+
+    diagbuf_add(job->diags, severity, stage, 0, 0, message);
+}
+
+/**
+ * Opens an output file of a job for writing, reporting failure.
+ *
+ * @param job Job.
+ * @param output Output file.
+ * @return File pointer or null on failure.
+ */
+static FILE *open_output_file(job_t *job, job_output_t output)
+{
+    char filename[FILENAME_MAX]; /* Output file path. */
+    FILE *fp; /* Output file pointer. */
+
+    output_path(job, output, filename);
+
+    if ((fp = fopen(filename, "w")) == 0) {
+        report(job, DIAG_ERROR, 0, "could not open %s for writing", filename);
+        job->io_error = 1;
+    } else {
+        job->outputs |= 1 << output;
+    }
+
+    return fp;
+}
+
+/**
+ * Closes an output file of a job, noting the bytes written to it and the
+ * time taken to write it.
+ *
+ * @param job Job.
+ * @param output Output file.
+ * @param fp File pointer.
+ * @param started Monotonic time at which writing started, in seconds.
+ * @return Zero on success, non-zero if buffered output could not be written.
+ */
+static int close_output_file(job_t *job, job_output_t output, FILE *fp, double started)
+{
+    long bytes = ftell(fp); /* Bytes written. */
+    int error; /* Return value. */
+
+    error = fclose(fp) != 0;
+    if (bytes > 0)
+        job->stats.bytes += bytes;
+    job->stats.seconds[STATS_WRITE_AM + output] += monotonic_seconds() - started;
+
+    return error;
+}
+
+/**
+ * Counts the lines of a text, the last one counting even if it isn't
+ * terminated by a newline.
+ *
+ * @param text Text.
+ * @param len Length of text.
+ * @return Number of lines.
+ */
+static long count_lines(const char *text, size_t len)
+{
+    const char *end = text + len; /* End of text. */
+    long count = 0; /* Return value. */
+
+    while ((text = memchr(text, '\n', end - text)) != 0) {
+        ++count;
+        ++text;
+    }
+
+    return count + (len > 0 && end[-1] != '\n');
+}
+
+/**
+ * Adds a diagnostic to those of a job, unless the job's cap on errors was
+ * reached, in which case the passes are told to stop. Has the signature of
+ * diag_func_t.
+ *
+ * @param ctx Pointer to the job.
+ * @param stage Name of the stage.
+ * @param file Path of the included file holding the line, or null.
+ * @param line Source line number.
+ * @param message Message to add.
+ */
+static void collect_diag(void *ctx, const char *stage, const char *file, int line,
+                         const char *message)
+{
+    job_t *job = (job_t*)ctx;
+    const int max = job->options.max_errors; /* Cap on errors. */
+
+    if (max && job->errors >= max)
+        return;
+
+    /* A repeat of an error doesn't count. */
+    if (diagbuf_add(job->diags, DIAG_ERROR, stage, file, line, message) != 0)
+        return;
+
+    if (++job->errors == max) {
+        report(job, DIAG_ERROR, 0, "stopping at the error limit (%d).", max);
+        job->shared->stop = 1;
+    }
+}
+
+/**
+ * Reports that an output file of a job could not be written.
+ *
+ * @param job Job.
+ * @param output Output file.
+ * @return Non-zero, for the caller's error.
+ */
+static int report_write_error(job_t *job, job_output_t output)
+{
+    char filename[FILENAME_MAX]; /* Output file path. */
+
+    output_path(job, output, filename);
+    report(job, DIAG_ERROR, 0, "could not write %s", filename);
+    job->io_error = 1;
+
+    return 1;
+}
+
+/**
+ * Writes the object, entries and externals files of an encoded job.
+ *
+ * @param job Job.
+ * @return Zero on success, non-zero on failure.
+ */
+static int write_outputs(job_t *job)
+{
+    shared_t *shared = job->shared; /* Shared assembly state. */
+    FILE *fp; /* Output file pointer. */
+    double started; /* Time at which writing a file started. */
+    int error = 0; /* Return value. */
+
+    if (shared->entrypoints) {
+        /* Write entrypoints to .ent file. */
+        started = monotonic_seconds();
+        if ((fp = open_output_file(job, JOB_OUTPUT_ENT)) == 0)
+            return 1;
+        if ((write_entries_file(fp, shared->entrypoints) |
+             close_output_file(job, JOB_OUTPUT_ENT, fp, started)) != 0)
+            error = report_write_error(job, JOB_OUTPUT_ENT);
+    }
+
+    if (shared->externals) {
+        /* Write externals to .ext file. */
+        started = monotonic_seconds();
+        if ((fp = open_output_file(job, JOB_OUTPUT_EXT)) == 0)
+            return 1;
+        if ((write_externals_file(fp, shared->externals) |
+             close_output_file(job, JOB_OUTPUT_EXT, fp, started)) != 0)
+            error = report_write_error(job, JOB_OUTPUT_EXT);
+    }
+
+    /* Write machine code to object file. */
+    started = monotonic_seconds();
+    if ((fp = open_output_file(job, JOB_OUTPUT_OB)) == 0)
+        return 1;
+    if ((write_object_file(fp, shared) |
+         close_output_file(job, JOB_OUTPUT_OB, fp, started)) != 0)
+        error = report_write_error(job, JOB_OUTPUT_OB);
+
+    return error;
+}
+
+/**
+ * Builds the path of the line records file of a job.
+ *
+ * @param job Job.
+ * @param filename Buffer of FILENAME_MAX characters receiving the path.
+ * @return Zero on success, non-zero if the path is too long.
+ */
+static int lines_path(const job_t *job, char *filename)
+{
+    if (strlen(job->basename) + strlen(LINES_EXT) >= FILENAME_MAX)
+        return 1;
+
+    strcpy(filename, job->basename);
+    strcat(filename, LINES_EXT);
+
+    return 0;
+}
+
+/**
+ * Runs the first pass over the lines that changed since the job's file was
+ * last assembled, replaying the records of the others.
+ *
+ * @param job Job.
+ * @return Zero on success, non-zero on failure.
+ */
+static int incremental_firstpass(job_t *job)
+{
+    char filename[FILENAME_MAX]; /* Line records file path. */
+    lines_t *old; /* Records of the last run. */
+    int error; /* Return value. */
+
+    /* Without records, run a plain first pass. */
+    if (lines_path(job, filename) != 0 || (job->lines = lines_alloc()) == 0)
+        return firstpass(dynstr_pointer(job->expanded), job->shared);
+
+    old = lines_load(filename);
+    error = firstpass_incremental(dynstr_pointer(job->expanded), job->shared, old,
+                                  job->lines, &job->lines_reused, &job->lines_total);
+    if (old)
+        lines_free(old);
+
+    return error;
+}
+
+/**
+ * Assembles the job's expanded source again from scratch and compares the
+ * outputs with the ones assembled incrementally.
+ *
+ * @param job Job, encoded.
+ * @return Zero if the outputs are the same, non-zero if they differ or the
+ *         clean assembly failed.
+ */
+static int verify_incremental(job_t *job)
+{
+    shared_t *clean; /* State of the clean assembly. */
+    diaglist_t *diags; /* Its diagnostics, discarded. */
+    FILE *fp; /* In-memory stream receiving the outputs. */
+    char *outputs[2] = { 0, 0 }; /* Outputs, incremental and clean. */
+    size_t lens[2] = { 0, 0 }; /* Length of outputs. */
+    int error = 1; /* Return value. */
+
+    clean = shared_alloc();
+    diags = diaglist_alloc();
+    if (!clean || !diags)
+        goto done;
+    clean->diag = diaglist_append;
+    clean->diag_ctx = diags;
+    clean->threads = job->options.threads;
+
+    if (firstpass(dynstr_pointer(job->expanded), clean) || secondpass(clean))
+        goto done;
+
+    /* Compare the outputs as a whole, symbols included. */
+    if ((fp = open_memstream(&outputs[0], &lens[0])) == 0)
+        goto done;
+    write_sections(fp, job->shared, 1);
+    fclose(fp);
+    if ((fp = open_memstream(&outputs[1], &lens[1])) == 0)
+        goto done;
+    write_sections(fp, clean, 1);
+    fclose(fp);
+
+    error = lens[0] != lens[1] || memcmp(outputs[0], outputs[1], lens[0]) != 0;
+
+done:
+    free(outputs[0]);
+    free(outputs[1]);
+    if (diags)
+        diaglist_free(diags);
+    if (clean)
+        shared_free(clean);
+
+    return error;
+}
+
+/**
+ * Restores an output file from a build cache entry. The file is only
+ * written if it doesn't hold the cached contents already, so that up to
+ * date files keep their modification times.
+ *
+ * @param job Job.
+ * @param output Output file.
+ * @param section Cached contents of the file.
+ * @return Zero on success, non-zero on failure.
+ */
+static int restore_output(job_t *job, job_output_t output, const cache_section_t *section)
+{
+    char filename[FILENAME_MAX]; /* Output file path. */
+    dynstr_t *existing; /* Current contents of the file. */
+    FILE *fp; /* Output file pointer. */
+    int same; /* Non-zero if the file is up to date. */
+    int error; /* Return value. */
+
+    /* Compare with the current contents. */
+    output_path(job, output, filename);
+    existing = read_source_file(filename);
+    same = existing && (size_t)dynstr_size(existing) == section->len &&
+           memcmp(dynstr_pointer(existing), section->buf, section->len) == 0;
+    if (existing)
+        dynstr_free(existing);
+
+    if (same) {
+        job->outputs |= 1 << output;
+        return 0;
+    }
+
+    if ((fp = open_output_file(job, output)) == 0)
+        return 1;
+    error = fwrite(section->buf, 1, section->len, fp) != section->len;
+    error |= fclose(fp) != 0;
+
+    return error;
+}
+
+/**
+ * Gets the length of the directory part of a job's basename, relative to
+ * which the source includes files.
+ *
+ * @param job Job.
+ * @return Length of the directory, including the last separator, or zero
+ *         if the basename has none.
+ */
+static int source_dir_len(const job_t *job)
+{
+    const char *slash = strrchr(job->basename, '/'); /* Last separator. */
+
+    return slash ? slash - job->basename + 1 : 0;
+}
+
+/**
+ * Checks that the files included by the source of a build cache entry
+ * still hold the contents they had, since entries are keyed by the source
+ * alone. The "includes" section starts with a line holding the directory
+ * of the source, which the paths of the files depend on, followed by the
+ * stamp and path of each file.
+ *
+ * @param job Job.
+ * @param entry Entry.
+ * @return Non-zero if the entry is current, zero if not.
+ */
+static int includes_current(const job_t *job, const cache_entry_t *entry)
+{
+    const cache_section_t *section = cache_find(entry, "includes"); /* Included files. */
+    char path[FILENAME_MAX]; /* Path of included file. */
+    char stamp[HASH_STAMP_LENGTH + 1]; /* Stamp of its current contents. */
+    const char *head, *end, *newline; /* Read position, end and end of line. */
+    dynstr_t *text; /* Current contents of included file. */
+    size_t len; /* Length of line. */
+    int dir_len = source_dir_len(job); /* Length of source directory. */
+
+    if (!section)
+        return 1;
+
+    /* Check the directory. */
+    head = section->buf;
+    end = head + section->len;
+    if ((newline = memchr(head, '\n', end - head)) == 0 || newline - head != dir_len ||
+        memcmp(head, job->basename, dir_len) != 0)
+        return 0;
+
+    /* Check the files. */
+    for (head = newline + 1; head < end; head = newline + 1) {
+        if ((newline = memchr(head, '\n', end - head)) == 0)
+            return 0;
+        len = newline - head;
+        if (len <= HASH_STAMP_LENGTH + 1 || len - HASH_STAMP_LENGTH - 1 >= FILENAME_MAX)
+            return 0;
+        memcpy(path, head + HASH_STAMP_LENGTH + 1, len - HASH_STAMP_LENGTH - 1);
+        path[len - HASH_STAMP_LENGTH - 1] = '\0';
+        if ((text = read_source_file(path)) == 0)
+            return 0;
+        hash_stamp(dynstr_pointer(text), dynstr_size(text), stamp);
+        dynstr_free(text);
+        if (memcmp(stamp, head, HASH_STAMP_LENGTH) != 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Restores the outcome of a job from its build cache entry: the output
+ * files, messages and status.
+ *
+ * @param job Job.
+ */
+static void restore_outcome(job_t *job)
+{
+    const cache_section_t *section; /* Section of the entry. */
+    char text[32]; /* Time taken text. */
+    double seconds; /* Time the job took when it was cached. */
+    int i; /* Counter. */
+
+    /* Replay messages. */
+    if ((section = cache_find(job->hit, "log")) != 0)
+        fwrite(section->buf, 1, section->len, job->log);
+
+    /* Restore the outputs the job produced. */
+    for (i = 0; i < JOB_OUTPUTS; ++i) {
+        if ((section = cache_find(job->hit, output_exts[i] + 1)) != 0 &&
+            restore_output(job, (job_output_t)i, section) != 0)
+            job->error = 1;
+    }
+
+    if ((section = cache_find(job->hit, "status")) != 0 && section->len > 0 &&
+        section->buf[0] != '0')
+        job->error = 1;
+
+    /* Compare with the time taken when the entry was stored. */
+    if ((section = cache_find(job->hit, "seconds")) != 0 && section->len < sizeof(text)) {
+        memcpy(text, section->buf, section->len);
+        text[section->len] = '\0';
+        seconds = atof(text) - (monotonic_seconds() - job->started);
+        if (seconds > 0)
+            job->saved = seconds;
+    }
+}
+
+/**
+ * Stores the outcome of a job in the build cache: the output files as
+ * written, messages, status and the time the job took. Failing to store
+ * it isn't an error; the job just misses again next time.
+ *
+ * @param job Job.
+ */
+static void store_outcome(job_t *job)
+{
+    cache_section_t sections[CACHE_MAX_SECTIONS]; /* Sections of the entry. */
+    dynstr_t *outputs[JOB_OUTPUTS]; /* Contents of the output files. */
+    char filename[FILENAME_MAX]; /* Output file path. */
+    char status[16]; /* Status text. */
+    char seconds[32]; /* Time taken text. */
+    char key[JOB_CACHE_KEY_SIZE]; /* Build cache key. */
+    dynstr_t *includes = 0; /* Files included by the source. */
+    int count = 0; /* Number of sections. */
+    int i; /* Counter. */
+
+    memset(outputs, 0, sizeof(outputs));
+    memset(sections, 0, sizeof(sections));
+
+    /* Messages. */
+    fflush(job->log);
+    strcpy(sections[count].name, "log");
+    sections[count].buf = job->log_buf ? job->log_buf : "";
+    sections[count++].len = job->log_len;
+
+    /* Read the output files back. */
+    for (i = 0; i < JOB_OUTPUTS; ++i) {
+        if (!(job->outputs & (1 << i)))
+            continue;
+        output_path(job, (job_output_t)i, filename);
+        if ((outputs[i] = read_source_file(filename)) == 0)
+            goto done;
+        strcpy(sections[count].name, output_exts[i] + 1);
+        sections[count].buf = dynstr_pointer(outputs[i]);
+        sections[count++].len = dynstr_size(outputs[i]);
+    }
+
+    sprintf(status, "%d", job->error != 0);
+    strcpy(sections[count].name, "status");
+    sections[count].buf = status;
+    sections[count++].len = strlen(status);
+
+    sprintf(seconds, "%f", monotonic_seconds() - job->started);
+    strcpy(sections[count].name, "seconds");
+    sections[count].buf = seconds;
+    sections[count++].len = strlen(seconds);
+
+    /* Files included, which must not change for the entry to apply. */
+    if (job->shared && dynstr_size(job->shared->deps) > 0) {
+        if ((includes = dynstr_alloc(dynstr_size(job->shared->deps) + FILENAME_MAX)) == 0 ||
+            dynstr_append_len(includes, job->basename, source_dir_len(job)) != 0 ||
+            dynstr_append(includes, "\n") != 0 ||
+            dynstr_append_len(includes, dynstr_pointer(job->shared->deps),
+                              dynstr_size(job->shared->deps)) != 0)
+            goto done;
+        strcpy(sections[count].name, "includes");
+        sections[count].buf = dynstr_pointer(includes);
+        sections[count++].len = dynstr_size(includes);
+    }
+
+    cache_store(job->options.cache_dir, cache_key(job, key), dynstr_pointer(job->source),
+                dynstr_size(job->source), sections, count);
+
+done:
+    for (i = 0; i < JOB_OUTPUTS; ++i) {
+        if (outputs[i])
+            dynstr_free(outputs[i]);
+    }
+    if (includes)
+        dynstr_free(includes);
+}
+
+/**
+ * Counts what the passes of a job made, once they are done. The lines of a
+ * streamed job were counted as they passed by.
+ *
+ * @param job Job.
+ */
+static void count_outcome(job_t *job)
+{
+    shared_t *shared = job->shared; /* Shared assembly state. */
+    stats_t *stats = &job->stats; /* Statistics of the job. */
+    external_t *ext; /* Current external reference. */
+    int i, j; /* Counters. */
+
+    if (job->expanded)
+        stats->lines = count_lines(dynstr_pointer(job->expanded), dynstr_size(job->expanded));
+    stats->instructions = shared->instruction_count;
+    stats->code_words = shared->code_seg_len;
+    stats->data_words = shared->data_seg_len;
+    stats->symbols = symtable_count(shared->symtable);
+
+    /* Every operand naming a symbol is resolved by the second pass. */
+    for (i = 0; i < shared->instruction_count; ++i) {
+        for (j = 0; j < shared->instructions[i].num_operands; ++j) {
+            if (shared->instructions[i].operand_symbols[j][0] != '\0')
+                ++stats->fixups;
+        }
+    }
+
+    for (ext = shared->externals; ext; ext = ext->next)
+        ++stats->externals;
+}
+
+/**
+ * Consumes a batch of expanded text: writes it to the .am file and feeds it
+ * to the first pass. Has the signature of preprocess_batch_func_t.
+ *
+ * @param ctx Pointer to the stream.
+ * @param batch Batch of text.
+ */
+static void consume_batch(void *ctx, dynstr_t *batch)
+{
+    stream_t *stream = (stream_t*)ctx;
+    job_t *job = stream->job; /* Job. */
+    double started; /* Time at which writing the batch started. */
+
+    if (stream->am) {
+        started = monotonic_seconds();
+        fwrite(dynstr_pointer(batch), 1, dynstr_size(batch), stream->am);
+        job->stats.seconds[STATS_WRITE_AM] += monotonic_seconds() - started;
+    }
+    if (job->options.stats)
+        job->stats.lines += count_lines(dynstr_pointer(batch), dynstr_size(batch));
+    firstpass_feed(stream->fp, dynstr_pointer(batch));
+    dynstr_free(batch);
+}
+
+/**
+ * Hands a batch of expanded text over to the first pass thread. Has the
+ * signature of preprocess_batch_func_t.
+ *
+ * @param ctx Pointer to the stream.
+ * @param batch Batch of text.
+ */
+static void push_batch(void *ctx, dynstr_t *batch)
+{
+    ring_push(((stream_t*)ctx)->ring, batch);
+}
+
+/**
+ * Preprocesses the source of a streamed job, from the source file through a
+ * window if one was opened, else from the source text.
+ *
+ * @param stream Stream.
+ * @param on_batch Callback receiving the batches.
+ * @return Zero on success, non-zero on failure.
+ */
+static int preprocess_job(stream_t *stream, preprocess_batch_func_t on_batch)
+{
+    job_t *job = stream->job; /* Job. */
+    double started = monotonic_seconds(); /* Time at which preprocessing started. */
+    int error; /* Return value. */
+
+    if (job->input)
+        error = preprocess_file(job->input, job->options.window, on_batch, stream,
+                                job->shared, stream->diags);
+    else
+        error = preprocess_stream(dynstr_pointer(job->source), on_batch, stream, job->shared,
+                                  stream->diags);
+    stream->seconds = monotonic_seconds() - started;
+
+    return error;
+}
+
+/**
+ * Preprocessor thread of a streamed job.
+ *
+ * @param arg Pointer to the stream.
+ * @return Null pointer.
+ */
+static void *preprocess_stage(void *arg)
+{
+    stream_t *stream = (stream_t*)arg;
+
+    stream->error = preprocess_job(stream, push_batch);
+
+    /* No more batches. */
+    ring_close(stream->ring);
+
+    return 0;
+}
+
+/**
+ * Preprocesses a job's source on another thread while running the first
+ * pass on this one, over the expanded text as it is produced. The expanded
+ * text is written to the .am file on the way and never held in whole.
+ *
+ * @param job Job.
+ * @return Zero on success, non-zero on failure.
+ */
+static int stream_passes(job_t *job)
+{
+    shared_t *shared = job->shared; /* Shared assembly state. */
+    diag_func_t diag = shared->diag; /* Diagnostics callback of the job. */
+    void *diag_ctx = shared->diag_ctx; /* Its context. */
+    diaglist_t *diags; /* First pass errors. */
+    stream_t stream; /* Stream state. */
+    pthread_t producer; /* Preprocessor thread. */
+    dynstr_t *batch; /* Batch of expanded text. */
+    double started; /* Time at which the passes started. */
+    int error; /* First pass failure. */
+
+    memset(&stream, 0, sizeof(stream));
+    stream.job = job;
+
+    /* Allocate stream state. */
+    stream.ring = ring_alloc(STREAM_RING_CAPACITY);
+    stream.diags = diaglist_alloc();
+    stream.fp = firstpass_begin(shared);
+    diags = diaglist_alloc();
+    if (!stream.ring || !stream.diags || !stream.fp || !diags) {
+        report(job, DIAG_ERROR, 0, "could not preprocess source file.");
+        if (stream.fp)
+            firstpass_end(stream.fp);
+        error = 1;
+        goto done;
+    }
+
+    /* The .am file is written as the text passes by, unless only checking.
+       Without it the passes still run, to report errors, but no other
+       output is written. */
+    if (!job->options.check && (stream.am = open_output_file(job, JOB_OUTPUT_AM)) == 0)
+        job->error = 1;
+
+    /* Hold first pass errors, so they follow the preprocessor's as if the
+       stages ran one after the other. */
+    shared->diag = diaglist_append;
+    shared->diag_ctx = diags;
+
+    started = monotonic_seconds();
+    if (!job->options.stream_inline &&
+        pthread_create(&producer, 0, preprocess_stage, &stream) == 0) {
+        /* Encode batches as they arrive. */
+        while ((batch = (dynstr_t*)ring_pop(stream.ring)) != 0)
+            consume_batch(&stream, batch);
+        pthread_join(producer, 0);
+    } else {
+        /* No thread; feed the first pass from this one. */
+        stream.error = preprocess_job(&stream, consume_batch);
+    }
+    error = firstpass_end(stream.fp);
+
+    /* The phases overlap, so the first pass is charged with the time it
+       ran alongside the preprocessor, less writing the .am file. */
+    job->stats.seconds[STATS_PREPROCESS] = stream.seconds;
+    job->stats.seconds[STATS_FIRSTPASS] = monotonic_seconds() - started -
+                                          job->stats.seconds[STATS_WRITE_AM];
+
+    /* Report errors. */
+    shared->diag = diag;
+    shared->diag_ctx = diag_ctx;
+    diaglist_flush(stream.diags, diag, diag_ctx);
+    if (stream.error) {
+        report(job, DIAG_ERROR, 0, "could not preprocess source file.");
+    } else {
+        diaglist_flush(diags, diag, diag_ctx);
+        if (error)
+            report(job, DIAG_FATAL, 0, "first pass failed.");
+    }
+    error |= stream.error;
+
+done:
+    if (stream.am)
+        close_output_file(job, JOB_OUTPUT_AM, stream.am, monotonic_seconds());
+    if (diags)
+        diaglist_free(diags);
+    if (stream.diags)
+        diaglist_free(stream.diags);
+    if (stream.ring)
+        ring_free(stream.ring);
+
+    /* The source is no longer needed, unless to key the build cache. */
+    if (job->input) {
+        fclose(job->input);
+        job->input = 0;
+    }
+    if (!job->options.cache_dir && job->source) {
+        dynstr_free(job->source);
+        job->source = 0;
+    }
+
+    return error;
+}
+
+job_t *job_alloc(const char *basename, const job_options_t *options)
+{
+    job_t *job = (job_t*)calloc(1, sizeof(job_t));
+    char as_filename[FILENAME_MAX + 3]; /* Source file path, for messages. */
+
+    /* Check if out of memory. */
+    if (!job)
+        return 0;
+
+    /* Copy basename, truncating if too long; job_load reports it. */
+    strncpy(job->basename, basename, sizeof(job->basename) - 1);
+    if (strlen(basename) >= sizeof(job->basename))
+        job->error = 1;
+
+    job->options = *options;
+    job->started = monotonic_seconds();
+    job->echo = stdout;
+
+    /* Allocate the diagnostics and open the log they are written to. */
+    strcpy(as_filename, job->basename);
+    strcat(as_filename, ".as");
+    if ((job->diags = diagbuf_alloc(as_filename)) == 0 ||
+        (job->log = open_memstream(&job->log_buf, &job->log_len)) == 0) {
+        job_free(job);
+        return 0;
+    }
+
+    return job;
+}
+
+const char *job_output_ext(job_output_t output)
+{
+    return output_exts[output];
+}
+
+void job_configure(struct shared *shared, const job_options_t *options, const char *path)
+{
+    shared->threads = options->threads;
+    shared->memo = options->memo;
+    shared->macros = options->macros;
+    shared->includes = options->includes;
+    shared->path = path;
+}
+
+void job_free(job_t *job)
+{
+    if (job->lines)
+        lines_free(job->lines);
+    if (job->hit) {
+        cache_entry_free(job->hit);
+        free(job->hit);
+    }
+    if (job->shared)
+        shared_free(job->shared);
+    if (job->expanded)
+        dynstr_free(job->expanded);
+    if (job->source)
+        dynstr_free(job->source);
+    if (job->input)
+        fclose(job->input);
+
+    /* Close the log if it wasn't flushed. */
+    if (job->log)
+        fclose(job->log);
+    free(job->log_buf);
+    if (job->diags)
+        diagbuf_free(job->diags);
+
+    free(job);
+}
+
+void job_load(job_t *job)
+{
+    char as_filename[FILENAME_MAX]; /* Source assembly file path (.as). */
+    char key[JOB_CACHE_KEY_SIZE]; /* Build cache key. */
+    double started; /* Time at which preprocessing started. */
+
+    /* Check if filename is too long so we don't overflow the filename
+       arrays. */
+    if (job->error || (strlen(job->basename) + 4) >= FILENAME_MAX) {
+        report(job, DIAG_ERROR, "assemble", "basename %s too long.", job->basename);
+        job->error = 1;
+        job->skipped = 1;
+        return;
+    }
+
+    /* Set input filename to basename with .as extension. */
+    strcpy(as_filename, job->basename);
+    strcat(as_filename, ".as");
+
+    /* Read the source file, or only open it if it is to be read through a
+       window as it is preprocessed. */
+    if (job->options.window && job->options.streamed)
+        job->input = fopen(as_filename, "r");
+    else
+        job->source = read_source_file(as_filename);
+    if (!job->source && !job->input) {
+        report(job, DIAG_ERROR, "preprocess", "couldn't open input file: %s", as_filename);
+        report(job, DIAG_ERROR, 0, "could not preprocess source file.");
+        job->error = 1;
+        job->skipped = 1;
+        return;
+    }
+
+    /* Look the source up in the build cache; on a hit there's nothing left
+       to do until the write stage. */
+    if (job->options.cache_dir && (job->hit = (cache_entry_t*)malloc(sizeof(cache_entry_t))) != 0 &&
+        cache_lookup(job->options.cache_dir, cache_key(job, key), dynstr_pointer(job->source),
+                     dynstr_size(job->source), job->hit) != 0) {
+        free(job->hit);
+        job->hit = 0;
+    }
+
+    /* An entry whose included files changed since is a miss too. */
+    if (job->hit && !includes_current(job, job->hit)) {
+        cache_entry_free(job->hit);
+        free(job->hit);
+        job->hit = 0;
+    }
+    if (job->hit)
+        return;
+
+    /* Allocate shared assembly state, unless given one to reuse. We don't
+       keep this on the stack because the memory segments are quite large. */
+    if (job->shared && shared_reset(job->shared) != 0) {
+        shared_free(job->shared);
+        job->shared = 0;
+    } else if (!job->shared) {
+        job->shared = shared_alloc();
+    }
+
+    /* Report diagnostics to the job's log. */
+    if (job->shared) {
+        job->shared->diag = collect_diag;
+        job->shared->diag_ctx = job;
+        job_configure(job->shared, &job->options, job->basename);
+
+        /* When streaming, preprocessing runs along with the first pass. */
+        if (job->options.streamed && !job->options.incremental) {
+            job->loaded = 1;
+            return;
+        }
+    }
+    job->expanded = job->source ? dynstr_alloc(dynstr_size(job->source)) : 0;
+
+    /* Preprocess. */
+    started = monotonic_seconds();
+    if (!job->shared || !job->expanded ||
+        preprocess(dynstr_pointer(job->source), job->expanded, job->shared)) {
+        report(job, DIAG_ERROR, 0, "could not preprocess source file.");
+        job->error = 1;
+        return;
+    }
+    job->stats.seconds[STATS_PREPROCESS] = monotonic_seconds() - started;
+
+    /* The source is no longer needed, unless to key the build cache. */
+    if (!job->options.cache_dir) {
+        dynstr_free(job->source);
+        job->source = 0;
+    }
+
+    job->loaded = 1;
+}
+
+void job_encode(job_t *job)
+{
+    double started; /* Time at which a pass started. */
+
+    if (!job->loaded)
+        return;
+
+    /* The preprocessor's errors may have reached the cap already. */
+    if (job->shared->stop) {
+        job->error = 1;
+        return;
+    }
+
+    /* Run first pass, alongside preprocessing when streaming. */
+    if (job->options.streamed && !job->options.incremental) {
+        if (stream_passes(job) != 0) {
+            job->error = 1;
+            return;
+        }
+    } else {
+        started = monotonic_seconds();
+        if (job->options.incremental ? incremental_firstpass(job) :
+            firstpass(dynstr_pointer(job->expanded), job->shared)) {
+            report(job, DIAG_FATAL, 0, "first pass failed.");
+            job->error = 1;
+        }
+        job->stats.seconds[STATS_FIRSTPASS] = monotonic_seconds() - started;
+    }
+
+    /* Note how often the first pass memo paid off. */
+    job->memo_lines = job->shared->memo_lines;
+    job->memo_hits = job->shared->memo_hits;
+    if (job->error || job->shared->stop) {
+        job->error = 1;
+        return;
+    }
+
+    /* Run second pass. */
+    started = monotonic_seconds();
+    if (secondpass(job->shared)) {
+        report(job, DIAG_FATAL, 0, "second pass failed.");
+        job->error = 1;
+        return;
+    }
+    job->stats.seconds[STATS_SECONDPASS] = monotonic_seconds() - started;
+
+    /* Check the incremental outputs before they are written. */
+    if (job->options.verify && job->lines && verify_incremental(job) != 0) {
+        report(job, DIAG_ERROR, 0, "incremental reassembly differs from a clean one.");
+        job->error = 1;
+        return;
+    }
+
+    /* A streamed job may have failed to write its .am file. */
+    job->encoded = !job->error;
+}
+
+int job_write(job_t *job)
+{
+    char filename[FILENAME_MAX]; /* Line records file path. */
+    FILE *fp; /* Macro expanded file pointer. */
+    char prefix[FILENAME_MAX + 16]; /* Start of statistics lines. */
+    double started; /* Time at which writing the .am file started. */
+    double seconds; /* Time the job took. */
+
+    if (job->hit) {
+        restore_outcome(job);
+    } else if (job->loaded && job->expanded && !job->options.check) {
+        /* Write the macro expanded source to the .am file. */
+        started = monotonic_seconds();
+        if ((fp = open_output_file(job, JOB_OUTPUT_AM)) != 0) {
+            fwrite(dynstr_pointer(job->expanded), 1, dynstr_size(job->expanded), fp);
+            close_output_file(job, JOB_OUTPUT_AM, fp, started);
+        } else {
+            job->error = 1;
+            job->encoded = 0;
+        }
+    }
+
+    /* Write object, entries and externals files. */
+    if (job->encoded && !job->options.check && write_outputs(job) != 0)
+        job->error = 1;
+
+    /* Keep the line records for the next run, unless every line was
+       replayed from the ones kept. Stale records of a file with errors
+       would only be replayed in vain. */
+    if (job->lines && job->lines_reused < job->lines_total && lines_path(job, filename) == 0) {
+        if (job->lines->error || lines_save(job->lines, filename) != 0)
+            remove(filename);
+    }
+
+    /* Write the messages to the log, after any replayed from the build
+       cache. */
+    diagbuf_write(job->diags, job->options.diag_format, job->log);
+
+    /* Cache the outcome of every file that was read, unless it's incomplete
+       because an output couldn't be written. */
+    if (job->options.cache_dir && !job->hit && job->source && !job->io_error)
+        store_outcome(job);
+
+    /* Follow the messages with the statistics, which are left out of the
+       build cache as they would be stale once replayed. */
+    if (job->options.stats) {
+        if (job->shared && !job->hit)
+            count_outcome(job);
+        job->stats.files = 1;
+        seconds = monotonic_seconds() - job->started;
+        if (job->options.diag_format == DIAG_FORMAT_JSON) {
+            sprintf(prefix, "%s.as", job->basename);
+            stats_write_json(job->log, prefix, &job->stats, seconds);
+            fputc('\n', job->log);
+        } else {
+            sprintf(prefix, "stats: %s.as: ", job->basename);
+            stats_print(job->log, prefix, &job->stats, seconds);
+        }
+    }
+
+    /* Print the messages in one piece. */
+    fclose(job->log);
+    job->log = 0;
+    if (job->echo)
+        fwrite(job->log_buf, 1, job->log_len, job->echo);
+
+    return job->error;
+}
+
+int job_run(job_t *job)
+{
+    job_load(job);
+    job_encode(job);
+    return job_write(job);
+}
@@ -0,0 +1,232 @@
+/**
+ * @file job.h
+ * @author Tamir Attias
+ * @brief Assembly job declarations.
+ * @details A job assembles a single source file. The work is split into
+ *          stages (load, encode, write) so that batch drivers can overlap
+ *          the stages of consecutive files.
+ */
+
+#ifndef JOB_H
+#define JOB_H
+
+#include "diag.h"
+#include "stats.h"
+
+#include <stdio.h> /* for FILE, FILENAME_MAX */
+
+/* Forward declarations. */
+struct dynstr;
+struct shared;
+struct cache_entry;
+struct lines;
+struct maclib;
+struct filecache;
+
+/**
+ * Largest window through which a source may be read, in KiB.
+ */
+#define MAX_WINDOW_KIB (1024 * 1024)
+
+/**
+ * Output files of a job.
+ */
+typedef enum {
+    JOB_OUTPUT_AM, /* Macro expanded source (.am). */
+    JOB_OUTPUT_OB, /* Object file (.ob). */
+    JOB_OUTPUT_ENT, /* Entries file (.ent). */
+    JOB_OUTPUT_EXT, /* Externals file (.ext). */
+    JOB_OUTPUTS /* Number of outputs. */
+} job_output_t;
+
+/**
+ * Options applying to every job of a batch.
+ */
+typedef struct job_options {
+    /** Number of threads a stage may use for a single file. */
+    int threads;
+    /** Non-zero to preprocess each file on a separate thread, feeding the
+        first pass as the expanded text is produced. */
+    int streamed;
+    /** Non-zero to preprocess a streamed file on the thread running its
+        first pass instead, as when no jobserver token is free for a thread
+        of its own. */
+    int stream_inline;
+    /** Build cache directory, or null to always assemble. */
+    const char *cache_dir;
+    /** Non-zero to keep a record of each line of a file next to its
+        outputs, and only process the lines that changed on the next run.
+        Replaces -P, and -t for the first pass. */
+    int incremental;
+    /** Non-zero to check every incremental reassembly against a clean one,
+        failing the file if they differ. */
+    int verify;
+    /** Non-zero to have the first pass parse each distinct line of a file
+        once and replay it where it recurs. */
+    int memo;
+    /** Size in characters of the window through which sources are read,
+        or zero to read each source in whole. Only applies when streamed,
+        and not with a build cache or incrementally. */
+    size_t window;
+    /** Non-zero to only check that files assemble, running every pass but
+        writing no output files. */
+    int check;
+    /** Number of errors after which a file stops being assembled, or zero
+        for no limit. */
+    int max_errors;
+    /** Non-zero to assemble no further files of a batch once one failed. */
+    int fail_fast;
+    /** Format the messages of each file are printed in. */
+    diag_format_t diag_format;
+    /** Non-zero to follow the messages of each file with its statistics,
+        in the same format. */
+    int stats;
+    /** Library of macros expanded unless a file defines its own, or
+        null. */
+    const struct maclib *macros;
+    /** Cache of the files included by sources, shared by every job, or null
+        to read them afresh for each. */
+    struct filecache *includes;
+} job_options_t;
+
+/**
+ * State of a single file being assembled.
+ */
+typedef struct job {
+    /** Path to the source file without extension. */
+    char basename[FILENAME_MAX];
+    /** Options. */
+    job_options_t options;
+    /** Source text. */
+    struct dynstr *source;
+    /** Source file, open until preprocessed, when read through a window
+        rather than into the source text. */
+    FILE *input;
+    /** Macro expanded source text. */
+    struct dynstr *expanded;
+    /** Shared assembly state. May be set by the caller before loading to
+        reuse the state of an earlier job, which is then reset. */
+    struct shared *shared;
+    /** Diagnostics of the job, held until the write stage. */
+    struct diagbuf *diags;
+    /** Stream the diagnostics are written to by job_write, backed by
+        log_buf. */
+    FILE *log;
+    /** Stream the messages are printed to in one piece by job_write, stdout
+        by default. If null, they are left in log_buf. */
+    FILE *echo;
+    /** Buffer backing the log stream. */
+    char *log_buf;
+    /** Length of the log buffer. */
+    size_t log_len;
+    /** Non-zero if the source was preprocessed successfully. */
+    int loaded;
+    /** Non-zero if both passes succeeded. */
+    int encoded;
+    /** Non-zero if any stage failed. */
+    int error;
+    /** Number of errors reported. */
+    int errors;
+    /** Non-zero if the source file could not be read, so the file was not
+        assembled at all. */
+    int skipped;
+    /** Monotonic time at which the job was allocated, in seconds. */
+    double started;
+    /** Bit mask of the output files produced, bit n standing for output n
+        of job_output_t. */
+    int outputs;
+    /** Non-zero if an output file could not be written, in which case the
+        outcome is not cached. */
+    int io_error;
+    /** Build cache entry holding the outcome of the job, if found. */
+    struct cache_entry *hit;
+    /** Time saved by finding the outcome in the build cache, in seconds. */
+    double saved;
+    /** Records of the lines of the source, saved by the write stage when
+        reassembling incrementally. */
+    struct lines *lines;
+    /** Number of lines replayed from the records of the last run. */
+    int lines_reused;
+    /** Number of lines of the macro expanded source. */
+    int lines_total;
+    /** Number of lines the first pass looked up in its memo. */
+    long memo_lines;
+    /** Number of those replayed from the memo. */
+    long memo_hits;
+    /** Time taken by each phase and what it made. Complete once written,
+        and left empty on a build cache hit. */
+    stats_t stats;
+} job_t;
+
+/**
+ * Gets the extension of an output file.
+ *
+ * @param output Output file.
+ * @return Extension, including the dot.
+ */
+const char *job_output_ext(job_output_t output);
+
+/**
+ * Applies the options the passes read to the shared state of a source.
+ *
+ * @param shared Shared assembly state.
+ * @param options Options.
+ * @param path Path of the source file, relative to which included files are
+ *             found, or null if the source isn't a file.
+ */
+void job_configure(struct shared *shared, const job_options_t *options, const char *path);
+
+/**
+ * Allocates a job. Its messages are held in memory and printed in one piece
+ * by job_write, so those of files assembled concurrently don't interleave.
+ *
+ * @param basename Path to the source file without extension.
+ * @param options Options, copied into the job.
+ * @return Pointer to the job or null if out of memory.
+ */
+job_t *job_alloc(const char *basename, const job_options_t *options);
+
+/**
+ * Frees a job.
+ *
+ * @param job Job to free.
+ */
+void job_free(job_t *job);
+
+/**
+ * Load stage: reads the source file and expands macros. Streamed jobs
+ * expand macros in the encode stage. If the outcome of the source is found
+ * in the build cache, nothing is expanded and no pass runs.
+ *
+ * @param job Job.
+ */
+void job_load(job_t *job);
+
+/**
+ * Encode stage: runs both assembly passes. Does nothing if loading failed.
+ * Streamed jobs also expand macros and write the .am file here.
+ *
+ * @param job Job.
+ */
+void job_encode(job_t *job);
+
+/**
+ * Write stage: writes the output files of the completed stages and prints
+ * the messages in the chosen format. On a build cache hit the cached outputs are restored
+ * instead, leaving files that already hold them untouched. Otherwise the
+ * outcome is stored in the cache.
+ *
+ * @param job Job.
+ * @return Zero if every stage succeeded, non-zero on failure.
+ */
+int job_write(job_t *job);
+
+/**
+ * Runs all stages of a job in sequence.
+ *
+ * @param job Job.
+ * @return Zero on success, non-zero on failure.
+ */
+int job_run(job_t *job);
+
+#endif
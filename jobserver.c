@@ -0,0 +1,156 @@
+/**
+ * @file jobserver.c
+ * @author Tamir Attias
+ * @brief GNU make jobserver client implementation.
+ */
+
+#include "jobserver.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+struct jobserver {
+    /** Descriptor tokens are read from. Non-blocking if we could open a
+        private one. */
+    int read_fd;
+    /** Descriptor tokens are returned to. */
+    int write_fd;
+    /** Non-zero if read_fd was opened by us and must be closed. */
+    int own_read_fd;
+    /** Non-zero if write_fd was opened by us and must be closed. */
+    int own_write_fd;
+};
+
+/**
+ * Finds the value of the last jobserver option in MAKEFLAGS.
+ *
+ * @param makeflags Value of MAKEFLAGS.
+ * @param value Buffer receiving the option value.
+ * @param size Size of the value buffer.
+ * @return Zero if found, non-zero otherwise.
+ */
+static int find_auth(const char *makeflags, char *value, int size)
+{
+    static const char *const names[] = {"--jobserver-auth=", "--jobserver-fds="};
+    const char *found = 0; /* Start of last value found. */
+    const char *p; /* Search position. */
+    int i, len; /* Counter, value length. */
+
+    /* Later options override earlier ones. */
+    for (i = 0; i < 2; ++i) {
+        for (p = makeflags; (p = strstr(p, names[i])) != 0; ) {
+            p += strlen(names[i]);
+            if (!found || p > found)
+                found = p;
+        }
+    }
+
+    if (!found)
+        return 1;
+
+    /* Value extends to the next space. */
+    for (len = 0; found[len] != '\0' && found[len] != ' '; ++len)
+        ;
+    if (len >= size)
+        return 1;
+
+    memcpy(value, found, len);
+    value[len] = '\0';
+
+    return 0;
+}
+
+jobserver_t *jobserver_open()
+{
+    const char *makeflags = getenv("MAKEFLAGS"); /* Flags passed by make. */
+    char auth[FILENAME_MAX]; /* Jobserver option value. */
+    char path[64]; /* Path of a private read descriptor. */
+    jobserver_t *js; /* Connection. */
+    int r, w; /* Inherited descriptors. */
+
+    if (!makeflags || find_auth(makeflags, auth, sizeof(auth)) != 0)
+        return 0;
+
+    if ((js = (jobserver_t*)calloc(1, sizeof(jobserver_t))) == 0)
+        return 0;
+
+    if (strncmp(auth, "fifo:", 5) == 0) {
+        /* Named pipe; open our own non-blocking ends. */
+        js->read_fd = open(auth + 5, O_RDONLY | O_NONBLOCK);
+        js->write_fd = js->read_fd >= 0 ? open(auth + 5, O_WRONLY) : -1;
+        js->own_read_fd = js->read_fd >= 0;
+        js->own_write_fd = js->write_fd >= 0;
+    } else if (sscanf(auth, "%d,%d", &r, &w) == 2 &&
+               fcntl(r, F_GETFD) != -1 && fcntl(w, F_GETFD) != -1) {
+        /* Inherited pipe. Setting O_NONBLOCK on it would affect make and
+           every other job sharing it, so try to reopen the read end as a
+           private non-blocking description instead. Reading the shared
+           blocking end could hang once another job takes the token we
+           polled for, so failing that, take no tokens at all and run on
+           the implicit one. */
+        sprintf(path, "/proc/self/fd/%d", r);
+        js->read_fd = open(path, O_RDONLY | O_NONBLOCK);
+        js->own_read_fd = js->read_fd >= 0;
+        js->write_fd = w;
+        return js;
+    } else {
+        /* Descriptors not inherited, e.g. recipe not marked recursive. */
+        js->read_fd = -1;
+    }
+
+    if (js->read_fd < 0 || js->write_fd < 0) {
+        jobserver_close(js);
+        return 0;
+    }
+
+    return js;
+}
+
+void jobserver_close(jobserver_t *js)
+{
+    if (js->own_read_fd)
+        close(js->read_fd);
+    if (js->own_write_fd)
+        close(js->write_fd);
+    free(js);
+}
+
+int jobserver_acquire(jobserver_t *js, int timeout_ms, char *token)
+{
+    struct pollfd pfd; /* Poll request. */
+    ssize_t n; /* Bytes read. */
+
+    /* Check if tokens can't be read without blocking. */
+    if (js->read_fd < 0)
+        return -1;
+
+    pfd.fd = js->read_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    /* Wait for a token to become readable. */
+    if (poll(&pfd, 1, timeout_ms) < 0)
+        return errno == EINTR ? 1 : -1;
+    if (!(pfd.revents & (POLLIN | POLLHUP)))
+        return pfd.revents ? -1 : 1;
+
+    /* Another process may have taken the token in the meantime. */
+    if ((n = read(js->read_fd, token, 1)) == 1)
+        return 0;
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return 1;
+
+    return -1;
+}
+
+void jobserver_release(jobserver_t *js, char token)
+{
+    /* Retry if interrupted; a token must never be lost. */
+    while (write(js->write_fd, &token, 1) < 0 && errno == EINTR)
+        ;
+}
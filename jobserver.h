@@ -0,0 +1,61 @@
+/**
+ * @file jobserver.h
+ * @author Tamir Attias
+ * @brief GNU make jobserver client declarations.
+ * @details When run from a recipe of a parallel make, the jobserver hands
+ *          out tokens that bound the total number of running jobs. Every
+ *          process owns one implicit token; each additional thread of work
+ *          must acquire a token first and return it when done, so that the
+ *          assembler's threads and make's jobs share one CPU budget.
+ */
+
+#ifndef JOBSERVER_H
+#define JOBSERVER_H
+
+/**
+ * Jobserver connection.
+ */
+typedef struct jobserver jobserver_t;
+
+/**
+ * Connects to the jobserver advertised in the MAKEFLAGS environment
+ * variable, if any. Both the descriptor (--jobserver-auth=R,W or
+ * --jobserver-fds=R,W) and the named pipe (--jobserver-auth=fifo:PATH)
+ * styles are supported.
+ *
+ * @return Jobserver connection or null if there is no usable jobserver.
+ *         If the inherited read end can't be reopened for non-blocking
+ *         reads, the connection hands out no tokens, so only the implicit
+ *         one is used.
+ */
+jobserver_t *jobserver_open();
+
+/**
+ * Closes a jobserver connection. All acquired tokens must be released
+ * first.
+ *
+ * @param js Connection to close.
+ */
+void jobserver_close(jobserver_t *js);
+
+/**
+ * Waits a limited time for a token.
+ *
+ * @param js Jobserver connection.
+ * @param timeout_ms Maximum time to wait in milliseconds.
+ * @param token Receives the token, which must be passed back to
+ *              jobserver_release.
+ * @return Zero if a token was acquired, positive if none was available in
+ *         time, negative if the jobserver is no longer usable.
+ */
+int jobserver_acquire(jobserver_t *js, int timeout_ms, char *token);
+
+/**
+ * Returns a token to the jobserver.
+ *
+ * @param js Jobserver connection.
+ * @param token Token received from jobserver_acquire.
+ */
+void jobserver_release(jobserver_t *js, char token);
+
+#endif
@@ -0,0 +1,202 @@
+/**
+ * @file libassembler.c
+ * @author Tamir Attias
+ * @brief Embeddable assembler implementation.
+ */
+
+#include "libassembler.h"
+#include "preprocessor.h"
+#include "firstpass.h"
+#include "secondpass.h"
+#include "shared.h"
+#include "dynstr.h"
+#include "diag.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Copies a memory segment to a newly allocated array of longs.
+ *
+ * @param segment Segment to copy.
+ * @param len Number of words in the segment.
+ * @param out Receives the copy.
+ * @return Zero on success, non-zero if out of memory.
+ */
+static int copy_segment(const word_t *segment, int len, long **out)
+{
+    int i; /* Counter. */
+
+    /* Allocate at least one word so that a null pointer means failure. */
+    if ((*out = (long*)malloc((len > 0 ? len : 1) * sizeof(long))) == 0)
+        return 1;
+
+    for (i = 0; i < len; ++i)
+        (*out)[i] = (long)segment[i];
+
+    return 0;
+}
+
+/**
+ * Copies the entry points and externals lists to the result.
+ *
+ * @param shared Shared state after a successful second pass.
+ * @param res Result to fill.
+ * @return Zero on success, non-zero if out of memory.
+ */
+static int copy_symbols(const shared_t *shared, asm_result_t *res)
+{
+    const entrypoint_t *ep; /* Entry point list traversal. */
+    const external_t *ext; /* Externals list traversal. */
+    int i; /* Counter. */
+
+    /* Count list items. */
+    for (ep = shared->entrypoints; ep; ep = ep->next)
+        ++res->entry_count;
+    for (ext = shared->externals; ext; ext = ext->next)
+        ++res->external_count;
+
+    /* Allocate arrays, at least one item each. */
+    res->entries = (asm_entry_t*)calloc(res->entry_count + 1, sizeof(asm_entry_t));
+    res->externals = (asm_external_t*)calloc(res->external_count + 1, sizeof(asm_external_t));
+    if (!res->entries || !res->externals)
+        return 1;
+
+    /* Copy entry points in list order. */
+    for (ep = shared->entrypoints, i = 0; ep; ep = ep->next, ++i) {
+        strcpy(res->entries[i].label, ep->label);
+        res->entries[i].base_addr = (long)ep->base_addr;
+        res->entries[i].offset = (long)ep->offset;
+    }
+
+    /* Copy externals in list order. */
+    for (ext = shared->externals, i = 0; ext; ext = ext->next, ++i) {
+        strcpy(res->externals[i].symbol, ext->symbol);
+        res->externals[i].base_addr_word_addr = (long)ext->base_addr_word_addr;
+        res->externals[i].offset_word_addr = (long)ext->offset_word_addr;
+    }
+
+    return 0;
+}
+
+/**
+ * Copies recorded diagnostics to the result.
+ *
+ * @param diags Recorded diagnostics.
+ * @param res Result to fill.
+ * @return Zero on success, non-zero if out of memory.
+ */
+static int copy_diags(const diaglist_t *diags, asm_result_t *res)
+{
+    const diag_t *diag; /* Current diagnostic. */
+    int i; /* Counter. */
+
+    res->diag_count = diaglist_size(diags);
+    if ((res->diags = (asm_diag_t*)calloc(res->diag_count + 1, sizeof(asm_diag_t))) == 0)
+        return 1;
+
+    for (i = 0; i < res->diag_count; ++i) {
+        diag = diaglist_get(diags, i);
+        res->diags[i].stage = diag->stage;
+        res->diags[i].line = diag->line;
+        strcpy(res->diags[i].message, diag->message);
+    }
+
+    return 0;
+}
+
+int asm_assemble(const char *source, size_t len, asm_word_func_t on_word, void *ctx, asm_result_t **result)
+{
+    asm_result_t *res; /* Result. */
+    dynstr_t *text = 0; /* Null terminated copy of the source. */
+    dynstr_t *expanded = 0; /* Macro expanded source. */
+    diaglist_t *diags = 0; /* Recorded diagnostics. */
+    shared_t *shared = 0; /* Shared assembly state. */
+    int error = -1; /* Return value. */
+    int i; /* Counter. */
+
+    /* Allocate result and working state. */
+    *result = 0;
+    if ((res = (asm_result_t*)calloc(1, sizeof(asm_result_t))) == 0)
+        return -1;
+    if ((text = dynstr_alloc((int)len)) == 0 ||
+        dynstr_append_len(text, source, (int)len) != 0 ||
+        (expanded = dynstr_alloc((int)len)) == 0 ||
+        (diags = diaglist_alloc()) == 0 ||
+        (shared = shared_alloc()) == 0)
+        goto done;
+
+    /* Record diagnostics instead of printing them. */
+    shared->diag = diaglist_append;
+    shared->diag_ctx = diags;
+
+    /* Sources have no place in the file system to include files from. */
+    shared->no_includes = 1;
+
+    /* Expand macros. The source is to blame if that fails with errors
+       reported, as an include line has, else memory ran out. Then run both
+       passes, stopping if the first one fails. */
+    if (preprocess(dynstr_pointer(text), expanded, shared)) {
+        if (diaglist_size(diags) == 0)
+            goto done;
+        error = 1;
+    } else {
+        error = firstpass(dynstr_pointer(expanded), shared) ||
+                secondpass(shared);
+    }
+
+    if (!error) {
+        /* Copy segments and symbols. */
+        if (copy_segment(shared->code_seg, shared->code_seg_len, &res->code) ||
+            copy_segment(shared->data_seg, shared->data_seg_len, &res->data) ||
+            copy_symbols(shared, res)) {
+            error = -1;
+            goto done;
+        }
+        res->code_len = shared->code_seg_len;
+        res->data_len = shared->data_seg_len;
+
+        /* Stream words to the caller. */
+        if (on_word) {
+            for (i = 0; i < res->code_len; ++i)
+                on_word(ctx, 100 + i, res->code[i]);
+            for (i = 0; i < res->data_len; ++i)
+                on_word(ctx, 100 + res->code_len + i, res->data[i]);
+        }
+    }
+
+    if (copy_diags(diags, res))
+        error = -1;
+
+done:
+    if (shared)
+        shared_free(shared);
+    if (diags)
+        diaglist_free(diags);
+    if (expanded)
+        dynstr_free(expanded);
+    if (text)
+        dynstr_free(text);
+
+    if (error < 0) {
+        asm_result_free(res);
+        return -1;
+    }
+
+    *result = res;
+
+    return error;
+}
+
+void asm_result_free(asm_result_t *result)
+{
+    if (!result)
+        return;
+
+    free(result->code);
+    free(result->data);
+    free(result->entries);
+    free(result->externals);
+    free(result->diags);
+    free(result);
+}
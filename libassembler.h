@@ -0,0 +1,121 @@
+/**
+ * @file libassembler.h
+ * @author Tamir Attias
+ * @brief Embeddable assembler interface.
+ * @details Assembles source text held in memory without touching the file
+ *          system, so sources may not include files. All functions are
+ *          reentrant so several sources may be assembled concurrently from
+ *          different threads.
+ */
+
+#ifndef LIBASSEMBLER_H
+#define LIBASSEMBLER_H
+
+#include <stddef.h> /* for size_t */
+
+/**
+ * Maximum length of a symbol name.
+ */
+#define ASM_MAX_LABEL_LENGTH 31
+
+/**
+ * Maximum length of a diagnostic message.
+ */
+#define ASM_MAX_MESSAGE_LENGTH 255
+
+/**
+ * Callback receiving each assembled word.
+ *
+ * @param ctx User supplied context.
+ * @param address Address of the word in the object file.
+ * @param word Encoded machine word.
+ */
+typedef void(*asm_word_func_t)(void *ctx, int address, long word);
+
+/**
+ * A diagnostic reported while assembling.
+ */
+typedef struct {
+    /** Name of the reporting stage ("preprocess", "firstpass", ...). */
+    const char *stage;
+    /** Source line number. */
+    int line;
+    /** Message. */
+    char message[ASM_MAX_MESSAGE_LENGTH + 1];
+} asm_diag_t;
+
+/**
+ * An entry point (.ent record).
+ */
+typedef struct {
+    /** Symbol name. */
+    char label[ASM_MAX_LABEL_LENGTH + 1];
+    /** Base address. */
+    long base_addr;
+    /** Offset from base address. */
+    long offset;
+} asm_entry_t;
+
+/**
+ * A reference to an external symbol (.ext record).
+ */
+typedef struct {
+    /** Referenced symbol name. */
+    char symbol[ASM_MAX_LABEL_LENGTH + 1];
+    /** Address of the word receiving the symbol's base address. */
+    long base_addr_word_addr;
+    /** Address of the word receiving the symbol's offset. */
+    long offset_word_addr;
+} asm_external_t;
+
+/**
+ * Result of assembling a source.
+ */
+typedef struct {
+    /** Code segment words. The first word is at address 100. */
+    long *code;
+    /** Number of words in the code segment. */
+    int code_len;
+    /** Data segment words. Placed directly after the code segment. */
+    long *data;
+    /** Number of words in the data segment. */
+    int data_len;
+    /** Entry points, in the order they appear in a .ent file. */
+    asm_entry_t *entries;
+    /** Number of entry points. */
+    int entry_count;
+    /** External references, in the order they appear in a .ext file. */
+    asm_external_t *externals;
+    /** Number of external references. */
+    int external_count;
+    /** Diagnostics, in the order they were reported. */
+    asm_diag_t *diags;
+    /** Number of diagnostics. */
+    int diag_count;
+} asm_result_t;
+
+/**
+ * Assembles source text. An .include line is reported as an error, as
+ * the text has no place in the file system to find files from.
+ *
+ * @param source Source text. Need not be null terminated.
+ * @param len Length of the source text in characters.
+ * @param on_word Optional callback receiving every assembled word, code
+ *                segment first, after a successful assembly. May be null.
+ * @param ctx Context passed to the callback.
+ * @param result Receives the result, which must be freed with
+ *               asm_result_free. Segments, entries and externals are only
+ *               filled on success; diagnostics are always filled.
+ * @return Zero on success, positive if the source has errors, negative if
+ *         out of memory (in which case *result is null).
+ */
+int asm_assemble(const char *source, size_t len, asm_word_func_t on_word, void *ctx, asm_result_t **result);
+
+/**
+ * Frees an assembly result.
+ *
+ * @param result Result returned by asm_assemble. May be null.
+ */
+void asm_result_free(asm_result_t *result);
+
+#endif
@@ -0,0 +1,293 @@
+/**
+ * @file lines.c
+ * @author Tamir Attias
+ * @brief Line record implementation.
+ */
+
+#include "lines.h"
+#include "constants.h"
+#include "dynstr.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+lines_t *lines_alloc()
+{
+    lines_t *lines = (lines_t*)calloc(1, sizeof(lines_t));
+
+    /* Check if out of memory. */
+    if (!lines)
+        return 0;
+
+    if ((lines->pool = dynstr_alloc(4096)) == 0) {
+        free(lines);
+        return 0;
+    }
+
+    return lines;
+}
+
+void lines_free(lines_t *lines)
+{
+    dynstr_free(lines->pool);
+    free(lines->words);
+    free(lines->recs);
+    free(lines);
+}
+
+void lines_clear(lines_t *lines)
+{
+    dynstr_clear(lines->pool);
+    lines->count = 0;
+    lines->words_len = 0;
+    lines->error = 0;
+}
+
+linerec_t *lines_add(lines_t *lines, const char *text, int len)
+{
+    linerec_t *rec; /* New record. */
+    int i; /* Counter. */
+
+    /* Make room for one more. */
+    if (lines->count == lines->capacity) {
+        rec = (linerec_t*)realloc(lines->recs, (lines->capacity ? lines->capacity * 2 : 256) * sizeof(linerec_t));
+        if (!rec) {
+            lines->error = 1;
+            return 0;
+        }
+        lines->recs = rec;
+        lines->capacity = lines->capacity ? lines->capacity * 2 : 256;
+    }
+
+    rec = &lines->recs[lines->count];
+    rec->text = dynstr_size(lines->pool);
+    rec->text_len = len;
+    if (dynstr_append_len(lines->pool, text, len) != 0) {
+        lines->error = 1;
+        return 0;
+    }
+
+    /* No effects yet. */
+    rec->marker = -1;
+    rec->words = lines->words_len;
+    rec->code_len = 0;
+    rec->data_len = 0;
+    rec->check = -1;
+    rec->define_kind = LINE_DEFINE_NONE;
+    rec->define = -1;
+    rec->entry = -1;
+    rec->num_operands = -1;
+    for (i = 0; i < MAX_OPERANDS; ++i)
+        rec->operand_symbols[i] = -1;
+
+    ++lines->count;
+
+    return rec;
+}
+
+int lines_add_name(lines_t *lines, const char *name)
+{
+    int offset = dynstr_size(lines->pool); /* Offset of the name. */
+
+    /* Keep the null terminator, so the name can be used in place. */
+    if (dynstr_append_len(lines->pool, name, strlen(name) + 1) != 0) {
+        lines->error = 1;
+        return -1;
+    }
+
+    return offset;
+}
+
+int lines_add_words(lines_t *lines, const word_t *words, int count)
+{
+    int pos = lines->words_len; /* Position of the words. */
+    int capacity; /* Grown capacity. */
+    word_t *grown; /* Grown array. */
+
+    /* Lines making no words may pass no array. */
+    if (count == 0)
+        return pos;
+
+    /* Make room for the words. */
+    if (lines->words_len + count > lines->words_capacity) {
+        capacity = lines->words_capacity ? lines->words_capacity * 2 : 1024;
+        while (capacity < lines->words_len + count)
+            capacity *= 2;
+        if ((grown = (word_t*)realloc(lines->words, capacity * sizeof(word_t))) == 0) {
+            lines->error = 1;
+            return -1;
+        }
+        lines->words = grown;
+        lines->words_capacity = capacity;
+    }
+
+    memcpy(lines->words + pos, words, count * sizeof(word_t));
+    lines->words_len += count;
+
+    return pos;
+}
+
+const char *lines_string(const lines_t *lines, int offset)
+{
+    return dynstr_pointer(lines->pool) + offset;
+}
+
+/**
+ * Copies a name of other records into the pool.
+ *
+ * @param lines Records receiving the name.
+ * @param from Records holding the name.
+ * @param offset Offset of the name in the pool of from, or -1.
+ * @return Offset of the copy, or -1.
+ */
+static int copy_name(lines_t *lines, const lines_t *from, int offset)
+{
+    return offset < 0 ? -1 : lines_add_name(lines, lines_string(from, offset));
+}
+
+int lines_copy(lines_t *lines, const lines_t *from, int index)
+{
+    const linerec_t *src = &from->recs[index]; /* Record to copy. */
+    linerec_t *rec; /* Copy. */
+    int words; /* Position of the copied words. */
+    int i; /* Counter. */
+
+    /* Copy the words before the record, which the record points to. */
+    words = lines_add_words(lines, from->words + src->words, src->code_len + src->data_len);
+    if (words < 0 || (rec = lines_add(lines, lines_string(from, src->text), src->text_len)) == 0)
+        return 1;
+
+    rec->marker = src->marker;
+    rec->words = words;
+    rec->code_len = src->code_len;
+    rec->data_len = src->data_len;
+    rec->define_kind = src->define_kind;
+    rec->num_operands = src->num_operands;
+    rec->check = copy_name(lines, from, src->check);
+    rec->define = copy_name(lines, from, src->define);
+    rec->entry = copy_name(lines, from, src->entry);
+    for (i = 0; i < MAX_OPERANDS; ++i)
+        rec->operand_symbols[i] = copy_name(lines, from, src->operand_symbols[i]);
+
+    return lines->error;
+}
+
+/**
+ * Checks a name of loaded records.
+ *
+ * @param lines Records.
+ * @param offset Offset of the name, or -1.
+ * @param max_len Maximum length of the name.
+ * @return Zero if the name is within the pool and not too long, non-zero
+ *         if not.
+ */
+static int check_name(const lines_t *lines, int offset, int max_len)
+{
+    if (offset == -1)
+        return 0;
+
+    return offset < 0 || offset >= dynstr_size(lines->pool) ||
+           strlen(lines_string(lines, offset)) > (size_t)max_len;
+}
+
+/**
+ * Checks that the offsets held by loaded records are within the pool and
+ * words, so a damaged file can't make them point elsewhere.
+ *
+ * @param lines Records.
+ * @return Zero if the records are sound, non-zero if not.
+ */
+static int check_records(const lines_t *lines)
+{
+    const linerec_t *rec; /* Current record. */
+    int i, j; /* Counters. */
+
+    for (i = 0; i < lines->count; ++i) {
+        rec = &lines->recs[i];
+        if (rec->text < 0 || rec->text_len < 0 || rec->text_len > dynstr_size(lines->pool) - rec->text ||
+            rec->words < 0 || rec->code_len < 0 || rec->data_len < 0 ||
+            rec->code_len > lines->words_len - rec->words ||
+            rec->data_len > lines->words_len - rec->words - rec->code_len ||
+            rec->define_kind < LINE_DEFINE_NONE || rec->define_kind > LINE_DEFINE_EXTERN ||
+            (rec->define_kind != LINE_DEFINE_NONE && rec->define == -1) ||
+            check_name(lines, rec->check, MAX_LABEL_LENGTH) ||
+            check_name(lines, rec->define, MAX_LINE_LENGTH) ||
+            check_name(lines, rec->entry, MAX_LINE_LENGTH) ||
+            rec->num_operands > MAX_OPERANDS)
+            return 1;
+        for (j = 0; j < rec->num_operands; ++j) {
+            if (rec->operand_symbols[j] == -1 ||
+                check_name(lines, rec->operand_symbols[j], MAX_LABEL_LENGTH))
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
+lines_t *lines_load(const char *path)
+{
+    FILE *fp; /* Records file. */
+    lines_t *lines; /* Return value. */
+    char header[128]; /* Header line. */
+    char version[32]; /* Assembler version that wrote the file. */
+    int format; /* Format of file. */
+    int count; /* Number of records. */
+    int pool_len, words_len; /* Length of pool and words. */
+
+    if ((fp = fopen(path, "r")) == 0)
+        return 0;
+
+    /* Check the header. */
+    if (!fgets(header, sizeof(header), fp) ||
+        sscanf(header, "asmlines %d %31s %d %d %d", &format, version, &count, &pool_len, &words_len) != 5 ||
+        format != LINES_FORMAT || strcmp(version, ASSEMBLER_VERSION) != 0 ||
+        count < 0 || pool_len < 0 || words_len < 0 || (lines = lines_alloc()) == 0) {
+        fclose(fp);
+        return 0;
+    }
+
+    /* Read the records and words straight into place, then the pool, which
+       runs to the end of the file. */
+    lines->recs = (linerec_t*)malloc(count * sizeof(linerec_t) + 1);
+    lines->words = (word_t*)malloc(words_len * sizeof(word_t) + 1);
+    if (!lines->recs || !lines->words ||
+        fread(lines->recs, sizeof(linerec_t), count, fp) != (size_t)count ||
+        fread(lines->words, sizeof(word_t), words_len, fp) != (size_t)words_len ||
+        dynstr_append_stream(lines->pool, fp) != 0 || dynstr_size(lines->pool) != pool_len) {
+        fclose(fp);
+        lines_free(lines);
+        return 0;
+    }
+    fclose(fp);
+
+    lines->count = lines->capacity = count;
+    lines->words_len = lines->words_capacity = words_len;
+
+    if (check_records(lines) != 0) {
+        lines_free(lines);
+        return 0;
+    }
+
+    return lines;
+}
+
+int lines_save(const lines_t *lines, const char *path)
+{
+    FILE *fp; /* Records file. */
+    int error; /* Return value. */
+
+    if ((fp = fopen(path, "w")) == 0)
+        return 1;
+
+    error = fprintf(fp, "asmlines %d %s %d %d %d\n", LINES_FORMAT, ASSEMBLER_VERSION,
+                    lines->count, dynstr_size(lines->pool), lines->words_len) < 0;
+    error |= fwrite(lines->recs, sizeof(linerec_t), lines->count, fp) != (size_t)lines->count;
+    error |= fwrite(lines->words, sizeof(word_t), lines->words_len, fp) != (size_t)lines->words_len;
+    error |= fwrite(dynstr_pointer(lines->pool), 1, dynstr_size(lines->pool), fp) !=
+             (size_t)dynstr_size(lines->pool);
+    error |= fclose(fp) != 0;
+
+    return error;
+}
@@ -0,0 +1,188 @@
+/**
+ * @file lines.h
+ * @author Tamir Attias
+ * @brief Line record declarations.
+ * @details A line record holds what the first pass made of one line of a
+ *          macro expanded source: the code and data words it emitted, the
+ *          symbols it defined, checked and referenced, and the line marker
+ *          it held. Addresses are relative to where the line starts, and
+ *          nothing in a record depends on the lines around it, so a later
+ *          first pass over a changed source can replay the records of the
+ *          lines that didn't change instead of parsing them again.
+ */
+
+#ifndef LINES_H
+#define LINES_H
+
+#include "instset.h"
+
+/* Forward declarations. */
+struct dynstr;
+
+/**
+ * Version of the line records file format.
+ */
+#define LINES_FORMAT 1
+
+/**
+ * Extension of line records files, appended to the basename of a source.
+ */
+#define LINES_EXT ".lines"
+
+/**
+ * Kinds of symbols a line may define.
+ */
+typedef enum {
+    LINE_DEFINE_NONE,   /**< Line defines no symbol. */
+    LINE_DEFINE_CODE,   /**< Label at the line's code address. */
+    LINE_DEFINE_DATA,   /**< Label at the line's data segment address. */
+    LINE_DEFINE_EXTERN  /**< External symbol. */
+} line_define_t;
+
+/**
+ * What the first pass made of a line. Names and text are offsets into the
+ * records' pool, -1 standing for none.
+ */
+typedef struct {
+    /** Line text, including the newline if any. */
+    int text;
+    /** Length of line text. */
+    int text_len;
+    /** Line number set by a line marker, or -1 if the line isn't one. */
+    int marker;
+    /** Position of the emitted words in the records' words, code first. */
+    int words;
+    /** Number of code words emitted. */
+    int code_len;
+    /** Number of data words emitted. */
+    int data_len;
+    /** Label checked for duplicates. */
+    int check;
+    /** Kind of symbol defined. */
+    line_define_t define_kind;
+    /** Name of symbol defined. */
+    int define;
+    /** Label referenced by an .entry directive. */
+    int entry;
+    /** Number of operands of the line's instruction, or -1 if the line
+        holds no instruction. */
+    int num_operands;
+    /** Symbol referenced by each operand. */
+    int operand_symbols[MAX_OPERANDS];
+} linerec_t;
+
+/**
+ * Records of the lines of a source, in order.
+ */
+typedef struct lines {
+    /** Records. */
+    linerec_t *recs;
+    /** Number of records. */
+    int count;
+    /** Number of records that fit in the array. */
+    int capacity;
+    /** Line texts and names. */
+    struct dynstr *pool;
+    /** Emitted words. */
+    word_t *words;
+    /** Number of emitted words. */
+    int words_len;
+    /** Number of words that fit in the array. */
+    int words_capacity;
+    /** Non-zero if the records are incomplete, because memory ran out or
+        the source had errors, so they must not be kept. */
+    int error;
+} lines_t;
+
+/**
+ * Allocates an empty set of line records.
+ *
+ * @return Pointer to the records or null if out of memory.
+ */
+lines_t *lines_alloc();
+
+/**
+ * Frees line records.
+ *
+ * @param lines Records.
+ */
+void lines_free(lines_t *lines);
+
+/**
+ * Removes all records.
+ *
+ * @param lines Records.
+ */
+void lines_clear(lines_t *lines);
+
+/**
+ * Appends a record for a line with no effects yet.
+ *
+ * @param lines Records.
+ * @param text Line text.
+ * @param len Length of line text.
+ * @return Pointer to the record, valid until the next record is appended,
+ *         or null if out of memory, which also sets the error flag.
+ */
+linerec_t *lines_add(lines_t *lines, const char *text, int len);
+
+/**
+ * Adds a name to the pool of the records.
+ *
+ * @param lines Records.
+ * @param name Null terminated name.
+ * @return Offset of the name, or -1 if out of memory, which also sets the
+ *         error flag.
+ */
+int lines_add_name(lines_t *lines, const char *name);
+
+/**
+ * Adds emitted words to the records.
+ *
+ * @param lines Records.
+ * @param words Words.
+ * @param count Number of words.
+ * @return Position of the words, or -1 if out of memory, which also sets
+ *         the error flag.
+ */
+int lines_add_words(lines_t *lines, const word_t *words, int count);
+
+/**
+ * Gets a string of the pool.
+ *
+ * @param lines Records.
+ * @param offset Offset of the string.
+ * @return Pointer to the string.
+ */
+const char *lines_string(const lines_t *lines, int offset);
+
+/**
+ * Appends a copy of a record of other records.
+ *
+ * @param lines Records receiving the copy.
+ * @param from Records holding the record.
+ * @param index Index of the record.
+ * @return Zero on success, non-zero if out of memory, which also sets the
+ *         error flag.
+ */
+int lines_copy(lines_t *lines, const lines_t *from, int index);
+
+/**
+ * Reads line records from a file written by lines_save.
+ *
+ * @param path Path of the file.
+ * @return Pointer to the records, or null if the file is missing, malformed,
+ *         written by another version of the assembler, or out of memory.
+ */
+lines_t *lines_load(const char *path);
+
+/**
+ * Writes line records to a file.
+ *
+ * @param lines Records.
+ * @param path Path of the file.
+ * @return Zero on success, non-zero on failure.
+ */
+int lines_save(const lines_t *lines, const char *path);
+
+#endif
@@ -0,0 +1,398 @@
+/**
+ * @file maclib.c
+ * @author Tamir Attias
+ * @brief Macro library implementation.
+ */
+
+#include "maclib.h"
+#include "constants.h"
+#include "preprocessor.h"
+#include "dynstr.h"
+#include "util.h"
+#include "diag.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/**
+ * Magic bytes starting an image.
+ */
+#define MACLIB_MAGIC "asmmacs"
+
+/**
+ * Value stored in an image to tell its byte order.
+ */
+#define MACLIB_BYTE_ORDER 0x01020304U
+
+/**
+ * Header of an image. It is followed by the directory buckets, the entries
+ * and the strings. Offsets are from the start of the image.
+ */
+typedef struct {
+    /** MACLIB_MAGIC. */
+    char magic[8];
+    /** Assembler version that wrote the image. */
+    char version[16];
+    /** MACLIB_FORMAT. */
+    unsigned int format;
+    /** MACLIB_BYTE_ORDER as written. */
+    unsigned int byte_order;
+    /** Size of the image in bytes. */
+    unsigned int size;
+    /** Number of directory buckets. */
+    unsigned int buckets;
+    /** Number of entries. */
+    unsigned int count;
+    /** Stamp, a hash of the names and bodies. */
+    char stamp[MACLIB_STAMP_LENGTH + 1];
+} header_t;
+
+/**
+ * Macro in an image.
+ */
+typedef struct {
+    /** Offset of the null terminated name. */
+    unsigned int name;
+    /** Offset of the null terminated body. */
+    unsigned int body;
+    /** Length of the body. */
+    unsigned int body_len;
+    /** Index plus one of the next entry in the same bucket, which is always
+        an earlier entry, or zero at the end of the bucket. */
+    unsigned int next;
+} entry_t;
+
+struct maclib {
+    /** Mapped image. */
+    const char *image;
+    /** Size of image in bytes. */
+    size_t size;
+    /** Header. */
+    const header_t *header;
+    /** Directory buckets, each the index plus one of its last entry, or
+        zero if empty. */
+    const unsigned int *buckets;
+    /** Entries. */
+    const entry_t *entries;
+};
+
+/**
+ * Macro definitions read by the compiler, in order.
+ */
+typedef struct {
+    /** Names and bodies, null terminated. */
+    dynstr_t *strings;
+    /** Definitions, with offsets into the strings. */
+    entry_t *entries;
+    /** Number of definitions. */
+    int count;
+    /** Number of definitions that fit in the array. */
+    int capacity;
+    /** Non-zero if out of memory. */
+    int error;
+} defs_t;
+
+/**
+ * Picks the directory bucket of a name.
+ *
+ * @param name Null terminated name.
+ * @param buckets Number of buckets.
+ * @return Bucket index.
+ */
+static unsigned int bucket_of(const char *name, unsigned int buckets)
+{
+    return fnv1a(FNV1A_BASIS, name, strlen(name)) % buckets;
+}
+
+/**
+ * Stores a definition read by the preprocessor. Has the signature of
+ * preprocess_macro_func_t.
+ *
+ * @param ctx Pointer to the definitions.
+ * @param name Name of macro.
+ * @param body Body text.
+ * @param len Length of body text.
+ */
+static void add_definition(void *ctx, const char *name, const char *body, int len)
+{
+    defs_t *defs = (defs_t*)ctx;
+    entry_t *grown; /* Grown array. */
+    entry_t *entry; /* New definition. */
+
+    if (defs->error)
+        return;
+
+    /* Make room for one more. */
+    if (defs->count == defs->capacity) {
+        grown = (entry_t*)realloc(defs->entries, (defs->capacity ? defs->capacity * 2 : 256) * sizeof(entry_t));
+        if (!grown) {
+            defs->error = 1;
+            return;
+        }
+        defs->entries = grown;
+        defs->capacity = defs->capacity ? defs->capacity * 2 : 256;
+    }
+
+    entry = &defs->entries[defs->count++];
+    entry->name = dynstr_size(defs->strings);
+    defs->error |= dynstr_append_len(defs->strings, name, strlen(name) + 1) != 0;
+    entry->body = dynstr_size(defs->strings);
+    entry->body_len = len;
+    defs->error |= dynstr_append_len(defs->strings, body, len) != 0;
+    defs->error |= dynstr_append_len(defs->strings, "", 1) != 0;
+    entry->next = 0;
+}
+
+/**
+ * Writes an image of definitions, keeping the latest definition of each
+ * name. An existing image is replaced in one step, so assemblers that have
+ * it mapped keep reading the old one.
+ *
+ * @param defs Definitions.
+ * @param path Path of the image file.
+ * @return Zero on success, non-zero on failure.
+ */
+static int write_image(const defs_t *defs, const char *path)
+{
+    const char *strings = dynstr_pointer(defs->strings); /* Names and bodies. */
+    header_t header; /* Image header. */
+    unsigned int *buckets; /* Directory buckets. */
+    entry_t *entries; /* Entries of the latest definitions. */
+    unsigned int count = 0; /* Number of entries. */
+    unsigned int base; /* Offset of the strings in the image. */
+    unsigned long lo = FNV1A_BASIS, hi = 3735928559UL; /* Stamp hash lanes. */
+    unsigned int slot, j; /* Bucket and entry indices. */
+    const entry_t *def; /* Current definition. */
+    char temp[FILENAME_MAX]; /* Temporary file path. */
+    const char *slash = strrchr(path, '/'); /* Last separator in the path. */
+    const int dir_len = slash ? slash - path + 1 : 0; /* Length of directory. */
+    FILE *fp; /* Image file. */
+    mode_t mask; /* File mode creation mask. */
+    int fd; /* Temporary file descriptor. */
+    int error = 1; /* Return value. */
+    int i; /* Counter. */
+
+    /* Two buckets per macro keep the chains short. */
+    memset(&header, 0, sizeof(header));
+    header.buckets = 16;
+    while (header.buckets < (unsigned int)defs->count * 2)
+        header.buckets *= 2;
+
+    buckets = (unsigned int*)calloc(header.buckets, sizeof(unsigned int));
+    entries = (entry_t*)malloc(defs->count * sizeof(entry_t) + 1);
+    if (!buckets || !entries)
+        goto done;
+
+    /* Enter the definitions in order, a redefinition replacing the body of
+       the entry it follows. */
+    for (i = 0; i < defs->count; ++i) {
+        def = &defs->entries[i];
+        slot = bucket_of(strings + def->name, header.buckets);
+        for (j = buckets[slot]; j; j = entries[j - 1].next) {
+            if (strcmp(strings + entries[j - 1].name, strings + def->name) == 0)
+                break;
+        }
+        if (j) {
+            entries[j - 1].body = def->body;
+            entries[j - 1].body_len = def->body_len;
+        } else {
+            entries[count] = *def;
+            entries[count].next = buckets[slot];
+            buckets[slot] = ++count;
+        }
+    }
+
+    /* Point the entries past the directory. */
+    base = sizeof(header_t) + header.buckets * sizeof(unsigned int) + count * sizeof(entry_t);
+    for (j = 0; j < count; ++j) {
+        lo = fnv1a(lo, strings + entries[j].name, strlen(strings + entries[j].name) + 1);
+        lo = fnv1a(lo, strings + entries[j].body, entries[j].body_len + 1);
+        hi = fnv1a(hi, strings + entries[j].body, entries[j].body_len + 1);
+        hi = fnv1a(hi, strings + entries[j].name, strlen(strings + entries[j].name) + 1);
+        entries[j].name += base;
+        entries[j].body += base;
+    }
+
+    /* Fill in the header. */
+    memcpy(header.magic, MACLIB_MAGIC, sizeof(MACLIB_MAGIC));
+    strncpy(header.version, ASSEMBLER_VERSION, sizeof(header.version) - 1);
+    header.format = MACLIB_FORMAT;
+    header.byte_order = MACLIB_BYTE_ORDER;
+    header.size = base + dynstr_size(defs->strings) + 1;
+    header.count = count;
+    sprintf(header.stamp, "%08lx%08lx", hi, lo);
+
+    /* Write the image to a temporary file next to the library, as it may be
+       mapped by running assemblers which must never see it half written. */
+    if (dir_len + sizeof("tmp.XXXXXX") > FILENAME_MAX)
+        goto done;
+    sprintf(temp, "%.*stmp.XXXXXX", dir_len, path);
+    if ((fd = mkstemp(temp)) < 0)
+        goto done;
+
+    /* Give it the permissions a new file gets, rather than the owner only
+       ones of mkstemp. */
+    mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+
+    if ((fp = fdopen(fd, "wb")) == 0) {
+        close(fd);
+        unlink(temp);
+        goto done;
+    }
+    error = fwrite(&header, sizeof(header), 1, fp) != 1;
+    error |= fwrite(buckets, sizeof(unsigned int), header.buckets, fp) != header.buckets;
+    error |= fwrite(entries, sizeof(entry_t), count, fp) != count;
+    error |= fwrite(strings, 1, dynstr_size(defs->strings), fp) != (size_t)dynstr_size(defs->strings);
+    error |= fputc('\0', fp) == EOF; /* Terminates the image, even if empty. */
+    error |= fclose(fp) != 0;
+
+    /* Move it into place in one step. */
+    if (error || rename(temp, path) != 0) {
+        unlink(temp);
+        error = 1;
+    }
+
+done:
+    free(entries);
+    free(buckets);
+
+    return error;
+}
+
+int maclib_compile(const char *source, const char *path, struct diaglist *diags)
+{
+    defs_t defs; /* Definitions read. */
+    int error = 1; /* Return value. */
+
+    memset(&defs, 0, sizeof(defs));
+    if ((defs.strings = dynstr_alloc(4096)) == 0)
+        return 1; /* Out of memory. */
+
+    if (preprocess_macros(source, add_definition, &defs, diags) == 0 && !defs.error &&
+        diaglist_size(diags) == 0)
+        error = write_image(&defs, path);
+
+    free(defs.entries);
+    dynstr_free(defs.strings);
+
+    return error;
+}
+
+/**
+ * Checks that the header, directory and entries of a mapped image lie
+ * within it, so a damaged file can't make lookups read elsewhere, and
+ * points the library to the directory and entries.
+ *
+ * @param lib Library, with the image and header set.
+ * @return Zero if the image is sound, non-zero if not.
+ */
+static int check_image(maclib_t *lib)
+{
+    const header_t *header = lib->header; /* Image header. */
+    const entry_t *entry; /* Current entry. */
+    size_t base; /* Offset of the strings. */
+    unsigned int i; /* Counter. */
+
+    if (lib->size < sizeof(header_t) ||
+        memcmp(header->magic, MACLIB_MAGIC, sizeof(MACLIB_MAGIC)) != 0 ||
+        header->format != MACLIB_FORMAT || header->byte_order != MACLIB_BYTE_ORDER ||
+        strncmp(header->version, ASSEMBLER_VERSION, sizeof(header->version)) != 0 ||
+        header->size != lib->size || header->buckets == 0 ||
+        header->stamp[MACLIB_STAMP_LENGTH] != '\0')
+        return 1;
+
+    /* The strings end with a null terminator, so none can run past the
+       image once its offset is checked. */
+    if (header->buckets > (lib->size - sizeof(header_t)) / sizeof(unsigned int) ||
+        header->count > (lib->size - sizeof(header_t) - header->buckets * sizeof(unsigned int)) / sizeof(entry_t))
+        return 1;
+    base = sizeof(header_t) + header->buckets * sizeof(unsigned int) + header->count * sizeof(entry_t);
+    if (base == lib->size || lib->image[lib->size - 1] != '\0')
+        return 1;
+    lib->buckets = (const unsigned int*)(lib->image + sizeof(header_t));
+    lib->entries = (const entry_t*)(lib->buckets + header->buckets);
+
+    for (i = 0; i < header->buckets; ++i) {
+        if (lib->buckets[i] > header->count)
+            return 1;
+    }
+    for (i = 0; i < header->count; ++i) {
+        entry = &lib->entries[i];
+        if (entry->name < base || entry->name >= lib->size ||
+            entry->body < base || entry->body >= lib->size ||
+            entry->body_len > lib->size - 1 - entry->body || entry->next > i)
+            return 1;
+    }
+
+    return 0;
+}
+
+maclib_t *maclib_open(const char *path)
+{
+    maclib_t *lib; /* Return value. */
+    struct stat st; /* Image file status. */
+    void *image; /* Mapped image. */
+    int fd; /* Image file descriptor. */
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return 0;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(header_t) ||
+        (image = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+    close(fd); /* The mapping stays. */
+
+    if ((lib = (maclib_t*)malloc(sizeof(maclib_t))) == 0) {
+        munmap(image, st.st_size);
+        return 0;
+    }
+    lib->image = (const char*)image;
+    lib->size = st.st_size;
+    lib->header = (const header_t*)image;
+
+    if (check_image(lib) != 0) {
+        maclib_close(lib);
+        return 0;
+    }
+
+    return lib;
+}
+
+void maclib_close(maclib_t *lib)
+{
+    munmap((void*)lib->image, lib->size);
+    free(lib);
+}
+
+const char *maclib_find(const maclib_t *lib, const char *name, int *len)
+{
+    unsigned int j; /* Index plus one of current entry. */
+
+    for (j = lib->buckets[bucket_of(name, lib->header->buckets)]; j; j = lib->entries[j - 1].next) {
+        if (strcmp(lib->image + lib->entries[j - 1].name, name) == 0) {
+            *len = lib->entries[j - 1].body_len;
+            return lib->image + lib->entries[j - 1].body;
+        }
+    }
+
+    return 0;
+}
+
+int maclib_count(const maclib_t *lib)
+{
+    return lib->header->count;
+}
+
+const char *maclib_stamp(const maclib_t *lib)
+{
+    return lib->header->stamp;
+}
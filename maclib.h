@@ -0,0 +1,93 @@
+/**
+ * @file maclib.h
+ * @author Tamir Attias
+ * @brief Macro library declarations.
+ * @details A macro library is a set of macro definitions compiled once into
+ *          a binary image: a header, a directory of name hashes and the
+ *          names and bodies. The image is mapped read-only into memory, so
+ *          one copy serves every file and thread of a process, and looking a
+ *          macro up needs no parsing or allocation. The preprocessor
+ *          consults it under the macros a file defines itself.
+ */
+
+#ifndef MACLIB_H
+#define MACLIB_H
+
+/* Forward declarations. */
+struct diaglist;
+
+/**
+ * Version of the macro library image format.
+ */
+#define MACLIB_FORMAT 1
+
+/**
+ * Length of a macro library stamp, not counting the null terminator.
+ */
+#define MACLIB_STAMP_LENGTH 16
+
+/**
+ * Macro library mapped into memory.
+ */
+typedef struct maclib maclib_t;
+
+/**
+ * Compiles the macros defined in source text into a library image. Only
+ * the definitions are kept; the latest definition of a name wins and any
+ * other line is ignored.
+ *
+ * @param source Null terminated raw source text.
+ * @param path Path of the image file to write.
+ * @param diags List receiving errors in the definitions.
+ * @return Zero on success, non-zero if the definitions have errors, in
+ *         which case no image is written, if out of memory or if the image
+ *         could not be written.
+ */
+int maclib_compile(const char *source, const char *path, struct diaglist *diags);
+
+/**
+ * Maps a library image into memory.
+ *
+ * @param path Path of the image file.
+ * @return Pointer to the library, or null if the file is missing,
+ *         malformed, written by another version of the assembler, or out of
+ *         memory.
+ */
+maclib_t *maclib_open(const char *path);
+
+/**
+ * Unmaps a library.
+ *
+ * @param lib Library.
+ */
+void maclib_close(maclib_t *lib);
+
+/**
+ * Finds a macro in a library.
+ *
+ * @param lib Library.
+ * @param name Name of macro.
+ * @param len Receives the length of the body in bytes.
+ * @return Pointer to the body, null terminated and valid until the library
+ *         is closed, or null if the library has no such macro.
+ */
+const char *maclib_find(const maclib_t *lib, const char *name, int *len);
+
+/**
+ * Gets the number of macros in a library.
+ *
+ * @param lib Library.
+ * @return Number of macros.
+ */
+int maclib_count(const maclib_t *lib);
+
+/**
+ * Gets the stamp of a library, a hash of its names and bodies which tells
+ * libraries with different contents apart.
+ *
+ * @param lib Library.
+ * @return Null terminated string of MACLIB_STAMP_LENGTH hex digits.
+ */
+const char *maclib_stamp(const maclib_t *lib);
+
+#endif
@@ -0,0 +1,114 @@
+/**
+ * @file manifest.c
+ * @author Tamir Attias
+ * @brief Basename list implementation.
+ */
+
+#include "manifest.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+struct manifest {
+    /** Basenames given as a list, or null if read from a file. */
+    char **basenames;
+    /** Number of basenames in the list. */
+    int count;
+    /** Index of the next basename in the list. */
+    int next;
+    /** Manifest file. */
+    FILE *fp;
+    /** Character separating basenames in the file. */
+    char delim;
+};
+
+manifest_t *manifest_from_list(char **basenames, int count)
+{
+    manifest_t *manifest = (manifest_t*)calloc(1, sizeof(manifest_t));
+
+    /* Check if out of memory. */
+    if (!manifest)
+        return 0;
+
+    manifest->basenames = basenames;
+    manifest->count = count;
+
+    return manifest;
+}
+
+manifest_t *manifest_open(const char *path, char delim)
+{
+    manifest_t *manifest = (manifest_t*)calloc(1, sizeof(manifest_t));
+
+    /* Check if out of memory. */
+    if (!manifest)
+        return 0;
+
+    /* Open the file. */
+    if (strcmp(path, "-") == 0) {
+        manifest->fp = stdin;
+    } else if ((manifest->fp = fopen(path, "r")) == 0) {
+        free(manifest);
+        return 0;
+    }
+    manifest->delim = delim;
+
+    return manifest;
+}
+
+void manifest_close(manifest_t *manifest)
+{
+    if (manifest->fp && manifest->fp != stdin)
+        fclose(manifest->fp);
+
+    free(manifest);
+}
+
+int manifest_count(const manifest_t *manifest)
+{
+    return manifest->fp ? -1 : manifest->count;
+}
+
+int manifest_next(manifest_t *manifest, char *name)
+{
+    const int trim = manifest->delim == '\n'; /* Trim whitespace? */
+    long len; /* Length of name, including any trailing whitespace. */
+    long end; /* Length of name up to its last non-whitespace character. */
+    int c; /* Current character. */
+
+    /* Take the next name from the list. */
+    if (!manifest->fp) {
+        if (manifest->next >= manifest->count)
+            return 0;
+        strncpy(name, manifest->basenames[manifest->next++], MANIFEST_NAME_SIZE - 1);
+        name[MANIFEST_NAME_SIZE - 1] = '\0';
+        return 1;
+    }
+
+    /* Read names from the file until a non-empty one. Lines are trimmed of
+       surrounding whitespace, a trailing '\r' included, so blank ones are
+       skipped too. */
+    do {
+        len = end = 0;
+        while ((c = getc(manifest->fp)) != EOF && c != manifest->delim) {
+            if (trim && isspace(c)) {
+                if (len == 0)
+                    continue;
+            } else {
+                end = len + 1;
+            }
+            if (len < MANIFEST_NAME_SIZE - 1)
+                name[len] = c;
+            ++len;
+        }
+
+        /* A name that didn't fit is kept at MANIFEST_NAME_SIZE - 1
+           characters, too long for a job, which reports it as failed. */
+        if (end > MANIFEST_NAME_SIZE - 1)
+            end = MANIFEST_NAME_SIZE - 1;
+        name[end] = '\0';
+    } while (end == 0 && c != EOF);
+
+    return end > 0;
+}
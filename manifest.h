@@ -0,0 +1,74 @@
+/**
+ * @file manifest.h
+ * @author Tamir Attias
+ * @brief Basename list declarations.
+ * @details A manifest yields the basenames of a batch one at a time, either
+ *          from the command line or streamed from a file, so batches of any
+ *          size can be assembled in one process.
+ */
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdio.h> /* for FILENAME_MAX */
+
+/**
+ * Size of a buffer receiving a basename from a manifest. One more than a
+ * job's basename, so that a name too long for a job stays too long and is
+ * reported instead of being silently truncated.
+ */
+#define MANIFEST_NAME_SIZE (FILENAME_MAX + 1)
+
+typedef struct manifest manifest_t;
+
+/**
+ * Creates a manifest over a list of basenames.
+ *
+ * @param basenames Basenames, not copied.
+ * @param count Number of basenames.
+ * @return Pointer to the manifest or null if out of memory.
+ */
+manifest_t *manifest_from_list(char **basenames, int count);
+
+/**
+ * Opens a manifest file holding one basename per line. Names are trimmed of
+ * surrounding whitespace, a trailing carriage return included, and blank
+ * lines are skipped. Names separated by '\0' are taken as they are, only
+ * empty ones being skipped.
+ *
+ * @param path Path of the file, or "-" to read standard input.
+ * @param delim Character separating basenames, '\n' or '\0'.
+ * @return Pointer to the manifest or null if the file can't be opened or
+ *         out of memory.
+ */
+manifest_t *manifest_open(const char *path, char delim);
+
+/**
+ * Closes a manifest.
+ *
+ * @param manifest Manifest.
+ */
+void manifest_close(manifest_t *manifest);
+
+/**
+ * Gets the number of basenames in a manifest if known in advance.
+ *
+ * @param manifest Manifest.
+ * @return Number of basenames, or -1 if the manifest is read as it goes.
+ */
+int manifest_count(const manifest_t *manifest);
+
+/**
+ * Reads the next basename of a manifest. Not thread-safe; callers sharing a
+ * manifest must serialize calls.
+ *
+ * @param manifest Manifest.
+ * @param name Buffer of MANIFEST_NAME_SIZE characters receiving the name.
+ *             Longer names are cut to MANIFEST_NAME_SIZE - 1 characters,
+ *             which is too long for a job, so they are reported as failed
+ *             rather than assembled under a truncated name.
+ * @return Non-zero if a name was read, zero if none remain.
+ */
+int manifest_next(manifest_t *manifest, char *name);
+
+#endif
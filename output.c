@@ -0,0 +1,313 @@
+/**
+ * @file output.c
+ * @author Tamir Attias
+ * @brief Output file writer definitions.
+ */
+
+#include "output.h"
+#include "shared.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/**
+ * Minimum number of words per thread when formatting an object file on
+ * several threads.
+ */
+#define MIN_CHUNK_WORDS 2048
+
+/**
+ * Length of an object file line without the address and the space after it.
+ */
+#define WORD_LINE_LENGTH 15
+
+/**
+ * Range of words formatted by one thread.
+ */
+typedef struct {
+    /** Shared state holding the segments. */
+    const struct shared *shared;
+    /** Where the range's first line goes. */
+    char *out;
+    /** Index of first word, counting the data segment after the code. */
+    int begin;
+    /** Index one past the last word. */
+    int end;
+} range_t;
+
+/**
+ * Writes an object file segment.
+ 
+ * @details Each group of 4 bits is encoded as a hex characters prefixed by a
+ *          letter (A-E in correspondence with the group index 1-5) and the 
+ *          groups are separated by a hyphen. Each word appears on its own
+ *          line. Additionally, each word is prefixed with its address
+ *          followed by space.
+ * @param fp File pointer to write the segment to.
+ * @param segment Memory segment to write.
+ * @param base_addr Offset that is added to each address.
+ * @param len Number of words in the segment.
+ * @return Zero on success, non-zero on failure.
+ */
+static int write_segment(FILE *fp, const word_t *segment, int base_addr, int len)
+{
+    int i;
+    word_t w;
+
+    for (i = 0; i < len; ++i) {
+        /* Get next word. */
+        w = segment[i];
+
+        /* Write its address. */
+        if (fprintf(fp, "%04d ", base_addr + i) < 0)
+            return -1;
+
+        /* Encode it to file. */
+        if (fprintf(fp, "A%x-B%x-C%x-D%x-E%x\n",
+            (unsigned)((w >> 16) & 0xF),
+            (unsigned)((w >> 12) & 0xF),
+            (unsigned)((w >> 8)  & 0xF),
+            (unsigned)((w >> 4)  & 0xF),
+            (unsigned)((w >> 0)  & 0xF)
+        ) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Calculates the length of the object file lines preceding a word.
+ *
+ * @details Lines are fixed width except for the address, which has at least
+ *          4 digits.
+ * @param index Index of the word, counting the data segment after the code.
+ * @return Number of characters.
+ */
+static long lines_length(int index)
+{
+    long len = (long)index * (4 + 1 + WORD_LINE_LENGTH); /* Return value. */
+    long threshold; /* Smallest address with one more digit. */
+
+    /* Add a character for every digit beyond 4 of the addresses, which start
+       from 100. */
+    for (threshold = 10000; 100 + index > threshold; threshold *= 10)
+        len += 100 + index - threshold;
+
+    return len;
+}
+
+/**
+ * Formats an object file line.
+ *
+ * @param out Where to store the line.
+ * @param address Address of word.
+ * @param w Word.
+ * @return Pointer one past the end of the line.
+ */
+static char *format_line(char *out, int address, word_t w)
+{
+    static const char hex[] = "0123456789abcdef"; /* Hex digits. */
+    char digits[16]; /* Address digits, least significant first. */
+    int n = 0; /* Number of digits. */
+    int shift; /* Shift of the current group of 4 bits. */
+
+    /* Write address, zero padded to 4 digits, followed by a space. */
+    do {
+        digits[n++] = '0' + address % 10;
+        address /= 10;
+    } while (address > 0);
+    while (n < 4)
+        digits[n++] = '0';
+    while (n > 0)
+        *out++ = digits[--n];
+    *out++ = ' ';
+
+    /* Write the groups, A being the most significant. */
+    for (shift = 16; shift >= 0; shift -= 4) {
+        *out++ = 'A' + (16 - shift) / 4;
+        *out++ = hex[(w >> shift) & 0xF];
+        *out++ = shift > 0 ? '-' : '\n';
+    }
+
+    return out;
+}
+
+/**
+ * Formats a range of words. Thread entry point.
+ *
+ * @param arg Pointer to the range.
+ * @return Null pointer.
+ */
+static void *format_range(void *arg)
+{
+    range_t *range = (range_t*)arg;
+    const struct shared *shared = range->shared;
+    char *out = range->out; /* Write position. */
+    int i; /* Counter. */
+
+    for (i = range->begin; i < range->end; ++i) {
+        out = format_line(out, 100 + i, i < shared->code_seg_len ?
+            shared->code_seg[i] : shared->data_seg[i - shared->code_seg_len]);
+    }
+
+    return 0;
+}
+
+/**
+ * Writes an object file by formatting it into memory and writing it in one
+ * go. Large files are formatted on several threads, each formatting a range
+ * of words into its own part of the buffer, since every line depends only
+ * on its word and address.
+ *
+ * @param fp File pointer to write to.
+ * @param shared Shared state holding the assembled segments.
+ * @return Zero on success, positive on write failure, negative if out of
+ *         memory.
+ */
+static int write_object_buffer(FILE *fp, const struct shared *shared)
+{
+    range_t ranges[MAX_THREADS]; /* Ranges of words. */
+    pthread_t threads[MAX_THREADS]; /* Thread formatting each range. */
+    int started[MAX_THREADS]; /* Was a thread started for the range? */
+    const int count = shared->code_seg_len + shared->data_seg_len; /* Number of words. */
+    char header[32]; /* Formatted header. */
+    int header_len; /* Length of header. */
+    long len; /* Length of object file. */
+    char *buf; /* Object file contents. */
+    int nranges; /* Number of ranges. */
+    int error; /* Return value. */
+    int i; /* Counter. */
+
+    /* Format header and allocate the whole file. */
+    header_len = sprintf(header, "%d %d\n", shared->code_seg_len, shared->data_seg_len);
+    len = header_len + lines_length(count);
+    if ((buf = (char*)malloc(len)) == 0)
+        return -1;
+    memcpy(buf, header, header_len);
+
+    /* Decide on the number of ranges. */
+    nranges = count / MIN_CHUNK_WORDS;
+    if (nranges > shared->threads)
+        nranges = shared->threads;
+    if (nranges > MAX_THREADS)
+        nranges = MAX_THREADS;
+    if (nranges < 1)
+        nranges = 1;
+
+    /* Split the words evenly. */
+    for (i = 0; i < nranges; ++i) {
+        ranges[i].shared = shared;
+        ranges[i].begin = (long)count * i / nranges;
+        ranges[i].end = (long)count * (i + 1) / nranges;
+        ranges[i].out = buf + header_len + lines_length(ranges[i].begin);
+    }
+
+    /* Format, the first range on this thread. */
+    for (i = 1; i < nranges; ++i)
+        started[i] = pthread_create(&threads[i], 0, format_range, &ranges[i]) == 0;
+    format_range(&ranges[0]);
+    for (i = 1; i < nranges; ++i) {
+        if (started[i])
+            pthread_join(threads[i], 0);
+        else
+            format_range(&ranges[i]);
+    }
+
+    /* Write. */
+    error = fwrite(buf, 1, len, fp) != (size_t)len;
+    free(buf);
+
+    return error;
+}
+
+int write_object_file(FILE *fp, const struct shared *shared)
+{
+    int error; /* Return value. */
+
+    /* Write the file in one go if memory allows. */
+    if ((error = write_object_buffer(fp, shared)) >= 0)
+        return error;
+
+    /* Write header. */
+    if (fprintf(fp, "%d %d\n", shared->code_seg_len, shared->data_seg_len) < 0)
+        return 1;
+
+    /* Write code segment. */
+    if ((error = write_segment(fp, shared->code_seg, 100, shared->code_seg_len)) != 0)
+        return error;
+
+    /* Write data segment. */
+    return write_segment(fp, shared->data_seg, 100 + shared->code_seg_len, shared->data_seg_len);
+}
+
+int write_entries_file(FILE *fp, const struct entrypoint *entrypoints)
+{
+    const entrypoint_t *cur; /* Currently traversed entry. */
+
+    /* Traverse linked list of entrypoints. */
+    for (cur = entrypoints; cur; cur = cur->next) {
+        /* Write entry to file. */
+        if (fprintf(fp, "%s,%ld,%ld\n", cur->label, (long)cur->base_addr, (long)cur->offset) < 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+int write_externals_file(FILE *fp, const struct external *externals)
+{
+    const external_t *cur; /* Currently traversed entry. */
+
+    /* Traverse linked list of externals. */
+    for (cur = externals; cur; cur = cur->next) {
+        /* Write base address and offset in separate lines. */
+        if (fprintf(fp, "%s BASE %ld\n", cur->symbol, (long)cur->base_addr_word_addr) < 0 ||
+            fprintf(fp, "%s OFFSET %ld\n", cur->symbol, (long)cur->offset_word_addr) < 0)
+            return 1;
+
+        /* Empty line between entries. */
+        if (cur->next && fputc('\n', fp) == EOF)
+            return 1; /* Error in fputc. */
+    }
+
+    return 0;
+}
+
+int write_section(FILE *fp, const char *name, const char *buf, size_t len)
+{
+    if (fprintf(fp, "%s %lu\n", name, (unsigned long)len) < 0)
+        return 1;
+
+    return fwrite(buf, 1, len, fp) != len;
+}
+
+int write_sections(FILE *fp, const struct shared *shared, int with_symbols)
+{
+    FILE *mem; /* In-memory stream receiving a section. */
+    char *buf = 0; /* Section contents. */
+    size_t len = 0; /* Section length. */
+    int section; /* Section counter. */
+    int error = 0; /* Return value. */
+
+    for (section = 0; section < (with_symbols ? 3 : 1) && !error; ++section) {
+        if ((mem = open_memstream(&buf, &len)) == 0)
+            return 1;
+
+        if (section == 0)
+            error = write_object_file(mem, shared);
+        else if (section == 1)
+            error = write_entries_file(mem, shared->entrypoints);
+        else
+            error = write_externals_file(mem, shared->externals);
+
+        fclose(mem);
+        error = error || write_section(fp, section == 0 ? "ob" : section == 1 ? "ent" : "ext", buf, len);
+        free(buf);
+        buf = 0;
+    }
+
+    return error;
+}
@@ -0,0 +1,69 @@
+/**
+ * @file output.h
+ * @author Tamir Attias
+ * @brief Output file writer declarations.
+ */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdio.h> /* for FILE */
+
+/* Forward declarations. */
+struct shared;
+struct entrypoint;
+struct external;
+
+/**
+ * Writes the object file (.ob) contents.
+ *
+ * @param fp Stream to write to.
+ * @param shared Shared state holding the assembled segments.
+ * @return Zero on success, non-zero on failure.
+ */
+int write_object_file(FILE *fp, const struct shared *shared);
+
+/**
+ * Writes the entry points file (.ent) contents.
+ *
+ * @param fp Stream to write to.
+ * @param entrypoints Linked list of entry points to write.
+ * @return Zero on success, non-zero on failure.
+ */
+int write_entries_file(FILE *fp, const struct entrypoint *entrypoints);
+
+/**
+ * Writes the externals file (.ext) contents.
+ *
+ * @param fp Stream to write to.
+ * @param externals Linked list of externals to write.
+ * @return Zero on success, non-zero on failure.
+ */
+int write_externals_file(FILE *fp, const struct external *externals);
+
+/**
+ * Writes one section of a framed output stream.
+ *
+ * @details A section is a header line holding the section name and the
+ *          length of its contents in bytes, followed by the contents.
+ * @param fp Stream to write to.
+ * @param name Section name.
+ * @param buf Section contents.
+ * @param len Length of the contents in bytes.
+ * @return Zero on success, non-zero on failure.
+ */
+int write_section(FILE *fp, const char *name, const char *buf, size_t len);
+
+/**
+ * Writes the outputs of an assembled file as sections of a framed stream:
+ * the object (ob) and optionally the entries (ent) and externals (ext).
+ * Each is formatted in memory first so its length is known up front.
+ *
+ * @param fp Stream to write to.
+ * @param shared Shared state holding the assembled file.
+ * @param with_symbols Also write the entries and externals sections.
+ * @return Zero on success, non-zero on failure.
+ */
+int write_sections(FILE *fp, const struct shared *shared, int with_symbols);
+
+#endif
@@ -8,12 +8,20 @@
 #include "constants.h"
 #include "hashtable.h"
 #include "dynstr.h"
+#include "shared.h"
 #include "util.h"
+#include "diag.h"
+#include "maclib.h"
+#include "filecache.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
 
 /* Number of characters to pre-allocate for macros. */
 #define MACRO_BUFFER_INITIAL_CAPACITY 256
@@ -21,157 +29,1229 @@
 /* Number of buckets in macro hash table. */
 #define MACRO_TABLE_BUCKET_COUNT 1024
 
-/* Callback for deallocating a macro buffer stored in a hash table. */
-static void free_macro(void *macro)
+/**
+ * What the preprocessor does with the lines it reads.
+ */
+typedef enum {
+    /** Define macros and expand the text in one go. */
+    MODE_FULL,
+    /** Only define macros, without output or errors. */
+    MODE_SCAN,
+    /** Only expand the text, using macros defined by an earlier scan. */
+    MODE_EXPAND
+} run_mode_t;
+
+/**
+ * Definition of a macro.
+ */
+typedef struct macro {
+    /** Body text, pointing into the source defining it. */
+    const char *body;
+    /** Length of body text. */
+    int len;
+    /** Copy of the body the body points to, if its lines weren't
+        contiguous in the source, or null. */
+    dynstr_t *copy;
+    /** Number of the endm line completing the definition. */
+    int line_no;
+    /** Previous definition of a macro with the same name, may be null. */
+    struct macro *prev;
+} macro_t;
+
+/* Forward declaration. */
+struct incfile;
+
+/**
+ * A file included by a text.
+ */
+typedef struct {
+    /** Included file. */
+    struct incfile *file;
+    /** Number of the line including it. */
+    int line_no;
+} layer_t;
+
+/**
+ * Files included by a text, in order.
+ */
+typedef struct {
+    /** Included files. */
+    layer_t *items;
+    /** Number of included files. */
+    int count;
+    /** Number of included files that fit in the array. */
+    int capacity;
+} layers_t;
+
+/**
+ * A preprocessed included file, as held by the include cache.
+ */
+typedef struct incfile {
+    /** Raw contents, which its macros point into. */
+    dynstr_t *source;
+    /** Expanded text, ending with a newline unless empty. */
+    dynstr_t *text;
+    /** Table mapping macro names to their definitions in the file. */
+    hashtable_t *macro_table;
+    /** Files it includes. */
+    layers_t layers;
+    /** Errors found preprocessing it, with its line numbers. */
+    diaglist_t *diags;
+    /** The stamp and path of each file it includes, one per line. */
+    dynstr_t *deps;
+    /** Stamp of its contents. */
+    char stamp[HASH_STAMP_LENGTH + 1];
+    /** Non-zero if a file it includes couldn't be inserted. */
+    int failed;
+    /** Cache holding it and the files it includes. */
+    filecache_t *cache;
+} incfile_t;
+
+/**
+ * Internal state for the preprocessor.
+ */
+typedef struct {
+    /** What to do with the lines read. */
+    run_mode_t mode;
+    /** Read position in the source text. */
+    const char *in;
+    /** Expanded output text. */
+    dynstr_t *out;
+    /** Shared state, for reporting errors. */
+    shared_t *shared;
+    /** If not null, errors are held here instead of being reported. */
+    diaglist_t *diags;
+    /** If not null, receives the output in batches. */
+    preprocess_batch_func_t on_batch;
+    /** Context passed to the batch callback. */
+    void *batch_ctx;
+    /** Current line number. */
+    int line_no;
+    /** Non-zero if within a macro definition. */
+    int in_macro;
+    /** Table mapping macro names to their latest definition. */
+    hashtable_t *macro_table;
+    /** Library of macros expanded unless defined in the text, may be
+        null. */
+    const maclib_t *macros;
+    /** If not null, receives the macros instead of the table. */
+    preprocess_macro_func_t on_macro;
+    /** Context passed to the macro callback. */
+    void *macro_ctx;
+    /** Path of the text, included files being found relative to it, or
+        null to find them relative to the current directory. */
+    const char *path;
+    /** Cache of included files. */
+    filecache_t *includes;
+    /** Files included so far, shared by every chunk. */
+    layers_t *layers;
+    /** If not null, receives the stamp and path of each included file. */
+    dynstr_t *deps;
+    /** Number of files including the text. */
+    int depth;
+    /** Non-zero if an included file couldn't be inserted, which fails the
+        text. */
+    int failed;
+    /** Non-zero if the text may not include files. */
+    int no_includes;
+    /** Non-zero if the source text is overwritten as it is read, so macro
+        bodies must be copied out of it. */
+    int transient;
+    /** If not null, receives the span of every macro body written to the
+        output. */
+    expansions_t *expansions;
+    /** Name of currently defined macro. */
+    char macroname[MAX_LINE_LENGTH + 1];
+    /** Start of currently defined macro's body in the source. */
+    const char *body_start;
+    /** End of the body so far. */
+    const char *body_end;
+    /** Copy of the body, made once a line of it is skipped, or null while
+        the body is contiguous in the source. */
+    dynstr_t *macro_buf;
+} state_t;
+
+/* Callback for deallocating a macro stored in a hash table. */
+static void free_macro(void *item)
 {
-    dynstr_free((dynstr_t*)macro);
+    macro_t *macro = (macro_t*)item;
+    macro_t *prev; /* Previous definition. */
+
+    while (macro) {
+        prev = macro->prev;
+        if (macro->copy)
+            dynstr_free(macro->copy);
+        free(macro);
+        macro = prev;
+    }
 }
 
-int preprocess(const char *infilename, const char *outfilename)
+/**
+ * Reports an error on a line of a file.
+ *
+ * @param st Internal state.
+ * @param file Path of the included file holding the line, or null if the
+ *             text holds it.
+ * @param line Line number.
+ * @param fmt printf style format string.
+ * @param args Format arguments.
+ */
+static void report_at(state_t *st, const char *file, int line, const char *fmt, va_list args)
+{
+    char message[MAX_DIAG_LENGTH + 1]; /* Formatted message. */
+
+    /* A scan is always followed by an expansion reporting the errors. */
+    if (st->mode == MODE_SCAN)
+        return;
+
+    if (st->diags) {
+        vsnprintf(message, sizeof(message), fmt, args);
+        diaglist_append(st->diags, "preprocess", file, line, message);
+    } else {
+        report_error(st->shared, "preprocess", file, line, fmt, args);
+    }
+}
+
+/**
+ * Prints a nicely formatted error with line number. Errors of an included
+ * file carry its path.
+ */
+static void print_error(state_t *st, const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    report_at(st, st->depth > 0 ? st->path : 0, st->line_no, fmt, args);
+    va_end(args);
+}
+
+/**
+ * Prints an error on a line of an included file.
+ */
+static void print_error_at(state_t *st, const char *file, int line, const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    report_at(st, file, line, fmt, args);
+    va_end(args);
+}
+
+/**
+ * Stores the body of the macro that was just defined in the macro table.
+ *
+ * @param st Internal state.
+ */
+static void define_macro(state_t *st)
+{
+    macro_t *macro; /* New definition. */
+    macro_t *latest; /* Definition currently stored in the table. */
+    macro_t tmp; /* For swapping definitions. */
+    const char *body = st->body_start; /* Body text. */
+    int len = st->body_end - st->body_start; /* Length of body text. */
+
+    /* Take the copy if one had to be made. */
+    if (st->macro_buf) {
+        body = dynstr_pointer(st->macro_buf);
+        len = dynstr_size(st->macro_buf);
+    } else if (st->transient) {
+        body = ""; /* Empty, and the source is about to be overwritten. */
+    }
+
+    /* Hand the definition over if only reading definitions. */
+    if (st->on_macro) {
+        st->on_macro(st->macro_ctx, st->macroname, body, len);
+        if (st->macro_buf)
+            dynstr_free(st->macro_buf);
+        return;
+    }
+
+    /* Allocate definition. */
+    if ((macro = (macro_t*)malloc(sizeof(macro_t))) == 0) {
+        if (st->macro_buf)
+            dynstr_free(st->macro_buf);
+        return; /* Out of memory. */
+    }
+    macro->body = body;
+    macro->len = len;
+    macro->copy = st->macro_buf;
+    macro->line_no = st->line_no;
+    macro->prev = 0;
+
+    if ((latest = (macro_t*)hashtable_find(st->macro_table, st->macroname)) != 0) {
+        /* Redefinition. The table keeps pointing to the same item, so move
+           the older definition out of it and the new one in. */
+        tmp = *latest;
+        *latest = *macro;
+        *macro = tmp;
+        latest->prev = macro;
+    } else if (hashtable_insert(st->macro_table, st->macroname, macro) != 0) {
+        free_macro(macro); /* Out of memory. */
+    }
+}
+
+/**
+ * Finds the body of the latest definition of a macro completed before a
+ * line, defined either in a text or in a file it included by then.
+ *
+ * @param table Table of the macros defined in the text.
+ * @param layers Files included by the text.
+ * @param line_no Line number.
+ * @param name Name of macro.
+ * @param len Receives the length of the body.
+ * @return Pointer to the body or null if the name is not a macro yet.
+ */
+static const char *find_body(hashtable_t *table, const layers_t *layers, int line_no,
+                             const char *name, int *len)
+{
+    macro_t *macro = (macro_t*)hashtable_find(table, name); /* Definition in the text. */
+    const char *body; /* Body defined by an included file. */
+    int i; /* Counter. */
+
+    /* Skip definitions completed on later lines; only a scan ahead of the
+       expansion defines those. */
+    while (macro && macro->line_no >= line_no)
+        macro = macro->prev;
+
+    /* Files included after the definition take precedence over it. */
+    for (i = layers->count - 1; i >= 0; --i) {
+        if (layers->items[i].line_no >= line_no)
+            continue;
+        if (macro && macro->line_no > layers->items[i].line_no)
+            break;
+        body = find_body(layers->items[i].file->macro_table, &layers->items[i].file->layers,
+                         INT_MAX, name, len);
+        if (body)
+            return body;
+    }
+
+    if (!macro)
+        return 0;
+
+    *len = macro->len;
+    return macro->body;
+}
+
+/**
+ * Finds the body of the macro in effect on the current line: the text's
+ * own or an included file's, or else the library's.
+ *
+ * @param st Internal state.
+ * @param name Name of macro.
+ * @param len Receives the length of the body.
+ * @return Pointer to the body or null if the name is not a macro yet.
+ */
+static const char *find_macro(state_t *st, const char *name, int *len)
+{
+    const char *body = find_body(st->macro_table, st->layers, st->line_no, name, len);
+
+    if (!body && st->macros)
+        body = maclib_find(st->macros, name, len);
+
+    return body;
+}
+
+/**
+ * Inserts the current line number as a comment so that it can be used in
+ * error reporting in later stages. The marker of a line of an included file
+ * is followed by the file's path.
+ *
+ * @param st Internal state.
+ */
+static void write_line_marker(state_t *st)
+{
+    char marker[32]; /* Formatted marker. */
+
+    /* Nothing is written while scanning. */
+    if (st->mode == MODE_SCAN)
+        return;
+
+    sprintf(marker, ";#%d", st->line_no);
+    dynstr_append(st->out, marker);
+    if (st->depth > 0) {
+        dynstr_append(st->out, " ");
+        dynstr_append(st->out, st->path);
+    }
+    dynstr_append(st->out, "\n");
+}
+
+/**
+ * Context of building an included file.
+ */
+typedef struct {
+    /** Macro library. */
+    const maclib_t *macros;
+    /** Cache of included files. */
+    filecache_t *includes;
+    /** Number of files including the file. */
+    int depth;
+} build_t;
+
+/* Forward declaration. */
+static int process_text(state_t *st, const char *end);
+
+/**
+ * Releases the files included by a text.
+ *
+ * @param cache Cache holding the files.
+ * @param layers Included files, emptied.
+ */
+static void release_layers(filecache_t *cache, layers_t *layers)
+{
+    int i; /* Counter. */
+
+    for (i = 0; i < layers->count; ++i)
+        filecache_release(cache, layers->items[i].file);
+    free(layers->items);
+    memset(layers, 0, sizeof(*layers));
+}
+
+/* Callback for deallocating an included file held by the include cache. */
+static void free_incfile(void *item)
+{
+    incfile_t *inc = (incfile_t*)item;
+
+    release_layers(inc->cache, &inc->layers);
+    if (inc->macro_table)
+        hashtable_free(inc->macro_table);
+    if (inc->source)
+        dynstr_free(inc->source);
+    if (inc->text)
+        dynstr_free(inc->text);
+    if (inc->diags)
+        diaglist_free(inc->diags);
+    if (inc->deps)
+        dynstr_free(inc->deps);
+    free(inc);
+}
+
+/**
+ * Preprocesses an included file for the include cache. Has the signature of
+ * filecache_build_func_t.
+ *
+ * @param ctx Pointer to the build context.
+ * @param path Path of the file.
+ * @param source Contents of the file, kept by the included file.
+ * @return Pointer to the included file or null if out of memory.
+ */
+static void *build_incfile(void *ctx, const char *path, dynstr_t *source)
+{
+    build_t *build = (build_t*)ctx;
+    incfile_t *inc; /* Included file. */
+    state_t st; /* Internal state. */
+
+    if ((inc = (incfile_t*)calloc(1, sizeof(incfile_t))) == 0) {
+        dynstr_free(source);
+        return 0;
+    }
+    inc->source = source;
+    inc->cache = build->includes;
+    hash_stamp(dynstr_pointer(source), dynstr_size(source), inc->stamp);
+
+    inc->text = dynstr_alloc(dynstr_size(source) + 1);
+    inc->macro_table = hashtable_alloc(MACRO_TABLE_BUCKET_COUNT, free_macro);
+    inc->diags = diaglist_alloc();
+    inc->deps = dynstr_alloc(256);
+    if (!inc->text || !inc->macro_table || !inc->diags || !inc->deps) {
+        free_incfile(inc);
+        return 0;
+    }
+
+    /* Expand it in whole, holding on to its errors. */
+    memset(&st, 0, sizeof(st));
+    st.mode = MODE_FULL;
+    st.in = dynstr_pointer(source);
+    st.out = inc->text;
+    st.diags = inc->diags;
+    st.macro_table = inc->macro_table;
+    st.macros = build->macros;
+    st.path = path;
+    st.includes = build->includes;
+    st.layers = &inc->layers;
+    st.deps = inc->deps;
+    st.depth = build->depth;
+
+    process_text(&st, 0);
+    inc->failed = st.failed;
+
+    if (st.macro_buf)
+        dynstr_free(st.macro_buf);
+
+    /* End with a newline, so the text that follows starts a line. */
+    if (dynstr_size(inc->text) > 0 && dynstr_pointer(inc->text)[dynstr_size(inc->text) - 1] != '\n')
+        dynstr_append(inc->text, "\n");
+
+    return inc;
+}
+
+/**
+ * Adds an included file to the files included by the text.
+ *
+ * @param st Internal state.
+ * @param inc Included file.
+ * @return Zero on success, non-zero if out of memory.
+ */
+static int add_layer(state_t *st, incfile_t *inc)
+{
+    layers_t *layers = st->layers; /* Included files. */
+    layer_t *grown; /* Grown array. */
+
+    /* Make room for one more. */
+    if (layers->count == layers->capacity) {
+        grown = (layer_t*)realloc(layers->items, (layers->capacity ? layers->capacity * 2 : 8) * sizeof(layer_t));
+        if (!grown)
+            return 1;
+        layers->items = grown;
+        layers->capacity = layers->capacity ? layers->capacity * 2 : 8;
+    }
+
+    layers->items[layers->count].file = inc;
+    layers->items[layers->count].line_no = st->line_no;
+    ++layers->count;
+
+    return 0;
+}
+
+/**
+ * Fails an include line that couldn't be resolved, which fails the text.
+ * The path of a file that couldn't be inserted is recorded with a stamp no
+ * contents have, so a build cache entry never applies and the file is
+ * watched for.
+ *
+ * @param st Internal state.
+ * @param path Path of the file or null if the line names none.
+ */
+static void fail_include(state_t *st, const char *path)
+{
+    char stamp[HASH_STAMP_LENGTH + 1]; /* Stamp matching no contents. */
+
+    st->failed = 1;
+    if (path && st->deps && st->mode != MODE_EXPAND) {
+        memset(stamp, '-', HASH_STAMP_LENGTH);
+        stamp[HASH_STAMP_LENGTH] = '\0';
+        dynstr_append(st->deps, stamp);
+        dynstr_append(st->deps, " ");
+        dynstr_append(st->deps, path);
+        dynstr_append(st->deps, "\n");
+    }
+    write_line_marker(st);
+}
+
+/**
+ * Handles an .include line: gets the preprocessed file from the include
+ * cache, making its macros available to the following lines, and inserts
+ * its text. The text keeps the file's own line numbers, and a line marker
+ * after it resumes the numbering of the including text.
+ *
+ * @param st Internal state.
+ * @param head Rest of the line after the directive.
+ */
+static void include_file(state_t *st, char *head)
+{
+    char path[FILENAME_MAX]; /* Path of included file. */
+    char *name, *end; /* Start and end of file name. */
+    const char *slash; /* Last separator in the path of the text. */
+    incfile_t *inc = 0; /* Included file. */
+    const diag_t *diag; /* Error of included file. */
+    const char *file; /* File the error is in. */
+    build_t build; /* Context of building the file. */
+    int dir_len; /* Length of directory of the text. */
+    int i; /* Counter. */
+
+    /* Read the quoted file name. */
+    for (name = head; *name == ' ' || *name == '\t'; ++name)
+        ;
+    if (*name != '"' || (end = strchr(name + 1, '"')) == 0 || end == name + 1 ||
+        !is_whitespace_string(end + 1)) {
+        print_error(st, "expected file name in quotes after .include.");
+        fail_include(st, 0);
+        return;
+    }
+    ++name;
+    *end = '\0';
+
+    if (st->on_macro) {
+        print_error(st, "files can't be included by a macro library.");
+        fail_include(st, 0);
+        return;
+    }
+    if (st->no_includes) {
+        print_error(st, "files can't be included by a source given in memory.");
+        fail_include(st, 0);
+        return;
+    }
+
+    /* Find it relative to the including text. */
+    slash = st->path && name[0] != '/' ? strrchr(st->path, '/') : 0;
+    dir_len = slash ? slash - st->path + 1 : 0;
+    if (dir_len + strlen(name) >= FILENAME_MAX) {
+        print_error(st, "included file name is too long.");
+        fail_include(st, 0);
+        return;
+    }
+    if (dir_len > 0)
+        memcpy(path, st->path, dir_len);
+    strcpy(path + dir_len, name);
+
+    if (st->mode == MODE_EXPAND) {
+        /* The scan included it already. */
+        for (i = 0; i < st->layers->count && !inc; ++i) {
+            if (st->layers->items[i].line_no == st->line_no)
+                inc = st->layers->items[i].file;
+        }
+    } else if (st->depth >= PREPROCESS_MAX_INCLUDE_DEPTH) {
+        print_error(st, "files included too deeply.");
+        fail_include(st, path);
+        return;
+    } else {
+        build.macros = st->macros;
+        build.includes = st->includes;
+        build.depth = st->depth + 1;
+        if ((inc = (incfile_t*)filecache_get(st->includes, path, build_incfile, &build)) != 0 &&
+            add_layer(st, inc) != 0) {
+            filecache_release(st->includes, inc);
+            inc = 0;
+        }
+
+        /* Record it along with the files it includes. */
+        if (inc && st->deps) {
+            dynstr_append(st->deps, inc->stamp);
+            dynstr_append(st->deps, " ");
+            dynstr_append(st->deps, path);
+            dynstr_append(st->deps, "\n");
+            dynstr_append_len(st->deps, dynstr_pointer(inc->deps), dynstr_size(inc->deps));
+        }
+    }
+
+    if (!inc) {
+        print_error(st, "couldn't read included file %s.", path);
+        fail_include(st, path);
+        return;
+    }
+
+    /* So do the files it includes. */
+    if (inc->failed)
+        st->failed = 1;
+
+    /* Nothing is written while scanning. */
+    if (st->mode == MODE_SCAN)
+        return;
+
+    /* Report its errors, and those of the files it includes, on their own
+       lines. */
+    for (i = 0; i < diaglist_size(inc->diags); ++i) {
+        diag = diaglist_get(inc->diags, i);
+        file = diag->file ? diag->file : path;
+        print_error_at(st, file, diag->line, "%s", diag->message);
+    }
+
+    /* Insert its text, numbered from its first line, then resume. */
+    dynstr_append(st->out, ";#0 ");
+    dynstr_append(st->out, path);
+    dynstr_append(st->out, "\n");
+    dynstr_append_len(st->out, dynstr_pointer(inc->text), dynstr_size(inc->text));
+    write_line_marker(st);
+}
+
+/**
+ * Process a line of raw assembly code.
+ *
+ * @param st Internal state.
+ * @param line Line to process.
+ * @return Zero to continue, EOF if the end of the input text was reached.
+ */
+static int process_line(state_t *st, char *line)
 {
-    FILE *in, *out; /* Input, output file pointers. */
-    char line[MAX_LINE_LENGTH + 1]; /* Line buffer. */
-    int line_no = 0; /* Line number. */
     char *head; /* Pointer to current byte in line being processed. */
     char field[MAX_LINE_LENGTH + 1]; /* Field buffer. */
-    int in_macro; /* Non-zero if within a macro definition. */
-    hashtable_t *macro_table; /* Table mapping macro names to their body. */
-    char macroname[MAX_LINE_LENGTH + 1]; /* Name of currently defined macro. */
-    dynstr_t *macro_buf; /* Buffer for currently defined macro's body. */
-    dynstr_t *macro; /* Body of referenced macro. */
-
-    /* Open input file. */
-    in = fopen(infilename, "r");
-    if (!in) {
-        printf("preprocess: couldn't open input file: %s\n", infilename);
-        return 1;
-    }
+    const char *body; /* Body of referenced macro. */
+    const char *start; /* Start of line in the source. */
+    int len; /* Length of body. */
 
-    /* Open output file. */
-    out = fopen(outfilename, "w");
-    if (!out) {
-        printf("preprocess: couldn't open output file: %s\n", outfilename);
-        fclose(in);
-        return 1;
+    /* Increment line counter. */
+    ++st->line_no;
+
+    /* If the line fills the buffer then this is an overflow. */
+    if (strlen(line) >= MAX_LINE_LENGTH) {
+        /* Print error. */
+        print_error(st, "line is too long, ignoring.");
+
+        /* Insert line number as a comment so that it can be used in
+           error reporting in later stages. */
+        write_line_marker(st);
+
+        /* Skip rest of line. */
+        return skip_line(&st->in);
     }
 
-    /* Initialize macro processing state. */
-    macro_table = hashtable_alloc(MACRO_TABLE_BUCKET_COUNT, free_macro);
-    macro_buf = 0;
-    in_macro = 0;
-
-    /* Read input file line by line. */
-    while (fgets(line, sizeof(line), in)) {
-        /* Increment line counter. */
-        ++line_no;
-
-        /* If the line fills the buffer and we haven't reached the end of file
-           then this is an overflow. */
-        if (strlen(line) >= MAX_LINE_LENGTH && !feof(in)) {
-            /* Print error. */
-            printf("preprocess: line %d is too long, ignoring.\n", line_no);
-            
+    /* Set read head to beginning of line. */
+    head = line;
+
+    /* Read first field in line. */
+    read_field(&head, field, 0);
+
+    /* Logic when processing a line within a macro. */
+    if (st->in_macro) {
+        if (strcmp(field, "endm") == 0) {
+            /* End of macro; store in table unless the scan already did. */
+            if (st->mode != MODE_EXPAND) {
+                define_macro(st);
+                st->macro_buf = 0;
+            }
+            st->in_macro = 0;
+
             /* Insert line number as a comment so that it can be used in
                error reporting in later stages. */
-            fprintf(out, ";#%d\n", line_no);
+            write_line_marker(st);
+        } else if (st->mode != MODE_EXPAND) {
+            /* Not end of macro; extend the body over the line, or copy it
+               if the line doesn't follow the body in the source. */
+            start = st->in - strlen(line);
+            if (!st->macro_buf && !st->transient && start == st->body_end) {
+                st->body_end = st->in;
+            } else {
+                if (!st->macro_buf && (st->macro_buf = dynstr_alloc(MACRO_BUFFER_INITIAL_CAPACITY)) != 0)
+                    dynstr_append_len(st->macro_buf, st->body_start, st->body_end - st->body_start);
+                if (st->macro_buf)
+                    dynstr_append(st->macro_buf, line);
+            }
+        }
+        return 0;
+    }
 
-            /* Skip rest of line. */
-            if (skip_line(in) == EOF)
-                break; /* End-of-file. */
+    /* Check if new macro is being declared. */
+    if (strcmp(field, "macro") == 0) {
+        /* End of line before macro name specified. */
+        if (is_eol(*head)) {
+            print_error(st, "macro missing name, ignoring line.");
 
-            continue; /* Next line. */
+            /* Insert line number as a comment so that it can be used in
+               error reporting in later stages. */
+            write_line_marker(st);
+
+            return 0;
         }
 
-        /* Set read head to beginning of line. */
-        head = line;
+        /* Read macro name. */
+        read_field(&head, st->macroname, 0);
 
-        /* Read first field in line. */
-        read_field(&head, field, 0);
+        /* Check for extraneous text. */
+        if (!is_whitespace_string(head)) {
+            print_error(st, "extraneous text after macro name, ignoring line.");
 
-        /* Logic when processing a line within a macro. */
-        if (in_macro) {
-            if (strcmp(field, "endm") == 0) {
-                /* End of macro; store in table. */
-                hashtable_insert(macro_table, macroname, macro_buf);
-                in_macro = 0;
-                macro_buf = 0;
+            /* Insert line number as a comment so that it can be used in
+               error reporting in later stages. */
+            write_line_marker(st);
 
-                /* Insert line number as a comment so that it can be used in
-                   error reporting in later stages. */
-                fprintf(out, ";#%d\n", line_no);
-            } else {
-                /* Not end of macro; append to macro buffer. */
-                dynstr_append(macro_buf, line);
-            }
-            continue;
+            return 0;
         }
 
-        /* Check if new macro is being declared. */
-        if (strcmp(field, "macro") == 0) {
-            /* End of line before macro name specified. */
-            if (is_eol(*head)) {
-                printf("preprocess: line %d: macro missing name, ignoring line.\n", line_no);
-                
-                /* Insert line number as a comment so that it can be used in
-                   error reporting in later stages. */
-                fprintf(out, ";#%d\n", line_no);
-
-                continue;
-            }
+        /* Enter macro state. */
+        st->in_macro = 1;
 
-            /* Read macro name. */
-            read_field(&head, macroname, 0);
+        if (st->mode == MODE_EXPAND) {
+            /* Body is skipped, it was stored by the scan. */
+        } else {
+            /* Body starts on the next line. */
+            st->body_start = st->in;
+            st->body_end = st->in;
+            if (st->macro_buf)
+                dynstr_free(st->macro_buf);
+            st->macro_buf = 0;
+        }
 
-            /* Check for extraneous text. */
-            if (!is_whitespace_string(head)) {
-                printf("preprocess: line %d: extraneous text after macro name, ignoring line.\n", line_no);
+        return 0;
+    }
 
-                /* Insert line number as a comment so that it can be used in
-                   error reporting in later stages. */
-                fprintf(out, ";#%d\n", line_no);
+    /* Check for an included file, which may define macros too. */
+    if (strcmp(field, ".include") == 0) {
+        include_file(st, head);
+        return 0;
+    }
 
-                continue;
-            }
+    /* Not a macro declaration. A scan is only interested in those. */
+    if (st->mode == MODE_SCAN)
+        return 0;
 
-            /* Enter macro state. */
-            in_macro = 1;
+    /* Check if first field in line is a macro reference. */
+    if ((body = find_macro(st, field, &len)) != 0) {
+        /* Note where the body goes, so the first pass can tell it apart.
+           Losing a span to lack of memory only costs it the shortcut. */
+        if (st->expansions && len > 0)
+            expansions_add(st->expansions, dynstr_size(st->out), len);
 
-            if (macro_buf) {
-                /* We already have a macro buffer so clear it. */
-                dynstr_clear(macro_buf);
-            } else {
-                /* Allocate empty macro buffer string. */
-                macro_buf = dynstr_alloc(MACRO_BUFFER_INITIAL_CAPACITY);
-            }
+        /* Write macro contents to output. */
+        dynstr_append_len(st->out, body, len);
+        return 0;
+    }
 
-            continue;
+    /* Not a macro reference. Copy line as is to output. */
+    dynstr_append(st->out, line);
+
+    return 0;
+}
+
+/**
+ * Hands the output to the batch callback and starts a new batch.
+ *
+ * @param st Internal state.
+ * @return Zero on success, non-zero if out of memory.
+ */
+static int flush_batch(state_t *st)
+{
+    st->on_batch(st->batch_ctx, st->out);
+
+    return (st->out = dynstr_alloc(PREPROCESS_BATCH_SIZE + MAX_LINE_LENGTH)) == 0;
+}
+
+/**
+ * Processes lines of text until the end of the text or a given position.
+ *
+ * @param st Internal state, with the read position at the start of a line.
+ * @param end Position to stop at, at the start of a line, or null to run to
+ *            the end of the text.
+ * @return Zero on success, non-zero if out of memory.
+ */
+static int process_text(state_t *st, const char *end)
+{
+    char line[MAX_LINE_LENGTH + 1]; /* Line buffer. */
+
+    /* Read input text line by line, unless the errors reported had the
+       file stopped. */
+    while ((!end || st->in < end) && !(st->shared && st->shared->stop) &&
+           read_line(&st->in, line, sizeof(line))) {
+        if (process_line(st, line) == EOF)
+            break; /* End of text. */
+
+        /* Hand over a full batch. Batches always end with a whole line. */
+        if (st->on_batch && dynstr_size(st->out) >= PREPROCESS_BATCH_SIZE && flush_batch(st))
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Range of the source expanded by one thread of the parallel preprocessor.
+ */
+typedef struct {
+    /** Expansion state, reading from the start of the chunk. */
+    state_t st;
+    /** Start of the next chunk or null for the last chunk. */
+    const char *end;
+    /** Spans of the macro bodies in the chunk's output. */
+    expansions_t expansions;
+} chunk_t;
+
+/**
+ * Expands a chunk. Thread entry point.
+ *
+ * @param arg Pointer to the chunk.
+ * @return Null pointer.
+ */
+static void *expand_chunk(void *arg)
+{
+    chunk_t *chunk = (chunk_t*)arg;
+
+    process_text(&chunk->st, chunk->end);
+
+    return 0;
+}
+
+/**
+ * Preprocesses source text on several threads. A scan first defines every
+ * macro and picks the chunk boundaries, at line starts outside of macro
+ * definitions. The chunks are then expanded concurrently, each into its own
+ * buffer, and concatenated in order along with their errors. Line markers
+ * hold absolute line numbers so they need no adjustment.
+ *
+ * @param base State to start from, with no macros or included files yet.
+ *             Flagged as failed if the scan found an include that couldn't
+ *             be resolved.
+ * @param nchunks Number of chunks to aim for, at least two.
+ * @return Zero on success, non-zero if out of memory before any output was
+ *         produced.
+ */
+static int preprocess_parallel(state_t *base, int nchunks)
+{
+    const char *source = base->in; /* Source text. */
+    dynstr_t *out = base->out; /* Expanded text. */
+    shared_t *shared = base->shared; /* Shared state. */
+    chunk_t chunks[MAX_THREADS]; /* Chunks. */
+    pthread_t threads[MAX_THREADS]; /* Thread expanding each chunk. */
+    int started[MAX_THREADS]; /* Was a thread started for the chunk? */
+    const int len = strlen(source); /* Length of source. */
+    state_t scan; /* Scan state. */
+    int count = 1; /* Number of chunks found by the scan. */
+    int error = 0; /* Return value. */
+    int i, j; /* Counters. */
+
+    /* Set up scan. */
+    scan = *base;
+    scan.mode = MODE_SCAN;
+    scan.out = 0;
+
+    /* First chunk expands straight into the output and reports its errors
+       as they come. */
+    memset(chunks, 0, sizeof(chunks));
+    chunks[0].st = scan;
+    chunks[0].st.mode = MODE_EXPAND;
+    chunks[0].st.out = out;
+
+    /* Define macros, starting a new chunk at the first line outside of a
+       macro past every chunk's share of the source. */
+    while (count < nchunks) {
+        process_text(&scan, source + (long)len * count / nchunks);
+        while (scan.in_macro && *scan.in != '\0')
+            process_text(&scan, scan.in + 1);
+        if (*scan.in == '\0')
+            break;
+
+        /* Expansion state at the start of the chunk. */
+        chunks[count].st = scan;
+        chunks[count].st.mode = MODE_EXPAND;
+        chunks[count].st.macro_buf = 0;
+        chunks[count - 1].end = scan.in;
+        ++count;
+    }
+    process_text(&scan, 0);
+    if (scan.macro_buf)
+        dynstr_free(scan.macro_buf);
+    base->failed = scan.failed;
+
+    /* Allocate the other chunks' buffers. Their spans are relative to
+       their own output until concatenated. */
+    for (i = 1; i < count; ++i) {
+        if (base->expansions)
+            chunks[i].st.expansions = &chunks[i].expansions;
+        chunks[i].st.out = dynstr_alloc(len / count + MACRO_BUFFER_INITIAL_CAPACITY);
+        chunks[i].st.diags = diaglist_alloc();
+        if (!chunks[i].st.out || !chunks[i].st.diags) {
+            error = 1;
+            goto done;
         }
+    }
 
-        /* Not a macro declaration. */
+    /* Expand the chunks, the first one on this thread. */
+    for (i = 1; i < count; ++i)
+        started[i] = pthread_create(&threads[i], 0, expand_chunk, &chunks[i]) == 0;
+    expand_chunk(&chunks[0]);
 
-        /* Check if first field in line is a macro reference. */
-        if ((macro = (dynstr_t*)hashtable_find(macro_table, field)) != 0) {
-            /* Write macro contents to output file. */
-            fwrite(dynstr_pointer(macro), 1, dynstr_size(macro), out);
-            continue;
+    /* Concatenate the other chunks in order. */
+    for (i = 1; i < count; ++i) {
+        if (started[i])
+            pthread_join(threads[i], 0);
+        else
+            expand_chunk(&chunks[i]);
+
+        /* Report errors. */
+        if (shared->diag)
+            diaglist_flush(chunks[i].st.diags, shared->diag, shared->diag_ctx);
+        else
+            diaglist_flush(chunks[i].st.diags, diag_print, 0);
+
+        /* Append spans and text. */
+        for (j = 0; j < chunks[i].expansions.count; ++j) {
+            expansions_add(base->expansions, dynstr_size(out) + chunks[i].expansions.items[j].offset,
+                           chunks[i].expansions.items[j].len);
         }
+        dynstr_append_len(out, dynstr_pointer(chunks[i].st.out), dynstr_size(chunks[i].st.out));
+    }
+
+done:
+    /* Free chunk buffers. */
+    for (i = 1; i < count; ++i) {
+        if (chunks[i].st.out)
+            dynstr_free(chunks[i].st.out);
+        if (chunks[i].st.diags)
+            diaglist_free(chunks[i].st.diags);
+        free(chunks[i].expansions.items);
+    }
+
+    return error;
+}
+
+filecache_t *preprocess_cache_alloc()
+{
+    return filecache_alloc(free_incfile);
+}
+
+/**
+ * Sets up the state of a source for including files.
+ *
+ * @param st Internal state.
+ * @param shared Shared state of the source.
+ * @param layers Empty list receiving the included files.
+ * @return Zero on success, non-zero if out of memory.
+ */
+static int begin_includes(state_t *st, shared_t *shared, layers_t *layers)
+{
+    memset(layers, 0, sizeof(*layers));
+    st->layers = layers;
+    st->path = shared->path;
+    st->deps = shared->deps;
+    st->no_includes = shared->no_includes;
+
+    /* Without a cache to share, use one for this source alone. */
+    st->includes = shared->includes ? shared->includes : filecache_alloc(free_incfile);
+
+    return st->includes == 0;
+}
+
+/**
+ * Releases the files included by a source.
+ *
+ * @param st Internal state.
+ * @param shared Shared state of the source.
+ */
+static void end_includes(state_t *st, shared_t *shared)
+{
+    release_layers(st->includes, st->layers);
+    if (st->includes != shared->includes)
+        filecache_free(st->includes);
+}
+
+int preprocess(const char *source, dynstr_t *out, struct shared *shared)
+{
+    layers_t layers; /* Included files. */
+    int nchunks; /* Number of chunks for parallel preprocessing. */
+    state_t st; /* Internal state. */
+    int error = 0; /* Return value. */
+
+    /* Zero initialize internal state. */
+    memset(&st, 0, sizeof(st));
+    st.mode = MODE_FULL;
+    st.in = source;
+    st.out = out;
+    st.shared = shared;
+    st.macros = shared->macros;
+    st.expansions = &shared->expansions;
+
+    /* Initialize macro processing state. */
+    if ((st.macro_table = hashtable_alloc(MACRO_TABLE_BUCKET_COUNT, free_macro)) == 0)
+        return 1; /* Out of memory. */
+    if (begin_includes(&st, shared, &layers) != 0) {
+        hashtable_free(st.macro_table);
+        return 1; /* Out of memory. */
+    }
+
+    /* Decide on the number of chunks. */
+    nchunks = strlen(source) / MIN_CHUNK_SIZE;
+    if (nchunks > shared->threads)
+        nchunks = shared->threads;
+    if (nchunks > MAX_THREADS)
+        nchunks = MAX_THREADS;
 
-        /* Not a macro reference. Copy line as is to output. */
-        fputs(line, out);
+    /* Try splitting the work across threads first. If that fails, nothing
+       was output yet and the macros and files it took in are dropped. */
+    if (nchunks > 1 && preprocess_parallel(&st, nchunks) == 0)
+        goto done;
+    if (nchunks > 1) {
+        release_layers(st.includes, &layers);
+        if (shared->deps)
+            dynstr_clear(shared->deps);
+        shared->expansions.count = 0;
+        hashtable_free(st.macro_table);
+        if ((st.macro_table = hashtable_alloc(MACRO_TABLE_BUCKET_COUNT, free_macro)) == 0) {
+            error = 1; /* Out of memory. */
+            goto done;
+        }
     }
 
+    process_text(&st, 0);
+
     /* Free unused macro buffer. */
-    if (macro_buf)
-        dynstr_free(macro_buf);
+    if (st.macro_buf)
+        dynstr_free(st.macro_buf);
+
+done:
+    end_includes(&st, shared);
 
     /* Free macro table. */
-    hashtable_free(macro_table);
+    if (st.macro_table)
+        hashtable_free(st.macro_table);
+
+    return error || st.failed;
+}
+
+/**
+ * Sets up the state of a source expanded in batches.
+ *
+ * @param st Internal state.
+ * @param layers Empty list receiving the included files.
+ * @param on_batch Callback receiving the batches.
+ * @param ctx Context passed to the callback.
+ * @param shared Shared state of the source.
+ * @param diags List receiving errors.
+ * @return Zero on success, non-zero if out of memory, in which case
+ *         end_stream must still be called.
+ */
+static int begin_stream(state_t *st, layers_t *layers, preprocess_batch_func_t on_batch, void *ctx,
+                        shared_t *shared, diaglist_t *diags)
+{
+    /* Zero initialize internal state. */
+    memset(st, 0, sizeof(*st));
+    st->mode = MODE_FULL;
+    st->diags = diags;
+    st->on_batch = on_batch;
+    st->batch_ctx = ctx;
+    st->macros = shared->macros;
+
+    /* Allocate first batch and macro table. */
+    if ((st->out = dynstr_alloc(PREPROCESS_BATCH_SIZE + MAX_LINE_LENGTH)) == 0)
+        return 1;
+    if ((st->macro_table = hashtable_alloc(MACRO_TABLE_BUCKET_COUNT, free_macro)) == 0)
+        return 1;
+
+    return begin_includes(st, shared, layers);
+}
+
+/**
+ * Completes a source expanded in batches, handing over the last batch
+ * unless empty, and frees its state.
+ *
+ * @param st Internal state.
+ * @param shared Shared state of the source.
+ * @param error Non-zero if expansion failed, so no batch is handed over.
+ * @return The error flag.
+ */
+static int end_stream(state_t *st, shared_t *shared, int error)
+{
+    if (!error && st->out && dynstr_size(st->out) > 0) {
+        st->on_batch(st->batch_ctx, st->out);
+        st->out = 0;
+    }
+
+    if (st->layers)
+        end_includes(st, shared);
+    if (st->out)
+        dynstr_free(st->out);
+    if (st->macro_buf)
+        dynstr_free(st->macro_buf);
+    if (st->macro_table)
+        hashtable_free(st->macro_table);
+
+    return error;
+}
+
+int preprocess_stream(const char *source, preprocess_batch_func_t on_batch, void *ctx,
+                      struct shared *shared, struct diaglist *diags)
+{
+    layers_t layers; /* Included files. */
+    state_t st; /* Internal state. */
+    int error; /* Return value. */
+
+    if ((error = begin_stream(&st, &layers, on_batch, ctx, shared, diags)) == 0) {
+        st.in = source;
+        error = process_text(&st, 0);
+    }
+
+    return end_stream(&st, shared, error) || st.failed;
+}
+
+int preprocess_file(FILE *in, size_t window, preprocess_batch_func_t on_batch, void *ctx,
+                    struct shared *shared, struct diaglist *diags)
+{
+    layers_t layers; /* Included files. */
+    state_t st; /* Internal state. */
+    char *buf; /* Window. */
+    size_t have = 0; /* Number of characters in the window. */
+    size_t end; /* End of the text processed from the window. */
+    size_t n; /* Number of characters read. */
+    char saved; /* Character overwritten by the null terminator. */
+    int eof = 0; /* End of file reached? */
+    int cut; /* Does the window end in the middle of a line? */
+    int c; /* Skipped character. */
+    int error; /* Return value. */
+
+    if ((buf = (char*)malloc(window + 1)) == 0)
+        return 1; /* Out of memory. */
+    if ((error = begin_stream(&st, &layers, on_batch, ctx, shared, diags)) != 0)
+        goto done;
+
+    /* The window is overwritten as the file is read, so macro bodies can't
+       point into it. */
+    st.transient = 1;
+
+    for (;;) {
+        /* Fill the window. */
+        while (!eof && have < window) {
+            if ((n = fread(buf + have, 1, window - have, in)) == 0)
+                eof = 1;
+            have += n;
+        }
+        if (have == 0 || ferror(in)) {
+            error = ferror(in);
+            break;
+        }
+
+        /* Process the whole lines in it, or all of it at the end of the
+           file. A line longer than the window is cut; only its start is
+           processed, which is enough to report it as too long. */
+        for (end = have; end > 0 && buf[end - 1] != '\n'; --end)
+            ;
+        cut = !eof && end == 0;
+        if (eof || cut)
+            end = have;
+        saved = buf[end];
+        buf[end] = '\0';
+        st.in = buf;
+        if ((error = process_text(&st, 0)) != 0)
+            break;
+        buf[end] = saved;
+
+        /* Text held in memory ends at a null character, so does this. */
+        if (st.in != buf + end)
+            break;
+
+        /* Keep the rest of the last line, or skip the rest of a cut one. */
+        memmove(buf, buf + end, have - end);
+        have -= end;
+        while (cut && (c = getc(in)) != '\n') {
+            if (c == EOF) {
+                eof = 1;
+                break;
+            }
+        }
+    }
+
+done:
+    free(buf);
+
+    return end_stream(&st, shared, error) || st.failed;
+}
+
+int preprocess_macros(const char *source, preprocess_macro_func_t on_macro, void *ctx,
+                      struct diaglist *diags)
+{
+    layers_t layers; /* Included files, which there are none of. */
+    state_t st; /* Internal state. */
+
+    /* Zero initialize internal state. */
+    memset(&st, 0, sizeof(st));
+    st.mode = MODE_FULL;
+    st.in = source;
+    st.diags = diags;
+    st.on_macro = on_macro;
+    st.macro_ctx = ctx;
+    memset(&layers, 0, sizeof(layers));
+    st.layers = &layers;
+
+    /* Lines outside of definitions are expanded into a scratch buffer,
+       which is dropped. The table stays empty. */
+    if ((st.out = dynstr_alloc(PREPROCESS_BATCH_SIZE)) == 0)
+        return 1; /* Out of memory. */
+    if ((st.macro_table = hashtable_alloc(MACRO_TABLE_BUCKET_COUNT, free_macro)) == 0) {
+        dynstr_free(st.out);
+        return 1; /* Out of memory. */
+    }
 
-    /* Close output file. */
-    fclose(out);
+    process_text(&st, 0);
 
-    /* Close input file. */
-    fclose(in);
+    dynstr_free(st.out);
+    if (st.macro_buf)
+        dynstr_free(st.macro_buf);
+    hashtable_free(st.macro_table);
 
     return 0;
 }
@@ -7,13 +7,119 @@
 #ifndef PREPROCESSOR_H
 #define PREPROCESSOR_H
 
+#include <stdio.h> /* for FILE, size_t */
+
+/* Forward declarations. */
+struct dynstr;
+struct shared;
+struct diaglist;
+struct maclib;
+struct filecache;
+
+/**
+ * Maximum depth of nested included files.
+ */
+#define PREPROCESS_MAX_INCLUDE_DEPTH 16
+
+/**
+ * Number of characters of expanded text after which preprocess_stream hands
+ * over a batch.
+ */
+#define PREPROCESS_BATCH_SIZE 65536
+
+/**
+ * Callback receiving a batch of expanded text made of whole lines.
+ *
+ * @param ctx Context given to preprocess_stream.
+ * @param batch Batch of text. The callback takes ownership of it.
+ */
+typedef void(*preprocess_batch_func_t)(void *ctx, struct dynstr *batch);
+
+/**
+ * Callback receiving a macro definition.
+ *
+ * @param ctx Context given to preprocess_macros.
+ * @param name Name of macro.
+ * @param body Body text.
+ * @param len Length of body text.
+ */
+typedef void(*preprocess_macro_func_t)(void *ctx, const char *name, const char *body, int len);
+
+/**
+ * Allocates a cache of included files, to be shared by the sources of a
+ * process through their shared state.
+ *
+ * @return Pointer to the cache, to be freed with filecache_free, or null if
+ *         out of memory.
+ */
+struct filecache *preprocess_cache_alloc();
+
+/**
+ * Preprocesses source text, reading macro definitions and expanding them.
+ * Macros of the shared state's library are expanded unless the source
+ * defines its own by the same name. Each file named by an .include line is
+ * preprocessed once, through the shared state's include cache, and its text
+ * inserted in place of the line; the macros it defines are in effect from
+ * that line on. The span of each macro body written to the output is
+ * added to the shared state's expansions.
+ *
+ * @param source Null terminated raw source text.
+ * @param out Dynamic string to which the expanded text is appended.
+ * @param shared Shared state, for reporting errors, the macro library and
+ *               including files.
+ * @return Zero on success, non-zero if out of memory or an included file
+ *         couldn't be inserted.
+ */
+int preprocess(const char *source, struct dynstr *out, struct shared *shared);
+
+/**
+ * Preprocesses source text, handing over the expanded text in batches as it
+ * is produced so that it never has to be held in whole.
+ *
+ * @param source Null terminated raw source text.
+ * @param on_batch Callback receiving the batches, in order.
+ * @param ctx Context passed to the callback.
+ * @param shared Shared state, for the macro library and including files
+ *               only, so the passes may use the rest of it meanwhile.
+ * @param diags List receiving errors.
+ * @return Zero on success, non-zero if out of memory or an included file
+ *         couldn't be inserted.
+ */
+int preprocess_stream(const char *source, preprocess_batch_func_t on_batch, void *ctx,
+                      struct shared *shared, struct diaglist *diags);
+
+/**
+ * Preprocesses a source file as preprocess_stream does, reading it through a
+ * window of fixed size rather than in whole, so memory use doesn't grow with
+ * the size of the file. The window holds whole lines; the start of a line
+ * longer than the window is read and the rest skipped, which reports it as
+ * too long as in memory.
+ *
+ * @param in Source file, read to its end.
+ * @param window Size of the window in characters, at least MAX_LINE_LENGTH.
+ * @param on_batch Callback receiving the batches, in order.
+ * @param ctx Context passed to the callback.
+ * @param shared Shared state, as for preprocess_stream.
+ * @param diags List receiving errors.
+ * @return Zero on success, non-zero if out of memory, the file could not
+ *         be read or an included file couldn't be inserted.
+ */
+int preprocess_file(FILE *in, size_t window, preprocess_batch_func_t on_batch, void *ctx,
+                    struct shared *shared, struct diaglist *diags);
+
 /**
- * Preprocesses an input file, reading macro definitions and expanding them.
+ * Reads the macro definitions of source text without expanding anything.
+ * Files can't be included.
  *
- * @param infilename Path of raw input file.
- * @param outfilename Path of processed output file.
- * @return Zero on success, non-zero on failure.
+ * @param source Null terminated raw source text.
+ * @param on_macro Callback receiving each definition as it is completed, in
+ *                 order, so redefinitions follow the definitions they
+ *                 replace.
+ * @param ctx Context passed to the callback.
+ * @param diags List receiving errors.
+ * @return Zero on success, non-zero if out of memory.
  */
-int preprocess(const char *infilename, const char *outfilename);
+int preprocess_macros(const char *source, preprocess_macro_func_t on_macro, void *ctx,
+                      struct diaglist *diags);
 
 #endif
@@ -0,0 +1,123 @@
+/**
+ * @file queue.c
+ * @author Tamir Attias
+ * @brief Bounded blocking queue implementation.
+ */
+
+#include "queue.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+
+struct queue {
+    /** Circular buffer of items. */
+    void **items;
+    /** Number of slots in the buffer. */
+    int capacity;
+    /** Index of the oldest item. */
+    int head;
+    /** Number of items in the queue. */
+    int size;
+    /** Set once no more items will be pushed. */
+    int closed;
+    /** Guards all fields. */
+    pthread_mutex_t lock;
+    /** Signalled when an item is pushed or the queue is closed. */
+    pthread_cond_t not_empty;
+    /** Signalled when an item is popped. */
+    pthread_cond_t not_full;
+};
+
+queue_t *queue_alloc(int capacity)
+{
+    queue_t *q = (queue_t*)calloc(1, sizeof(queue_t));
+
+    /* Check if out of memory. */
+    if (!q)
+        return 0;
+
+    /* Allocate item buffer. */
+    if ((q->items = (void**)malloc(capacity * sizeof(void*))) == 0) {
+        free(q);
+        return 0;
+    }
+
+    q->capacity = capacity;
+    pthread_mutex_init(&q->lock, 0);
+    pthread_cond_init(&q->not_empty, 0);
+    pthread_cond_init(&q->not_full, 0);
+
+    return q;
+}
+
+void queue_free(queue_t *q)
+{
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_mutex_destroy(&q->lock);
+    free(q->items);
+    free(q);
+}
+
+void queue_push(queue_t *q, void *item)
+{
+    pthread_mutex_lock(&q->lock);
+
+    /* Wait for a free slot. */
+    while (q->size >= q->capacity)
+        pthread_cond_wait(&q->not_full, &q->lock);
+
+    /* Store item after the newest one. */
+    q->items[(q->head + q->size++) % q->capacity] = item;
+
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+int queue_try_push(queue_t *q, void *item)
+{
+    int full; /* Return value. */
+
+    pthread_mutex_lock(&q->lock);
+
+    /* Store item after the newest one, if there is room. */
+    if ((full = q->size >= q->capacity) == 0) {
+        q->items[(q->head + q->size++) % q->capacity] = item;
+        pthread_cond_signal(&q->not_empty);
+    }
+
+    pthread_mutex_unlock(&q->lock);
+
+    return full;
+}
+
+void *queue_pop(queue_t *q)
+{
+    void *item = 0; /* Removed item. */
+
+    pthread_mutex_lock(&q->lock);
+
+    /* Wait for an item or for the queue to close. */
+    while (q->size == 0 && !q->closed)
+        pthread_cond_wait(&q->not_empty, &q->lock);
+
+    /* Remove the oldest item, if any. */
+    if (q->size > 0) {
+        item = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        --q->size;
+        pthread_cond_signal(&q->not_full);
+    }
+
+    pthread_mutex_unlock(&q->lock);
+
+    return item;
+}
+
+void queue_close(queue_t *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
@@ -0,0 +1,66 @@
+/**
+ * @file queue.h
+ * @author Tamir Attias
+ * @brief Bounded blocking queue declarations.
+ * @details A fixed capacity FIFO queue of pointers for handing work between
+ *          threads. Producers block while the queue is full and consumers
+ *          block while it is empty, which bounds the amount of work in
+ *          flight.
+ */
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+/**
+ * Bounded blocking queue.
+ */
+typedef struct queue queue_t;
+
+/**
+ * Allocates an empty queue.
+ *
+ * @param capacity Maximum number of items held at once.
+ * @return Pointer to the queue or null if out of memory.
+ */
+queue_t *queue_alloc(int capacity);
+
+/**
+ * Frees a queue. Items still in the queue are not freed.
+ *
+ * @param q Queue to free. No thread may be using it.
+ */
+void queue_free(queue_t *q);
+
+/**
+ * Appends an item, blocking while the queue is full.
+ *
+ * @param q Queue.
+ * @param item Item to append.
+ */
+void queue_push(queue_t *q, void *item);
+
+/**
+ * Appends an item unless the queue is full.
+ *
+ * @param q Queue.
+ * @param item Item to append.
+ * @return Zero if appended, non-zero if the queue is full.
+ */
+int queue_try_push(queue_t *q, void *item);
+
+/**
+ * Removes the oldest item, blocking while the queue is empty and open.
+ *
+ * @param q Queue.
+ * @return The removed item or null if the queue is closed and empty.
+ */
+void *queue_pop(queue_t *q);
+
+/**
+ * Closes a queue, signalling consumers that no more items will be pushed.
+ *
+ * @param q Queue.
+ */
+void queue_close(queue_t *q);
+
+#endif
@@ -0,0 +1,199 @@
+/**
+ * @file ring.c
+ * @author Tamir Attias
+ * @brief Lock-free single producer, single consumer ring buffer
+ *        implementation.
+ * @details Uses the GCC atomic builtins, which C89 lacks a standard
+ *          alternative to. The producer owns the tail index and the consumer
+ *          the head index; each publishes its index with a release store
+ *          after touching the slot and reads the other's with an acquire
+ *          load. A side that is still waiting after a few yields sleeps on
+ *          a condition variable, which the other side only signals while
+ *          someone sleeps, so a slow producer doesn't keep a processor busy.
+ */
+
+#include "ring.h"
+
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+
+/* Size of a cache line, to keep the two sides' indices apart. */
+#define CACHE_LINE_SIZE 64
+
+/* Number of times a waiting side yields before it sleeps. */
+#define RING_SPINS 64
+
+struct ring {
+    /** Circular buffer of items. */
+    void **items;
+    /** Number of slots minus one; the number of slots is a power of two. */
+    unsigned long mask;
+    /** Keeps head off the cache line of the fields above. */
+    char pad0[CACHE_LINE_SIZE];
+    /** Number of items popped so far. Written by the consumer only. */
+    unsigned long head;
+    /** Keeps head and tail on separate cache lines. */
+    char pad1[CACHE_LINE_SIZE];
+    /** Number of items pushed so far. Written by the producer only. */
+    unsigned long tail;
+    /** Set once no more items will be pushed. */
+    int closed;
+    /** Number of sides sleeping until woken. */
+    int sleepers;
+    /** Guards sleeping. */
+    pthread_mutex_t lock;
+    /** Signalled when an index moves or the ring is closed while a side
+        sleeps. */
+    pthread_cond_t moved;
+};
+
+/**
+ * Condition a side waits for.
+ *
+ * @param ring Ring.
+ * @param index The side's own index.
+ * @return Non-zero once the side may go on.
+ */
+typedef int(*ready_func_t)(ring_t *ring, unsigned long index);
+
+ring_t *ring_alloc(int capacity)
+{
+    ring_t *ring = (ring_t*)calloc(1, sizeof(ring_t));
+    unsigned long slots = 1; /* Number of slots. */
+
+    /* Check if out of memory. */
+    if (!ring)
+        return 0;
+
+    /* Round capacity up to a power of two so indices wrap with a mask. */
+    while (slots < (unsigned long)capacity)
+        slots *= 2;
+
+    /* Allocate item buffer. */
+    if ((ring->items = (void**)malloc(slots * sizeof(void*))) == 0) {
+        free(ring);
+        return 0;
+    }
+
+    ring->mask = slots - 1;
+    pthread_mutex_init(&ring->lock, 0);
+    pthread_cond_init(&ring->moved, 0);
+
+    return ring;
+}
+
+void ring_free(ring_t *ring)
+{
+    pthread_cond_destroy(&ring->moved);
+    pthread_mutex_destroy(&ring->lock);
+    free(ring->items);
+    free(ring);
+}
+
+/**
+ * Checks if the producer has a free slot.
+ *
+ * @param ring Ring.
+ * @param tail Producer's index.
+ * @return Non-zero if an item may be pushed.
+ */
+static int has_slot(ring_t *ring, unsigned long tail)
+{
+    return tail - __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) <= ring->mask;
+}
+
+/**
+ * Checks if the consumer has an item to take or was told there are none
+ * left.
+ *
+ * @param ring Ring.
+ * @param head Consumer's index.
+ * @return Non-zero if an item may be popped or the ring is closed.
+ */
+static int has_item(ring_t *ring, unsigned long head)
+{
+    return __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) != head ||
+           __atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Waits until a side may go on, yielding the processor a few times and then
+ * sleeping until the other side moves. The sleeper is counted before it
+ * checks once more, so the other side either sees it or was seen.
+ *
+ * @param ring Ring.
+ * @param ready Condition waited for.
+ * @param index The side's own index.
+ */
+static void wait_until(ring_t *ring, ready_func_t ready, unsigned long index)
+{
+    int spins; /* Counter. */
+
+    for (spins = 0; spins < RING_SPINS; ++spins) {
+        if (ready(ring, index))
+            return;
+        sched_yield();
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    __atomic_add_fetch(&ring->sleepers, 1, __ATOMIC_SEQ_CST);
+    while (!ready(ring, index))
+        pthread_cond_wait(&ring->moved, &ring->lock);
+    __atomic_sub_fetch(&ring->sleepers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/**
+ * Wakes the other side if it sleeps, after an index moved or the ring was
+ * closed. The store that moved on is sequentially consistent, so it is
+ * ordered before the look for sleepers.
+ *
+ * @param ring Ring.
+ */
+static void wake(ring_t *ring)
+{
+    if (__atomic_load_n(&ring->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&ring->lock);
+        pthread_cond_broadcast(&ring->moved);
+        pthread_mutex_unlock(&ring->lock);
+    }
+}
+
+void ring_push(ring_t *ring, void *item)
+{
+    const unsigned long tail = ring->tail; /* Only we write it. */
+
+    /* Wait while full. */
+    wait_until(ring, has_slot, tail);
+
+    /* Store item, then publish it. */
+    ring->items[tail & ring->mask] = item;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+    wake(ring);
+}
+
+void *ring_pop(ring_t *ring)
+{
+    const unsigned long head = ring->head; /* Only we write it. */
+    void *item; /* Return value. */
+
+    /* Wait while empty. Closing happens after the last push, so once the
+       ring is seen closed an empty ring stays empty. */
+    wait_until(ring, has_item, head);
+    if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == head)
+        return 0;
+
+    /* Take item, then free its slot. */
+    item = ring->items[head & ring->mask];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+    wake(ring);
+
+    return item;
+}
+
+void ring_close(ring_t *ring)
+{
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_SEQ_CST);
+    wake(ring);
+}
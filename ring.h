@@ -0,0 +1,61 @@
+/**
+ * @file ring.h
+ * @author Tamir Attias
+ * @brief Lock-free single producer, single consumer ring buffer declarations.
+ * @details A fixed capacity FIFO of pointers between exactly one producer
+ *          thread and one consumer thread. Neither side takes a lock while
+ *          the other keeps up; a side that has to wait for the other yields
+ *          the processor a few times, then sleeps until woken. Use the
+ *          blocking queue when there are more threads.
+ */
+
+#ifndef RING_H
+#define RING_H
+
+/**
+ * Single producer, single consumer ring buffer.
+ */
+typedef struct ring ring_t;
+
+/**
+ * Allocates an empty ring.
+ *
+ * @param capacity Maximum number of items held at once, rounded up to a
+ *                 power of two.
+ * @return Pointer to the ring or null if out of memory.
+ */
+ring_t *ring_alloc(int capacity);
+
+/**
+ * Frees a ring. Items still in the ring are not freed.
+ *
+ * @param ring Ring to free. No thread may be using it.
+ */
+void ring_free(ring_t *ring);
+
+/**
+ * Appends an item, waiting while the ring is full. Producer only.
+ *
+ * @param ring Ring.
+ * @param item Item to append, not null.
+ */
+void ring_push(ring_t *ring, void *item);
+
+/**
+ * Removes the oldest item, waiting while the ring is empty and open.
+ * Consumer only.
+ *
+ * @param ring Ring.
+ * @return The removed item or null if the ring is closed and empty.
+ */
+void *ring_pop(ring_t *ring);
+
+/**
+ * Closes a ring, signalling the consumer that no more items will be pushed.
+ * Producer only.
+ *
+ * @param ring Ring.
+ */
+void ring_close(ring_t *ring);
+
+#endif
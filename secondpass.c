@@ -7,7 +7,6 @@
 #include "secondpass.h"
 #include "constants.h"
 #include "shared.h"
-#include "util.h"
 #include "symtable.h"
 #include "instset.h"
 
@@ -15,36 +14,13 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <pthread.h>
 
 /**
- * Node in linked list of entry points.
+ * Minimum number of instructions per thread when symbolic operands are
+ * resolved on several threads.
  */
-typedef struct entrypoint {
-    /** Symbol name. */
-    char label[MAX_LABEL_LENGTH + 1];
-    /** Base address. */
-    word_t base_addr;
-    /** Offset from base address. */
-    word_t offset;
-    /** Next item in list of entry points. */
-    struct entrypoint *next;
-} entrypoint_t;
-
-/**
- * Node in linked list of code words referencing external symbols.
- */
-typedef struct external {
-    /** Address of machine code word in which to load the base address of the
-        symbol. */
-    word_t base_addr_word_addr;
-    /** Address of machine code word in which to load the offset from the base
-        address of the symbol. */
-    word_t offset_word_addr;
-    /** Externally referenced symbol for this word. */
-    char symbol[MAX_LABEL_LENGTH + 1];
-    /** Next item in list of externals. */
-    struct external *next;
-} external_t;
+#define MIN_CHUNK_INSTRUCTIONS 512
 
 /**
  * Internal state for second pass.
@@ -52,18 +28,14 @@ typedef struct external {
 typedef struct {
     /** Line number. */
     int line_no;
-    /** Pointer to next character to process. */
-    char *line_head;
-    /** Last read field. */
-    char field[MAX_LINE_LENGTH + 1];
-    /** Length of last read field. */
-    int field_len;
+    /** Path of the included file holding the line, or null. */
+    const char *file;
     /** Index of next instruction to process. */
     int instruction_index;
-    /** Head of entry point linked list. */
-    entrypoint_t *entrypoints;
-    /** Head of externals linked list. */
-    external_t *externals;
+    /** Non-zero if instructions were already completed. */
+    int resolved;
+    /** Shared state, for reporting errors. */
+    shared_t *shared;
 } state_t;
 
 /**
@@ -73,22 +45,10 @@ static void print_error(state_t *st, const char *fmt, ...)
 {
     va_list args;
     va_start(args, fmt);
-    printf("secondpass: error: line %d: ", st->line_no);
-    vprintf(fmt, args);
-    putchar('\n'); /* Newline at end. */
+    report_error(st->shared, "secondpass", st->file, st->line_no, fmt, args);
     va_end(args);
 }
 
-/**
- * Reads the next field in the line.
- *
- * @param st Internal state.
- */
-static void next_field(state_t *st)
-{
-    read_field(&st->line_head, st->field, &st->field_len);
-}
-
 /**
  * Inserts an entry at the head of the externals list.
  *
@@ -123,29 +83,16 @@ static void insert_external(
 }
 
 /**
- * Free externals linked list.
+ * Fills in the words of an instruction's symbolic operands.
  *
- * @param head Head of list of externals to free.
- */
-static void free_externals(external_t *head)
-{
-    external_t *cur, *next;
-
-    for (cur = head; cur; cur = next) {
-        next = cur->next;
-        free(cur);
-    }
-}
-
-/**
- * Adds missing words for an instruction in the code segment, if necessary.
- *
- * @param st Internal state.
  * @param shared Data shared between first and second pass.
  * @param data Instruction data.
- * @return Zero on success, non-zero on failure.
+ * @param externals Pointer to head of list receiving references to external
+ *                  symbols.
+ * @return Zero on success, else the number of the operand referencing a
+ *         missing symbol, starting from one.
  */
-static int complete_instruction(state_t *st, struct shared *shared, const inst_data_t *data)
+static int resolve_instruction(struct shared *shared, const inst_data_t *data, external_t **externals)
 {
     int i; /* Counter. */
     symbol_t *sym; /* Referenced symbol. */
@@ -163,11 +110,8 @@ static int complete_instruction(state_t *st, struct shared *shared, const inst_d
         
         /* Find symbol referenced by operand. */
         sym = symtable_find(shared->symtable, data->operand_symbols[i]);
-        if (!sym) {
-            print_error(st, "could not find symbol %s referenced by operand #%d.",
-                data->operand_symbols[i], i + 1);
-            return 1;
-        }
+        if (!sym)
+            return i + 1;
 
         /* Third word is base address. */
         words[2] = MAKE_EXTRA_INST_WORD(
@@ -189,7 +133,7 @@ static int complete_instruction(state_t *st, struct shared *shared, const inst_d
             /* Store addresses of words where the symbol's base address and
                offset should be placed. */
             insert_external(
-                &st->externals,
+                externals,
                 data->address + 2,
                 data->address + 3,
                 data->operand_symbols[i]);
@@ -199,6 +143,31 @@ static int complete_instruction(state_t *st, struct shared *shared, const inst_d
     return 0;
 }
 
+/**
+ * Adds missing words for an instruction in the code segment, if necessary.
+ *
+ * @param st Internal state.
+ * @param shared Data shared between first and second pass.
+ * @param data Instruction data.
+ * @return Zero on success, non-zero on failure.
+ */
+static int complete_instruction(state_t *st, struct shared *shared, const inst_data_t *data)
+{
+    int operand; /* Operand referencing a missing symbol. */
+
+    /* Report errors on the instruction's line. */
+    st->line_no = data->line_no;
+    st->file = data->file;
+
+    if ((operand = resolve_instruction(shared, data, &shared->externals)) != 0) {
+        print_error(st, "could not find symbol %s referenced by operand #%d.",
+            data->operand_symbols[operand - 1], operand);
+        return 1;
+    }
+
+    return 0;
+}
+
 /**
  * Insert a new entrypoint at the head of a linked list of entrypoints.
  *
@@ -227,317 +196,210 @@ static void insert_entrypoint(entrypoint_t **head, const char *label, word_t bas
 }
 
 /**
- * Free the linked list of entry points.
+ * Completes the instructions preceding a given one.
  *
- * @param head Head of linked list.
+ * @param st Internal state.
+ * @param shared Shared state.
+ * @param end Index of instruction to stop at.
+ * @return Zero on success, non-zero on failure.
  */
-static void free_entrypoints(entrypoint_t *head)
+static int complete_instructions(state_t *st, shared_t *shared, int end)
 {
-    entrypoint_t *cur, *next;
+    int error = 0; /* Return value. */
 
-    /* Traverse list, freeing each node. */
-    for (cur = head; cur; cur = next) {
-        next = cur->next;
-        free(cur);
+    /* Nothing to do if resolved up front. */
+    if (st->resolved) {
+        st->instruction_index = end;
+        return 0;
     }
+
+    while (st->instruction_index < end && !shared->stop)
+        error |= complete_instruction(st, shared, &shared->instructions[st->instruction_index++]);
+
+    return error;
 }
 
 /**
- * Process a line of expanded assembly code.
+ * Process a .entry directive recorded by the first pass.
  *
  * @param st Internal state.
  * @param shared Shared state.
- * @param line Line to process.
+ * @param ref Directive.
+ * @return Zero on success, non-zero on failure.
  */
-static int process_line(state_t *st, shared_t *shared, char *line)
+static int process_entry(state_t *st, shared_t *shared, const entryref_t *ref)
 {
     symbol_t *sym; /* Symbol referenced by .entry directive. */
 
-    /* Increment line counter. */
-    ++st->line_no;
-
-    /* Reset line head to beginning of line. */
-    st->line_head = line;
-
-    /* First field. */
-    next_field(st);
-
-    /* Check if first field is empty. */
-    if (st->field[0] == '\0')
-        return 0; /* Skip empty line. */
+    /* Report errors on the directive's line. */
+    st->line_no = ref->line_no;
+    st->file = ref->file;
 
-    /* Handle comment lines. */
-    if (st->field[0] == ';') {
-        /* Check if line number reset generated by preprocessor. */
-        if (st->field[1] == '#') {
-            /* Reset line number to value after pound sign. */
-            sscanf(st->field + 2, "%d", &st->line_no);
-        }
-        return 0; /* Skip comment line. */
-    }
-
-    /* Check if labeled. */
-    if (st->field[st->field_len - 1] == ':') {
-        /* Skip the label without checking for validity as that was already
-           done in the first pass. */
-        next_field(st);
-        if (st->field[0] == '\0')
-            return 0; /* Nothing after label, ignore line. */
+    /* Check if symbol name is empty. */
+    if (ref->label[0] == '\0') {
+        print_error(st, "missing symbol name in .entry directive.");
+        return 1;
     }
 
-    /* Check if directive. */
-    if (st->field[0] == '.') {
-        /* Check if .entry directive. */
-        if (strcmp(st->field + 1, "entry") != 0)
-            return 0; /* Skip non .entry directives. */
-
-        /* Get symbol name. */
-        next_field(st);
-
-        /* Check if symbol name is empty. */
-        if (st->field[0] == '\0') {
-            print_error(st, "missing symbol name in .entry directive.");
-            return 1;
-        }
-
-        /* Try to find the symbol in the symbol table. */
-        sym = symtable_find(shared->symtable, st->field);
-        if (!sym) {
-            print_error(st, "could not find symbol %s in symbol table.", st->field);
-            return 1;
-        }
-        
-        /* Insert to linked list of entry points. */
-        insert_entrypoint(&st->entrypoints, st->field, sym->base_addr, sym->offset);
-    } else {
-        /* Instruction statement. Fill in missing words. */
-        if (complete_instruction(st, shared, &shared->instructions[st->instruction_index++]) != 0)
-            return 1;
+    /* Try to find the symbol in the symbol table. */
+    sym = symtable_find(shared->symtable, ref->label);
+    if (!sym) {
+        print_error(st, "could not find symbol %s in symbol table.", ref->label);
+        return 1;
     }
+    
+    /* Insert to linked list of entry points. */
+    insert_entrypoint(&shared->entrypoints, ref->label, sym->base_addr, sym->offset);
 
     return 0;
 }
 
 /**
- * Writes an object file segment.
- 
- * @details Each group of 4 bits is encoded as a hex characters prefixed by a
- *          letter (A-E in correspondence with the group index 1-5) and the 
- *          groups are separated by a hyphen. Each word appears on its own
- *          line. Additionally, each word is prefixed with its address
- *          followed by space.
- * @param fp File pointer to write the segment to.
- * @param segment Memory segment to write.
- * @param base_addr Offset that is added to each address.
- * @param len Number of words in the segment.
- * @return Zero on success, non-zero on failure.
+ * Range of instructions resolved by one thread.
  */
-static int write_segment(FILE *fp, const word_t *segment, int base_addr, int len)
-{
-    int i;
-    word_t w;
-
-    for (i = 0; i < len; ++i) {
-        /* Get next word. */
-        w = segment[i];
-
-        /* Write its address. */
-        if (fprintf(fp, "%04d ", base_addr + i) < 0)
-            return -1;
-
-        /* Encode it to file. */
-        if (fprintf(fp, "A%x-B%x-C%x-D%x-E%x\n",
-            (unsigned)((w >> 16) & 0xF),
-            (unsigned)((w >> 12) & 0xF),
-            (unsigned)((w >> 8)  & 0xF),
-            (unsigned)((w >> 4)  & 0xF),
-            (unsigned)((w >> 0)  & 0xF)
-        ) < 0)
-            return -1;
-    }
-
-    return 0;
-}
+typedef struct {
+    /** Shared state. */
+    shared_t *shared;
+    /** Index of first instruction. */
+    int begin;
+    /** Index one past the last instruction. */
+    int end;
+    /** References to external symbols, latest first. */
+    external_t *externals;
+    /** Last node of the externals list. */
+    external_t *last;
+    /** Non-zero if a symbol is missing. */
+    int error;
+} chunk_t;
 
 /**
- * Writes object file.
+ * Resolves a range of instructions. Thread entry point.
  *
- * @param obfilename Output path.
- * @param shared Shared state.
- * @return Zero on success, non-zero on failure.
+ * @param arg Pointer to the chunk.
+ * @return Null pointer.
  */
-static int write_object_file(const char *obfilename, struct shared *shared)
+static void *resolve_chunk(void *arg)
 {
-    FILE *out; /* Output file pointer. */
-    int error = 0; /* Return value. */
-
-    /* Try to open file for writing. */
-    if ((out = fopen(obfilename, "wb")) == 0) {
-        printf("secondpass: could not open object file %s for writing\n", obfilename);
-        return 1;
-    }
-
-    /* Write header. */
-    if (fprintf(out, "%d %d\n", shared->code_seg_len, shared->data_seg_len) < 0) {
-        printf("secondpass: error: could not write header.\n");
-        goto done;
-    }
+    chunk_t *chunk = (chunk_t*)arg;
+    int i; /* Counter. */
 
-    /* Write code segment. */
-    if ((error = write_segment(out, shared->code_seg, 100, shared->code_seg_len)) != 0) {
-        printf("secondpass: error: could not write code segment.\n");
-        goto done;
-    }
+    for (i = chunk->begin; i < chunk->end && !chunk->error; ++i) {
+        chunk->error = resolve_instruction(chunk->shared, &chunk->shared->instructions[i],
+                                           &chunk->externals) != 0;
 
-    /* Write data segment. */
-    if ((error = write_segment(out, shared->data_seg, 100 + shared->code_seg_len, shared->data_seg_len)) != 0) {
-        printf("secondpass: error: could not write data segment.\n");
-        goto done;
+        /* The first node inserted ends up last. */
+        if (!chunk->last && chunk->externals) {
+            for (chunk->last = chunk->externals; chunk->last->next; chunk->last = chunk->last->next)
+                ;
+        }
     }
 
-done:
-    /* Close output file. */
-    fclose(out);
-
-    return error;
+    return 0;
 }
 
 /**
- * Writes entry points to a .ent file.
+ * Frees a list of references to external symbols.
  *
- * @param filename Output filename.
- * @param entrypoints Linked list of entry points to write.
- * @return Zero on success, non-zero on failure.
+ * @param head Head of list.
  */
-static int write_entries_file(const char *filename, entrypoint_t *entrypoints)
+static void free_externals(external_t *head)
 {
-    FILE *fp; /* Output file. */
-    entrypoint_t *cur; /* Currently traversed entry. */
-
-    /* Try to open the file. */
-    if ((fp = fopen(filename, "w")) == 0) {
-        printf("error: could not open entries file %s for writing\n", filename);
-        return 1;
-    }
-
-    /* Traverse linked list of entrypoints. */
-    for (cur = entrypoints; cur; cur = cur->next) {
-        /* Write entry to file. */
-        if (fprintf(fp, "%s,%ld,%ld\n", cur->label, (long)cur->base_addr, (long)cur->offset) < 0) {
-            /* Report error. */
-            printf("error: could not write entrypoint %s to entries file\n",
-                cur->label);
-
-            /* Close output file. */
-            fclose(fp);
+    external_t *next; /* Next node. */
 
-            return 1;
-        }
+    for (; head; head = next) {
+        next = head->next;
+        free(head);
     }
-
-    /* Close output file. */
-    fclose(fp);
-
-    return 0;
 }
 
 /**
- * Writes externals to a .ext file.
+ * Resolves the symbolic operands of all instructions on several threads.
+ * Every thread resolves a range of instructions, patching its own words in
+ * the code segment and building its own list of external references. The
+ * lists are then joined as if the instructions were resolved in order.
  *
- * @param filename Output filename.
- * @param entrypoints Linked list of externals to write.
- * @return Zero on success, non-zero on failure.
+ * @param shared Shared state.
+ * @param nchunks Number of threads to use.
+ * @return Zero on success, non-zero if a symbol is missing, in which case
+ *         the serial pass must run to report it.
  */
-static int write_externals_file(const char *filename, external_t *externals)
+static int resolve_parallel(shared_t *shared, int nchunks)
 {
-    FILE *fp; /* Output file. */
-    external_t *cur; /* Currently traversed entry. */
+    chunk_t chunks[MAX_THREADS]; /* Instruction ranges. */
+    pthread_t threads[MAX_THREADS]; /* Thread resolving each range. */
+    int started[MAX_THREADS]; /* Was a thread started for the range? */
     int error = 0; /* Return value. */
+    int i; /* Counter. */
 
-    /* Try to open the file. */
-    if ((fp = fopen(filename, "w")) == 0) {
-        printf("error: could not open entries file %s for writing\n", filename);
-        return 1;
+    /* Split instructions evenly. */
+    memset(chunks, 0, sizeof(chunks));
+    for (i = 0; i < nchunks; ++i) {
+        chunks[i].shared = shared;
+        chunks[i].begin = shared->instruction_count * i / nchunks;
+        chunks[i].end = shared->instruction_count * (i + 1) / nchunks;
     }
 
-    /* Traverse linked list of externals. */
-    for (cur = externals; cur; cur = cur->next) {
-        /* Write base address and offset in separate lines. */
-        if (fprintf(fp, "%s BASE %ld\n", cur->symbol, (long)cur->base_addr_word_addr) < 0 ||
-            fprintf(fp, "%s OFFSET %ld\n", cur->symbol, (long)cur->offset_word_addr) < 0) {
-            /* Report error. */
-            printf("error: could not write external with symbol %s\n",
-                cur->symbol);
-    
-            error = 1;
-            goto end; /* Exit. */
-        }
+    /* Resolve, the first range on this thread. */
+    for (i = 1; i < nchunks; ++i)
+        started[i] = pthread_create(&threads[i], 0, resolve_chunk, &chunks[i]) == 0;
+    resolve_chunk(&chunks[0]);
+    for (i = 1; i < nchunks; ++i) {
+        if (started[i])
+            pthread_join(threads[i], 0);
+        else
+            resolve_chunk(&chunks[i]);
+    }
 
-        /* Empty line between entries. */
-        if (cur->next && fputc('\n', fp) == EOF) {
-            /* Error in fputc. */
+    for (i = 0; i < nchunks; ++i)
+        error |= chunks[i].error;
 
-            error = 1;
-            goto end; /* Exit. */
-        }
+    /* Join the lists, the last range first, the way serial resolution
+       inserts at the head. */
+    for (i = 0; i < nchunks; ++i) {
+        if (!chunks[i].externals)
+            continue;
+        chunks[i].last->next = shared->externals;
+        shared->externals = chunks[i].externals;
     }
 
-end:
-    /* Close output file. */
-    fclose(fp);
+    /* Drop the references if the serial pass will run again. */
+    if (error) {
+        free_externals(shared->externals);
+        shared->externals = 0;
+    }
 
     return error;
 }
 
-int secondpass(
-    const char *infilename,
-    const char *obfilename,
-    const char *entfilename,
-    const char *extfilename,
-    struct shared *shared
-)
+int secondpass(struct shared *shared)
 {
-    FILE *in; /* Input file pointer. */
-    char line[MAX_LINE_LENGTH + 1]; /* Line buffer. */
     state_t st; /* Internal state. */
+    const entryref_t *ref; /* Current entry directive. */
+    int nchunks; /* Number of threads resolving instructions. */
     int error = 0; /* Return value. */
 
-    /* Try to open input file. */
-    if ((in = fopen(infilename, "r")) == 0) {
-        printf("secondpass: error: could not open %s\n", infilename);
-        return 1;
-    }
-
     /* Initialize state to zero. */
     memset(&st, 0, sizeof(st));
-
-    /* Process file line by line. */
-    while (fgets(line, sizeof(line), in))
-        error |= process_line(&st, shared, line);
-
-    /* Close input file. */
-    fclose(in);
-
-    if (error == 0 && st.entrypoints != 0) {
-        /* Write entrypoints to .ent file. */
-        write_entries_file(entfilename, st.entrypoints);
-
-        /* Free linked list of entry points. */
-        free_entrypoints(st.entrypoints);
+    st.shared = shared;
+
+    /* Decide on the number of threads resolving instructions. */
+    nchunks = shared->instruction_count / MIN_CHUNK_INSTRUCTIONS;
+    if (nchunks > shared->threads)
+        nchunks = shared->threads;
+    if (nchunks > MAX_THREADS)
+        nchunks = MAX_THREADS;
+
+    /* Instructions don't depend on each other once the first pass is done,
+       so try resolving them all up front. Only entry points are left then. */
+    if (nchunks > 1 && resolve_parallel(shared, nchunks) == 0)
+        st.resolved = 1;
+
+    /* Go over instructions and entry directives in source order. */
+    for (ref = shared->entryrefs; ref; ref = ref->next) {
+        error |= complete_instructions(&st, shared, ref->instruction_index);
+        error |= process_entry(&st, shared, ref);
     }
-
-    if (error == 0 && st.externals != 0) {
-        /* Write externals to .ext file. */
-        write_externals_file(extfilename, st.externals);
-
-        /* Free linked list of externals. */
-        free_externals(st.externals);
-    }
-
-    /* Write machine code to object file. */
-    if (error == 0)
-        error = write_object_file(obfilename, shared);
+    error |= complete_instructions(&st, shared, shared->instruction_count);
 
     return error;
 }
-
@@ -11,21 +11,13 @@
 struct shared;
 
 /**
- * Executes second pass.
+ * Executes second pass. Completes the code segment and collects the entry
+ * points and external references into the shared state. Works from what the
+ * first pass recorded, so the source text is no longer needed.
  *
- * @param infilename Input filename (.am file).
- * @param obfilename Object filename (.ob)
- * @param entfilename Entries filename (.ent)
- * @param extfilename Externals filename (.ext)
  * @param shared Shared assembly state.
  * @return Zero on success, non-zero on failure.
  */
-int secondpass(
-    const char *infilename,
-    const char *obfilename,
-    const char *entfilename,
-    const char *extfilename,
-    struct shared *shared
-);
+int secondpass(struct shared *shared);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,531 @@
+/**
+ * @file server.c
+ * @author Tamir Attias
+ * @brief Assembler server implementation.
+ */
+
+#include "server.h"
+#include "job.h"
+#include "batch.h"
+#include "queue.h"
+#include "shared.h"
+#include "dynstr.h"
+#include "preprocessor.h"
+#include "firstpass.h"
+#include "secondpass.h"
+#include "output.h"
+#include "diag.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+/**
+ * Maximum length of a request header line.
+ */
+#define MAX_HEADER_LENGTH (FILENAME_MAX + 16)
+
+/**
+ * Set by the signal handler once the server must stop.
+ */
+static volatile sig_atomic_t stop_requested;
+
+/**
+ * An accepted connection waiting for a worker.
+ */
+typedef struct {
+    /** Socket. */
+    int fd;
+} connection_t;
+
+/**
+ * State shared by the workers of a server.
+ */
+typedef struct {
+    /** Accepted connections waiting for a worker. */
+    queue_t *connections;
+    /** Options applying to every request. */
+    const job_options_t *options;
+    /** Non-zero once the server is stopping. */
+    int stopping;
+    /** Guards stopping and the workers' fd. */
+    pthread_mutex_t lock;
+} server_t;
+
+/**
+ * Worker of a server. Keeps its assembly state warm between requests.
+ */
+typedef struct {
+    /** Server the worker belongs to. */
+    server_t *server;
+    /** Socket of the connection being served, or -1. */
+    int fd;
+    /** Shared assembly state reused by every request, or null. */
+    shared_t *shared;
+    /** Source text of an inline request. */
+    dynstr_t *source;
+    /** Macro expanded source text of an inline request. */
+    dynstr_t *expanded;
+} worker_t;
+
+/**
+ * Signal handler asking the server to stop.
+ *
+ * @param sig Signal number.
+ */
+static void request_stop(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+}
+
+/**
+ * Replies to a request that could not be carried out.
+ *
+ * @param out Stream receiving the reply.
+ * @param message Message explaining why, ending with a newline.
+ * @return Zero on success, non-zero if the reply could not be written.
+ */
+static int reply_error(FILE *out, const char *message)
+{
+    return write_section(out, "log", message, strlen(message)) ||
+           fprintf(out, "status 1\n") < 0;
+}
+
+/**
+ * Turns away a connection no worker can take, replying that the server is
+ * busy.
+ *
+ * @param fd Socket of the connection, closed when done.
+ */
+static void reject_connection(int fd)
+{
+    FILE *out; /* Stream writing the socket. */
+
+    if ((out = fdopen(fd, "w")) == 0) {
+        close(fd);
+        return;
+    }
+    reply_error(out, "error: server busy, try again later.\n");
+    fclose(out);
+}
+
+/**
+ * Gets fresh shared assembly state for a request, reusing the worker's.
+ *
+ * @param worker Worker.
+ * @return Pointer to the state or null if out of memory.
+ */
+static shared_t *warm_shared(worker_t *worker)
+{
+    if (worker->shared && shared_reset(worker->shared) != 0) {
+        shared_free(worker->shared);
+        worker->shared = 0;
+    }
+    if (!worker->shared)
+        worker->shared = shared_alloc();
+
+    return worker->shared;
+}
+
+/**
+ * Assembles a file from disk.
+ *
+ * @param worker Worker.
+ * @param basename Basename of the file.
+ * @param out Stream receiving the reply.
+ * @return Zero on success, non-zero if the reply could not be written.
+ */
+static int serve_path(worker_t *worker, const char *basename, FILE *out)
+{
+    job_t *job; /* Job for the file. */
+    FILE *files; /* In-memory stream listing the output files. */
+    char *buf = 0; /* Output files list. */
+    size_t len = 0; /* Length of output files list. */
+    shared_t *shared; /* Assembled file. */
+    int status; /* Result of assembly. */
+    int error; /* Return value. */
+    int i; /* Counter. */
+
+    if ((job = job_alloc(basename, worker->server->options)) == 0 ||
+        (files = open_memstream(&buf, &len)) == 0) {
+        if (job)
+            job_free(job);
+        return reply_error(out, "error: out of memory.\n");
+    }
+
+    /* Run the job on the warm state and keep its messages. */
+    job->shared = worker->shared;
+    job->echo = 0;
+    status = job_run(job);
+    shared = job->shared;
+
+    /* List the outputs written. */
+    for (i = 0; i < JOB_OUTPUTS; ++i) {
+        if (job->outputs & (1 << i))
+            fprintf(files, "%s%s\n", job->basename, job_output_ext((job_output_t)i));
+    }
+    fclose(files);
+
+    error = write_section(out, "log", job->log_buf, job->log_len) ||
+            write_section(out, "files", buf, len) ||
+            fprintf(out, "status %d\n", status) < 0;
+
+    /* Take the state back for the next request. */
+    worker->shared = shared;
+    job->shared = 0;
+    job_free(job);
+    free(buf);
+
+    return error;
+}
+
+/**
+ * Assembles source text sent along with the request.
+ *
+ * @param worker Worker.
+ * @param length Length of the source text in bytes.
+ * @param in Stream holding the source text.
+ * @param out Stream receiving the reply.
+ * @return Zero on success, non-zero if the source could not be read or the
+ *         reply could not be written.
+ */
+static int serve_source(worker_t *worker, long length, FILE *in, FILE *out)
+{
+    char chunk[4096]; /* Chunk of source text. */
+    size_t n; /* Size of chunk. */
+    diagbuf_t *diags; /* Diagnostics. */
+    FILE *log; /* In-memory stream receiving the messages. */
+    char *buf = 0; /* Messages. */
+    size_t len = 0; /* Length of messages. */
+    FILE *mem; /* In-memory stream receiving the sections. */
+    char *sections = 0; /* Formatted sections. */
+    size_t sections_len = 0; /* Length of sections. */
+    shared_t *shared; /* Shared assembly state. */
+    int status = 1; /* Result of assembly. */
+    int error; /* Return value. */
+
+    /* Read the source text. */
+    dynstr_clear(worker->source);
+    while (length > 0) {
+        n = length < (long)sizeof(chunk) ? (size_t)length : sizeof(chunk);
+        if (fread(chunk, 1, n, in) != n || dynstr_append_len(worker->source, chunk, n) != 0)
+            return 1;
+        length -= n;
+    }
+
+    if ((diags = diagbuf_alloc("-")) == 0)
+        return 1;
+    if ((log = open_memstream(&buf, &len)) == 0) {
+        diagbuf_free(diags);
+        return 1;
+    }
+
+    /* Assemble on the warm state. */
+    if ((shared = warm_shared(worker)) == 0) {
+        diagbuf_add(diags, DIAG_ERROR, 0, 0, 0, "out of memory.");
+    } else {
+        shared->diag = diagbuf_append;
+        shared->diag_ctx = diags;
+        job_configure(shared, worker->server->options, 0);
+        dynstr_clear(worker->expanded);
+
+        if (preprocess(dynstr_pointer(worker->source), worker->expanded, shared))
+            diagbuf_add(diags, DIAG_ERROR, 0, 0, 0, "could not preprocess source file.");
+        else if (firstpass(dynstr_pointer(worker->expanded), shared))
+            diagbuf_add(diags, DIAG_FATAL, 0, 0, 0, "first pass failed.");
+        else if (secondpass(shared))
+            diagbuf_add(diags, DIAG_FATAL, 0, 0, 0, "second pass failed.");
+        else if ((mem = open_memstream(&sections, &sections_len)) == 0)
+            diagbuf_add(diags, DIAG_ERROR, 0, 0, 0, "out of memory.");
+        else {
+            /* Format the sections ahead of the log, so a failure to do so
+               is among its messages. */
+            status = write_sections(mem, shared, 1);
+            status |= fclose(mem) != 0;
+            if (status)
+                diagbuf_add(diags, DIAG_ERROR, 0, 0, 0, "could not write output.");
+        }
+    }
+    diagbuf_write(diags, worker->server->options->diag_format, log);
+    diagbuf_free(diags);
+    fclose(log);
+
+    error = write_section(out, "log", buf, len) ||
+            (status == 0 && fwrite(sections, 1, sections_len, out) != sections_len) ||
+            fprintf(out, "status %d\n", status) < 0;
+    free(sections);
+    free(buf);
+
+    return error;
+}
+
+/**
+ * Serves the requests of a connection until the client closes it.
+ *
+ * @param worker Worker.
+ * @param fd Socket of the connection, closed when done.
+ */
+static void serve_connection(worker_t *worker, int fd)
+{
+    char header[MAX_HEADER_LENGTH + 2]; /* Request header line. */
+    FILE *in, *out; /* Streams reading and writing the socket. */
+    char *end; /* End of header line. */
+    long length; /* Length of inline source. */
+    int error = 0; /* Is the connection broken? */
+    int dup_fd; /* Second descriptor of socket, for the output stream. */
+
+    /* Open buffered streams over the socket. */
+    in = fdopen(fd, "r");
+    dup_fd = in ? dup(fd) : -1;
+    out = dup_fd >= 0 ? fdopen(dup_fd, "w") : 0;
+    if (!out) {
+        if (dup_fd >= 0)
+            close(dup_fd);
+        if (in)
+            fclose(in);
+        else
+            close(fd);
+        return;
+    }
+
+    while (!error && fgets(header, sizeof(header), in)) {
+        /* Strip the newline; a header without one is too long. */
+        if ((end = strchr(header, '\n')) == 0) {
+            reply_error(out, "error: request header too long.\n");
+            break;
+        }
+        *end = '\0';
+
+        if (strncmp(header, "path ", 5) == 0 && header[5] != '\0') {
+            error = serve_path(worker, header + 5, out);
+        } else if (sscanf(header, "source %ld", &length) == 1 && length >= 0) {
+            error = serve_source(worker, length, in, out);
+        } else {
+            reply_error(out, "error: unknown request.\n");
+            error = 1;
+        }
+
+        error |= fflush(out) != 0;
+    }
+
+    /* Connection is done. */
+    pthread_mutex_lock(&worker->server->lock);
+    worker->fd = -1;
+    pthread_mutex_unlock(&worker->server->lock);
+
+    fclose(out);
+    fclose(in);
+}
+
+/**
+ * Worker thread of a server. Serves connections until the server stops.
+ *
+ * @param arg Pointer to the worker.
+ * @return Null pointer.
+ */
+static void *server_worker(void *arg)
+{
+    worker_t *worker = (worker_t*)arg;
+    server_t *server = worker->server;
+    connection_t *conn; /* Connection to serve. */
+    int stopping; /* Is the server stopping? */
+
+    while ((conn = (connection_t*)queue_pop(server->connections)) != 0) {
+        /* Claim the connection, unless the server is stopping. */
+        pthread_mutex_lock(&server->lock);
+        if (!(stopping = server->stopping))
+            worker->fd = conn->fd;
+        pthread_mutex_unlock(&server->lock);
+
+        if (stopping)
+            close(conn->fd);
+        else
+            serve_connection(worker, conn->fd);
+        free(conn);
+    }
+
+    return 0;
+}
+
+/**
+ * Opens the listening socket of a server.
+ *
+ * @param path Path of the socket.
+ * @return Socket or -1 on failure, which is reported.
+ */
+static int open_socket(const char *path)
+{
+    struct sockaddr_un addr; /* Socket address. */
+    struct stat st; /* Status of a file at the path. */
+    int fd; /* Return value. */
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("error: socket path %s too long.\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    /* Replace a socket left behind by a server that didn't stop cleanly,
+       but nothing else. */
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(fd, SERVER_BACKLOG) != 0 ||
+        fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+        printf("error: could not listen on %s: %s.\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int server_run(const char *path, const job_options_t *options, int workers)
+{
+    pthread_t threads[MAX_JOBS]; /* Worker threads. */
+    worker_t state[MAX_JOBS]; /* Worker state. */
+    server_t server; /* State shared by the workers. */
+    struct sigaction sa; /* Stop signal action. */
+    sigset_t stop_signals, old_mask; /* Signal masks. */
+    connection_t *conn; /* Accepted connection. */
+    struct timeval idle; /* Time a connection may stay silent. */
+    fd_set readable; /* Listening socket, to wait for connections. */
+    int listen_fd; /* Listening socket. */
+    int fd; /* Accepted socket. */
+    int started = 0; /* Number of workers started. */
+    int i; /* Counter. */
+
+    if ((listen_fd = open_socket(path)) < 0)
+        return 1;
+
+    /* Worker state lives on the stack. */
+    if (workers > MAX_JOBS)
+        workers = MAX_JOBS;
+
+    server.options = options;
+    server.stopping = 0;
+    pthread_mutex_init(&server.lock, 0);
+    if ((server.connections = queue_alloc(SERVER_BACKLOG)) == 0) {
+        printf("error: out of memory.\n");
+        goto done;
+    }
+
+    /* Stop on SIGINT and SIGTERM. The signals are blocked except while
+       waiting for a connection, so they interrupt the wait and nothing
+       else; workers inherit the blocked mask. A client going away must not
+       kill the server either. */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, 0);
+    sigaction(SIGTERM, &sa, 0);
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+
+    /* Start the workers. */
+    for (started = 0; started < workers; ++started) {
+        memset(&state[started], 0, sizeof(worker_t));
+        state[started].server = &server;
+        state[started].fd = -1;
+        state[started].source = dynstr_alloc(4096);
+        state[started].expanded = dynstr_alloc(4096);
+        if (!state[started].source || !state[started].expanded ||
+            pthread_create(&threads[started], 0, server_worker, &state[started]) != 0) {
+            if (state[started].source)
+                dynstr_free(state[started].source);
+            if (state[started].expanded)
+                dynstr_free(state[started].expanded);
+            break;
+        }
+    }
+
+    if (started == 0) {
+        printf("error: could not start any server worker.\n");
+    } else {
+        printf("server: listening on %s with %d workers.\n", path, started);
+        fflush(stdout);
+
+        /* Accept connections until asked to stop. */
+        while (!stop_requested) {
+            FD_ZERO(&readable);
+            FD_SET(listen_fd, &readable);
+            if (pselect(listen_fd + 1, &readable, 0, 0, 0, &old_mask) <= 0)
+                continue;
+
+            /* The client may be gone by now, which is fine. */
+            if ((fd = accept(listen_fd, 0, 0)) < 0)
+                continue;
+            fcntl(fd, F_SETFL, 0);
+
+            /* A worker must not wait forever on a silent client. */
+            idle.tv_sec = SERVER_IDLE_SECONDS;
+            idle.tv_usec = 0;
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+
+            if ((conn = (connection_t*)malloc(sizeof(connection_t))) == 0) {
+                close(fd);
+                continue;
+            }
+            conn->fd = fd;
+
+            /* Never wait for a worker here, or the stop signals would go
+               unnoticed; turn the client away instead. */
+            if (queue_try_push(server.connections, conn) != 0) {
+                reject_connection(fd);
+                free(conn);
+            }
+        }
+
+        printf("server: stopping.\n");
+    }
+
+    /* Let the connections being served finish their current request, and
+       drop the ones still waiting. */
+    pthread_mutex_lock(&server.lock);
+    server.stopping = 1;
+    for (i = 0; i < started; ++i) {
+        if (state[i].fd >= 0)
+            shutdown(state[i].fd, SHUT_RD);
+    }
+    pthread_mutex_unlock(&server.lock);
+    queue_close(server.connections);
+
+    /* Wait for the workers and free their state. */
+    for (i = 0; i < started; ++i) {
+        pthread_join(threads[i], 0);
+        if (state[i].shared)
+            shared_free(state[i].shared);
+        dynstr_free(state[i].source);
+        dynstr_free(state[i].expanded);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, 0);
+    queue_free(server.connections);
+
+done:
+    pthread_mutex_destroy(&server.lock);
+    close(listen_fd);
+    unlink(path);
+
+    return started == 0;
+}
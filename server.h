@@ -0,0 +1,54 @@
+/**
+ * @file server.h
+ * @author Tamir Attias
+ * @brief Assembler server declarations.
+ * @details The server listens on a Unix domain socket and assembles files on
+ *          request, so clients don't pay for starting a process per file.
+ *
+ *          A client sends requests over a connection one after the other,
+ *          each starting with a header line:
+ *
+ *          - "path <basename>": assemble <basename>.as from disk, writing
+ *            the output files next to it as the command line does.
+ *          - "source <length>": assemble the <length> bytes of source text
+ *            following the header, writing nothing to disk.
+ *
+ *          Each reply is a series of sections, as in stream mode: a header
+ *          line holding the section name and the length of its contents in
+ *          bytes, followed by the contents. A "log" section holds the
+ *          messages. A path reply then holds a "files" section listing the
+ *          output files written, one per line; a source reply holds the
+ *          "ob", "ent" and "ext" sections if assembly succeeded. The reply
+ *          ends with a "status <n>" line, zero on success.
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+/* Forward declarations. */
+struct job_options;
+
+/**
+ * Number of accepted connections that may wait for a free worker.
+ */
+#define SERVER_BACKLOG 16
+
+/**
+ * Number of seconds a connection may stay silent while a worker waits for
+ * it, after which it is closed.
+ */
+#define SERVER_IDLE_SECONDS 60
+
+/**
+ * Runs the server until it receives SIGINT or SIGTERM.
+ *
+ * @param path Path of the socket to listen on. A stale socket left there is
+ *             replaced; the socket is removed when the server stops.
+ * @param options Options applying to every request.
+ * @param workers Number of requests served concurrently.
+ * @return Zero if the server stopped cleanly, non-zero if it failed to
+ *         start.
+ */
+int server_run(const char *path, const struct job_options *options, int workers);
+
+#endif
@@ -6,23 +6,203 @@
 
 #include "shared.h"
 #include "symtable.h"
+#include "dynstr.h"
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * Path of an included file, in a linked list.
+ */
+typedef struct srcfile {
+    /** Null terminated path. */
+    char *path;
+    /** Next path. */
+    struct srcfile *next;
+} srcfile_t;
 
 shared_t *shared_alloc()
 {
     shared_t *shared = (shared_t*)calloc(1, sizeof(shared_t));
+
+    /* Check if out of memory. */
+    if (!shared)
+        return 0;
     
-    /* Allocate symbol table. */
-    shared->symtable = symtable_alloc();
+    /* Allocate symbol table and list of included files. */
+    if ((shared->symtable = symtable_alloc()) == 0) {
+        free(shared);
+        return 0;
+    }
+    if ((shared->deps = dynstr_alloc(256)) == 0) {
+        symtable_free(shared->symtable);
+        free(shared);
+        return 0;
+    }
 
     return shared;
 }
 
+/**
+ * Frees the linked lists of entry directives, entry points and externals.
+ *
+ * @param shared Shared state.
+ */
+static void free_lists(shared_t *shared)
+{
+    entryref_t *ref, *next_ref; /* Entry directive list traversal. */
+    entrypoint_t *ep, *next_ep; /* Entry point list traversal. */
+    external_t *ext, *next_ext; /* Externals list traversal. */
+
+    /* Free linked list of entry directives. */
+    for (ref = shared->entryrefs; ref; ref = next_ref) {
+        next_ref = ref->next;
+        free(ref);
+    }
+    shared->entryrefs = 0;
+
+    /* Free linked list of entry points. */
+    for (ep = shared->entrypoints; ep; ep = next_ep) {
+        next_ep = ep->next;
+        free(ep);
+    }
+    shared->entrypoints = 0;
+
+    /* Free linked list of externals. */
+    for (ext = shared->externals; ext; ext = next_ext) {
+        next_ext = ext->next;
+        free(ext);
+    }
+    shared->externals = 0;
+}
+
+/**
+ * Frees the paths of included files.
+ *
+ * @param shared Shared state.
+ */
+static void free_files(shared_t *shared)
+{
+    srcfile_t *file, *next; /* Path list traversal. */
+
+    for (file = shared->files; file; file = next) {
+        next = file->next;
+        free(file->path);
+        free(file);
+    }
+    shared->files = 0;
+}
+
 void shared_free(shared_t *shared)
 {
     /* Free symbol table. */
     symtable_free(shared->symtable);
 
+    free_lists(shared);
+    free_files(shared);
+
+    dynstr_free(shared->deps);
+    free(shared->expansions.items);
+
     free(shared);
 }
+
+int shared_reset_passes(shared_t *shared)
+{
+    symtable_t *symtable; /* Fresh symbol table. */
+
+    /* Replace the symbol table. */
+    if ((symtable = symtable_alloc()) == 0)
+        return 1;
+    symtable_free(shared->symtable);
+    shared->symtable = symtable;
+
+    free_lists(shared);
+
+    /* Empty the segments. Their contents are overwritten as they grow. */
+    shared->data_seg_len = 0;
+    shared->code_seg_len = 0;
+    shared->instruction_count = 0;
+
+    shared->memo_lines = 0;
+    shared->memo_hits = 0;
+
+    return 0;
+}
+
+int shared_reset(shared_t *shared)
+{
+    if (shared_reset_passes(shared) != 0)
+        return 1;
+
+    /* Forget the source. */
+    shared->stop = 0;
+    shared->path = 0;
+    shared->no_includes = 0;
+    dynstr_clear(shared->deps);
+    free_files(shared);
+    shared->expansions.count = 0;
+
+    return 0;
+}
+
+int expansions_add(expansions_t *list, long offset, int len)
+{
+    expansion_t *grown; /* Grown array. */
+    int capacity; /* Grown capacity. */
+
+    /* Make room for one more. */
+    if (list->count == list->capacity) {
+        capacity = list->capacity ? list->capacity * 2 : 256;
+        if ((grown = (expansion_t*)realloc(list->items, capacity * sizeof(expansion_t))) == 0)
+            return 1;
+        list->items = grown;
+        list->capacity = capacity;
+    }
+
+    list->items[list->count].offset = offset;
+    list->items[list->count].len = len;
+    ++list->count;
+
+    return 0;
+}
+
+const char *shared_file(shared_t *shared, const char *path, int len)
+{
+    srcfile_t *file; /* Current path. */
+    const char *copy = 0; /* Return value. */
+
+    /* Look for the path among those kept. Sources include few files. */
+    for (file = shared->files; file && !copy; file = file->next) {
+        if (strncmp(file->path, path, len) == 0 && file->path[len] == '\0')
+            copy = file->path;
+    }
+
+    /* Keep a copy of a new one. */
+    if (!copy && (file = (srcfile_t*)malloc(sizeof(srcfile_t))) != 0) {
+        if ((file->path = (char*)malloc(len + 1)) != 0) {
+            memcpy(file->path, path, len);
+            file->path[len] = '\0';
+            file->next = shared->files;
+            shared->files = file;
+            copy = file->path;
+        } else {
+            free(file);
+        }
+    }
+    return copy;
+}
+
+void report_error(shared_t *shared, const char *stage, const char *file, int line,
+                  const char *fmt, va_list args)
+{
+    char message[MAX_DIAG_LENGTH + 1]; /* Formatted message. */
+
+    vsnprintf(message, sizeof(message), fmt, args);
+
+    if (shared->diag)
+        shared->diag(shared->diag_ctx, stage, file, line, message);
+    else
+        diag_print(0, stage, file, line, message);
+}
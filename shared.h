@@ -9,9 +9,16 @@
 
 #include "instset.h"
 #include "constants.h"
+#include "diag.h"
 
-/* Forward declaration. */
+#include <stdarg.h>
+
+/* Forward declarations. */
 struct symtable;
+struct maclib;
+struct filecache;
+struct dynstr;
+struct srcfile;
 
 /**
  * Data about an instruction encoded in the code segment.
@@ -23,8 +30,83 @@ typedef struct {
     char operand_symbols[MAX_OPERANDS][MAX_LABEL_LENGTH + 1];
     /** Number of operands. */
     int num_operands;
+    /** Source line number, for reporting errors. */
+    int line_no;
+    /** Path of the included file holding the line, or null if the source
+        holds it. Kept by the shared state. */
+    const char *file;
 } inst_data_t;
 
+/**
+ * Node in linked list of entry points.
+ */
+typedef struct entrypoint {
+    /** Symbol name. */
+    char label[MAX_LABEL_LENGTH + 1];
+    /** Base address. */
+    word_t base_addr;
+    /** Offset from base address. */
+    word_t offset;
+    /** Next item in list of entry points. */
+    struct entrypoint *next;
+} entrypoint_t;
+
+/**
+ * Node in linked list of code words referencing external symbols.
+ */
+typedef struct external {
+    /** Address of machine code word in which to load the base address of the
+        symbol. */
+    word_t base_addr_word_addr;
+    /** Address of machine code word in which to load the offset from the base
+        address of the symbol. */
+    word_t offset_word_addr;
+    /** Externally referenced symbol for this word. */
+    char symbol[MAX_LABEL_LENGTH + 1];
+    /** Next item in list of externals. */
+    struct external *next;
+} external_t;
+
+/**
+ * Node in linked list of .entry directives, recorded by the first pass for
+ * the second.
+ */
+typedef struct entryref {
+    /** Name of referenced symbol, empty if missing. */
+    char label[MAX_LINE_LENGTH + 1];
+    /** Source line number. */
+    int line_no;
+    /** Path of the included file holding the line, or null. */
+    const char *file;
+    /** Number of instructions preceding the directive. */
+    int instruction_index;
+    /** Next directive in source order. */
+    struct entryref *next;
+} entryref_t;
+
+/**
+ * Span of an expanded text holding the body of a macro, written by the
+ * preprocessor in place of a line using the macro.
+ */
+typedef struct {
+    /** Position of the body in the expanded text. */
+    long offset;
+    /** Length of the body. */
+    int len;
+} expansion_t;
+
+/**
+ * Spans of macro bodies in an expanded text, in order.
+ */
+typedef struct {
+    /** Spans. */
+    expansion_t *items;
+    /** Number of spans. */
+    int count;
+    /** Number of spans that fit in the array. */
+    int capacity;
+} expansions_t;
+
 /**
  * State shared between assembly passes.
  */
@@ -43,12 +125,57 @@ typedef struct shared {
     int instruction_count;
     /** Symbol table. */
     struct symtable *symtable;
+    /** Head of .entry directive linked list in source order, filled by the
+        first pass. */
+    entryref_t *entryrefs;
+    /** Head of entry point linked list, filled by the second pass. */
+    entrypoint_t *entrypoints;
+    /** Head of externals linked list, filled by the second pass. */
+    external_t *externals;
+    /** Callback receiving diagnostics. Printed to standard output if null. */
+    diag_func_t diag;
+    /** Context passed to the diagnostics callback. */
+    void *diag_ctx;
+    /** Set by the diagnostics callback once it takes no more, such as when
+        a cap on errors was reached, so the passes stop early. */
+    int stop;
+    /** Number of threads a stage may use for this file. One if zero. */
+    int threads;
+    /** Non-zero to have the first pass memoize the lines it parses. */
+    int memo;
+    /** Number of lines the first pass looked up in its memo. */
+    long memo_lines;
+    /** Number of those replayed from the memo. */
+    long memo_hits;
+    /** Library of macros the preprocessor expands unless the source
+        defines its own, or null. */
+    const struct maclib *macros;
+    /** Cache of included files shared by every source, or null to read
+        them afresh for this source. */
+    struct filecache *includes;
+    /** Path of the source file, relative to which included files are
+        found, or null if the source isn't a file. */
+    const char *path;
+    /** Non-zero if the source may not include files, as a source given to
+        the library in memory may not. */
+    int no_includes;
+    /** Stamp and path of each file the source included, one per line,
+        filled by the preprocessor. */
+    struct dynstr *deps;
+    /** Paths of the included files named by the line markers met by the
+        first pass, kept for reporting errors. */
+    struct srcfile *files;
+    /** Spans of the macro bodies in the expanded text, filled by the
+        preprocessor unless streaming. Lets the first pass encode a body
+        once and replay it wherever it recurs. */
+    expansions_t expansions;
 } shared_t;
 
 /**
  * Allocate shared state.
  *
- * @return Pointer to allocated and initialized shared state.
+ * @return Pointer to allocated and initialized shared state or null if out
+ *         of memory.
  */
 shared_t *shared_alloc();
 
@@ -59,4 +186,59 @@ shared_t *shared_alloc();
  */
 void shared_free(shared_t *shared);
 
+/**
+ * Resets shared state to its freshly allocated contents, keeping the
+ * diagnostics callback, thread count, memo flag, macro library and include
+ * cache.
+ *
+ * @param shared Shared state to reset.
+ * @return Zero on success, non-zero if out of memory.
+ */
+int shared_reset(shared_t *shared);
+
+/**
+ * Discards what the assembly passes made of the source, keeping what the
+ * preprocessor recorded of it along with what shared_reset keeps. Used to
+ * run a pass over again.
+ *
+ * @param shared Shared state to reset.
+ * @return Zero on success, non-zero if out of memory.
+ */
+int shared_reset_passes(shared_t *shared);
+
+/**
+ * Appends a span to a list of macro body spans.
+ *
+ * @param list List of spans.
+ * @param offset Position of the body in the expanded text.
+ * @param len Length of the body.
+ * @return Zero on success, non-zero if out of memory.
+ */
+int expansions_add(expansions_t *list, long offset, int len);
+
+/**
+ * Gets the copy of a path of an included file kept by shared state, adding
+ * it if new. The copy lasts until the state is reset.
+ *
+ * @param shared Shared state.
+ * @param path Path, not necessarily null terminated.
+ * @param len Length of the path.
+ * @return Copy of the path, or null if out of memory.
+ */
+const char *shared_file(shared_t *shared, const char *path, int len);
+
+/**
+ * Reports an error through the diagnostics callback.
+ *
+ * @param shared Shared state.
+ * @param stage Name of the reporting stage.
+ * @param file Path of the included file holding the line, or null if the
+ *             source holds it.
+ * @param line Source line number.
+ * @param fmt printf style format string.
+ * @param args Format arguments.
+ */
+void report_error(shared_t *shared, const char *stage, const char *file, int line,
+                  const char *fmt, va_list args);
+
 #endif
@@ -0,0 +1,92 @@
+/**
+ * @file stats.c
+ * @author Tamir Attias
+ * @brief Assembly statistics implementation.
+ */
+
+#include "stats.h"
+#include "util.h"
+
+/**
+ * Names of the phases, indexed by stats_phase_t.
+ */
+static const char *const phase_names[STATS_PHASES] = {
+    "preprocess", "firstpass", "secondpass", "am", "ob", "ent", "ext"
+};
+
+void stats_add(stats_t *total, const stats_t *stats)
+{
+    int i; /* Counter. */
+
+    total->files += stats->files;
+    for (i = 0; i < STATS_PHASES; ++i)
+        total->seconds[i] += stats->seconds[i];
+    total->lines += stats->lines;
+    total->instructions += stats->instructions;
+    total->code_words += stats->code_words;
+    total->data_words += stats->data_words;
+    total->symbols += stats->symbols;
+    total->fixups += stats->fixups;
+    total->externals += stats->externals;
+    total->bytes += stats->bytes;
+}
+
+/**
+ * Computes a rate, zero if no time was measured.
+ *
+ * @param count Amount.
+ * @param seconds Time taken.
+ * @return Amount per second.
+ */
+static double rate(double count, double seconds)
+{
+    return seconds > 0 ? count / seconds : 0;
+}
+
+void stats_print(FILE *fp, const char *prefix, const stats_t *stats, double seconds)
+{
+    const long words = stats->code_words + stats->data_words; /* Words assembled. */
+    int i; /* Counter. */
+
+    fprintf(fp, "%s%ld lines, %ld instructions, %ld code and %ld data words, %ld symbols, "
+            "%ld fixups, %ld externals, %ld bytes written.\n",
+            prefix, stats->lines, stats->instructions, stats->code_words, stats->data_words,
+            stats->symbols, stats->fixups, stats->externals, stats->bytes);
+
+    /* Writers are named by their output files. */
+    fputs(prefix, fp);
+    for (i = 0; i < STATS_PHASES; ++i) {
+        fprintf(fp, "%s%s%s %.3f ms", i ? ", " : "", i >= STATS_WRITE_AM ? "." : "",
+                phase_names[i], stats->seconds[i] * 1000);
+    }
+    fputs(".\n", fp);
+
+    fprintf(fp, "%s%.0f lines/s, %.0f words/s, %.2f MB/s in %.3f s.\n", prefix,
+            rate(stats->lines, seconds), rate(words, seconds),
+            rate(stats->bytes / 1e6, seconds), seconds);
+}
+
+void stats_write_json(FILE *fp, const char *file, const stats_t *stats, double seconds)
+{
+    const long words = stats->code_words + stats->data_words; /* Words assembled. */
+    int i; /* Counter. */
+
+    /* Name the file, or count the files of a batch. */
+    if (file) {
+        fputs("{\"file\":", fp);
+        json_write_string(fp, file);
+    } else {
+        fprintf(fp, "{\"files\":%ld", stats->files);
+    }
+
+    fprintf(fp, ",\"seconds\":%.6f,\"phases\":{", seconds);
+    for (i = 0; i < STATS_PHASES; ++i)
+        fprintf(fp, "%s\"%s\":%.6f", i ? "," : "", phase_names[i], stats->seconds[i]);
+
+    fprintf(fp, "},\"lines\":%ld,\"instructions\":%ld,\"code_words\":%ld,\"data_words\":%ld,"
+            "\"symbols\":%ld,\"fixups\":%ld,\"externals\":%ld,\"bytes\":%ld",
+            stats->lines, stats->instructions, stats->code_words, stats->data_words,
+            stats->symbols, stats->fixups, stats->externals, stats->bytes);
+    fprintf(fp, ",\"lines_per_second\":%.1f,\"words_per_second\":%.1f,\"mb_per_second\":%.3f}",
+            rate(stats->lines, seconds), rate(words, seconds), rate(stats->bytes / 1e6, seconds));
+}
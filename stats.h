@@ -0,0 +1,88 @@
+/**
+ * @file stats.h
+ * @author Tamir Attias
+ * @brief Assembly statistics declarations.
+ * @details Statistics tell where the time of assembling goes: how long each
+ *          phase of a file took and how much it made, for one file or
+ *          summed over a batch, along with the throughput that follows.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h> /* for FILE */
+
+/**
+ * Timed phases of assembling a file. The writers follow the order of the
+ * output files.
+ */
+typedef enum {
+    STATS_PREPROCESS, /* Expanding macros. */
+    STATS_FIRSTPASS, /* First pass. */
+    STATS_SECONDPASS, /* Second pass. */
+    STATS_WRITE_AM, /* Writing the .am file. */
+    STATS_WRITE_OB, /* Writing the .ob file. */
+    STATS_WRITE_ENT, /* Writing the .ent file. */
+    STATS_WRITE_EXT, /* Writing the .ext file. */
+    STATS_PHASES /* Number of phases. */
+} stats_phase_t;
+
+/**
+ * Statistics of a file or a batch of files.
+ */
+typedef struct {
+    /** Number of files. */
+    long files;
+    /** Time taken by each phase, in seconds. */
+    double seconds[STATS_PHASES];
+    /** Number of lines of macro expanded source. */
+    long lines;
+    /** Number of instructions. */
+    long instructions;
+    /** Number of words of the code segment. */
+    long code_words;
+    /** Number of words of the data segment. */
+    long data_words;
+    /** Number of symbols defined. */
+    long symbols;
+    /** Number of operands referring to a symbol, resolved by the second
+        pass. */
+    long fixups;
+    /** Number of references to external symbols. */
+    long externals;
+    /** Number of bytes written to output files. */
+    long bytes;
+} stats_t;
+
+/**
+ * Adds the statistics of a file or batch to a total.
+ *
+ * @param total Total.
+ * @param stats Statistics to add.
+ */
+void stats_add(stats_t *total, const stats_t *stats);
+
+/**
+ * Prints statistics for people: the counts, the time of each phase and the
+ * throughput.
+ *
+ * @param fp Stream.
+ * @param prefix Text starting each line.
+ * @param stats Statistics.
+ * @param seconds Time the files took in whole, over which the throughput is
+ *                reckoned.
+ */
+void stats_print(FILE *fp, const char *prefix, const stats_t *stats, double seconds);
+
+/**
+ * Writes statistics as a JSON object, without a trailing newline.
+ *
+ * @param fp Stream.
+ * @param file Name of the file the statistics are about, or null for a
+ *             batch, in which case the number of files is written instead.
+ * @param stats Statistics.
+ * @param seconds Time the files took in whole, as for stats_print.
+ */
+void stats_write_json(FILE *fp, const char *file, const stats_t *stats, double seconds);
+
+#endif
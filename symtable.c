@@ -5,59 +5,201 @@
  */
 
 #include "symtable.h"
-#include "hashtable.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 
 /**
- * Number of slots in hash table. Chosen arbitrarily.
- * Ideally, this should be set to the number of symbols that is expected to be
- * defined on average.
+ * Number of shards the table is split into, each with its own lock. Enough
+ * that threads defining symbols at once seldom pick the same shard.
  */
-#define SYMTABLE_SLOTS 4096
+#define SYMTABLE_SHARDS 64
+
+/**
+ * Number of hash chains in a shard. Chosen arbitrarily.
+ * Ideally, the total number of chains should be set to the number of symbols
+ * that is expected to be defined on average.
+ */
+#define SHARD_SLOTS 64
+
+/**
+ * Part of the symbol table holding the names with some hashes.
+ */
+typedef struct {
+    /** Guards the chains while symbols are defined. */
+    pthread_mutex_t lock;
+    /** Hash chains. */
+    symbol_t *slots[SHARD_SLOTS];
+} shard_t;
 
 struct symtable {
-    /** Backing hash table. */
-    hashtable_t *ht;
+    /** Shards. */
+    shard_t shards[SYMTABLE_SHARDS];
 };
 
+/**
+ * Hashes a symbol name.
+ *
+ * @param key Null terminated name.
+ * @return Hash value.
+ */
+static unsigned hash(const char *key)
+{
+    char c;
+    unsigned hash = 7;
+
+    while ((c = *key++) != '\0')
+        hash = hash * 31 + c;
+
+    return hash;
+}
+
+/**
+ * Finds the chain a name belongs to.
+ *
+ * @param table Symbol table.
+ * @param label Name.
+ * @param shard Set to the shard holding the chain.
+ * @return Pointer to the head of the chain.
+ */
+static symbol_t **find_slot(symtable_t *table, const char *label, shard_t **shard)
+{
+    const unsigned h = hash(label); /* Hash of name. */
+
+    *shard = &table->shards[h % SYMTABLE_SHARDS];
+    return &(*shard)->slots[(h / SYMTABLE_SHARDS) % SHARD_SLOTS];
+}
+
+/**
+ * Finds the link pointing to the symbol found for a name.
+ *
+ * @param slot Head of the chain holding the name.
+ * @param label Name.
+ * @return Link to the symbol, pointing to null if the name is not defined.
+ */
+static symbol_t **find_link(symbol_t **slot, const char *label)
+{
+    while (*slot && strcmp((*slot)->name, label) != 0)
+        slot = &(*slot)->next;
+
+    return slot;
+}
+
 symtable_t *symtable_alloc()
 {
-    symtable_t *table = (symtable_t*)malloc(sizeof(symtable_t));
-    
-    /* Allocate the underlying hash table. */
-    table->ht = hashtable_alloc(SYMTABLE_SLOTS, free);
+    symtable_t *table = (symtable_t*)calloc(1, sizeof(symtable_t));
+    int i; /* Counter. */
+
+    /* Check if out of memory. */
+    if (!table)
+        return 0;
+
+    for (i = 0; i < SYMTABLE_SHARDS; ++i)
+        pthread_mutex_init(&table->shards[i].lock, 0);
 
     return table;
 }
 
 void symtable_free(symtable_t *table)
 {
-    /* Free underlying hash table. */
-    hashtable_free(table->ht);
+    symbol_t *sym, *next_sym; /* Symbol found for a name. */
+    symbol_t *cur, *next; /* Hidden definition. */
+    int i, j; /* Counters. */
+
+    for (i = 0; i < SYMTABLE_SHARDS; ++i) {
+        for (j = 0; j < SHARD_SLOTS; ++j) {
+            for (sym = table->shards[i].slots[j]; sym; sym = next_sym) {
+                /* Free the hidden definitions, then the symbol. */
+                for (cur = sym->shadowed; cur; cur = next) {
+                    next = cur->shadowed;
+                    free(cur);
+                }
+                next_sym = sym->next;
+                free(sym);
+            }
+        }
+        pthread_mutex_destroy(&table->shards[i].lock);
+    }
 
     free(table);
 }
 
-symbol_t *symtable_new(symtable_t *table, const char *label)
+symbol_t *symtable_define(symtable_t *table, const char *label, long order)
 {
     symbol_t *sym = (symbol_t*)calloc(1, sizeof(symbol_t));
-    
-    /* Copy label. */
-    strcpy(sym->name, label);
+    symbol_t **link; /* Link to the symbol found for the name. */
+    symbol_t *found; /* Symbol found for the name. */
+    shard_t *shard; /* Shard holding the name. */
+
+    /* Check if out of memory. */
+    if (!sym)
+        return 0;
 
     /* Don't insert empty symbols. */
     assert(label[0] != 0);
 
-    /* Insert into hash table. */
-    hashtable_insert(table->ht, label, sym);
+    /* Copy label. */
+    strcpy(sym->name, label);
+    sym->order = order;
+    sym->first_order = order;
+
+    link = find_slot(table, label, &shard);
+    pthread_mutex_lock(&shard->lock);
+
+    link = find_link(link, label);
+    if ((found = *link) == 0) {
+        /* First definition, insert at head of chain. */
+        link = find_slot(table, label, &shard);
+        sym->next = *link;
+        *link = sym;
+    } else if (order > found->order) {
+        /* Later definition, takes the found symbol's place. */
+        sym->next = found->next;
+        sym->shadowed = found;
+        sym->first_order = found->first_order;
+        found->next = 0;
+        *link = sym;
+    } else {
+        /* Earlier definition, hidden by the found symbol. */
+        sym->shadowed = found->shadowed;
+        found->shadowed = sym;
+        if (order < found->first_order)
+            found->first_order = order;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
 
     return sym;
 }
 
 symbol_t *symtable_find(symtable_t *table, const char *label)
 {
-    return (symbol_t*)hashtable_find(table->ht, label);
-}
\ No newline at end of file
+    shard_t *shard; /* Shard holding the name. */
+
+    return *find_link(find_slot(table, label, &shard), label);
+}
+
+int symtable_defined_before(symtable_t *table, const char *label, long order)
+{
+    symbol_t *sym = symtable_find(table, label);
+
+    return sym && sym->first_order < order;
+}
+
+long symtable_count(symtable_t *table)
+{
+    symbol_t *sym; /* Symbol found for a name. */
+    long count = 0; /* Return value. */
+    int i, j; /* Counters. */
+
+    for (i = 0; i < SYMTABLE_SHARDS; ++i) {
+        for (j = 0; j < SHARD_SLOTS; ++j) {
+            for (sym = table->shards[i].slots[j]; sym; sym = sym->next)
+                ++count;
+        }
+    }
+
+    return count;
+}
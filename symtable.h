@@ -31,7 +31,7 @@
 /**
  * A symbol in the symbol table.
  */
-typedef struct {
+typedef struct symbol {
     /** Label. */
     char name[MAX_LABEL_LENGTH + 1];
     /** Base address. */
@@ -40,6 +40,16 @@ typedef struct {
     word_t offset;
     /** External flag. */
     int ext;
+    /** Position of the definition in the source. Of several definitions of
+        a name, the one with the highest position is found. */
+    long order;
+    /** Position of the earliest definition of the name. Only maintained in
+        the symbol that is found. */
+    long first_order;
+    /** Next symbol in the hash chain. */
+    struct symbol *next;
+    /** Other definitions of the name, hidden by this one. */
+    struct symbol *shadowed;
 } symbol_t;
 
 typedef struct symtable symtable_t;
@@ -47,7 +57,7 @@ typedef struct symtable symtable_t;
 /**
  * Allocates a symbol table.
  *
- * @return Pointer to the allocated table.
+ * @return Pointer to the allocated table or null if out of memory.
  */
 symtable_t *symtable_alloc();
 
@@ -59,19 +69,27 @@ symtable_t *symtable_alloc();
 void symtable_free(symtable_t *table);
 
 /**
- * Creates a new symbol in the symbol table with the given label if doesn't
- * already exist in the table.
+ * Defines a symbol in the symbol table. A name may be defined more than
+ * once; lookups find the definition at the highest position, whatever the
+ * order the definitions were made in.
+ *
+ * @details May be called by several threads at once. The table is split into
+ *          shards, each guarded by its own lock, so threads defining
+ *          different names rarely wait for each other.
  *
  * @param table The symbol table into which to insert the symbol.
  * @param label Label that will be copied to the symbol's name field.
- * @return If the symbol was not already present in the table, a pointer to
- *         the new symbol, else a null pointer.
+ * @param order Position of the definition in the source.
+ * @return Pointer to the new symbol or null if out of memory.
  */
-symbol_t *symtable_new(symtable_t *table, const char *label);
+symbol_t *symtable_define(symtable_t *table, const char *label, long order);
 
 /**
  * Performs a symbol lookup.
  *
+ * @details Takes no locks, so it may be called by any number of threads at
+ *          once, but not while symbols are being defined.
+ *
  * @param table The symbol table in which to perform the lookup.
  * @param label The name of the symbol to look for.
  * @return If the symbol is found, a pointer to the symbol else a null
@@ -79,4 +97,28 @@ symbol_t *symtable_new(symtable_t *table, const char *label);
  */
 symbol_t *symtable_find(symtable_t *table, const char *label);
 
+/**
+ * Checks if a name was defined before a position in the source. Used to
+ * detect duplicate labels deterministically once definitions made by several
+ * threads are all in.
+ *
+ * @details Has the same restrictions as symtable_find.
+ *
+ * @param table The symbol table in which to perform the lookup.
+ * @param label The name of the symbol to look for.
+ * @param order Position in the source.
+ * @return Non-zero if some definition of the name precedes the position.
+ */
+int symtable_defined_before(symtable_t *table, const char *label, long order);
+
+/**
+ * Counts the names defined in a symbol table.
+ *
+ * @details Has the same restrictions as symtable_find.
+ *
+ * @param table The symbol table.
+ * @return Number of names.
+ */
+long symtable_count(symtable_t *table);
+
 #endif
\ No newline at end of file
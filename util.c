@@ -8,16 +8,44 @@
 
 #include <ctype.h>
 #include <string.h>
+#include <time.h>
 
-int skip_line(FILE *fp)
+char *read_line(const char **head, char *line, int size)
 {
-    int c;
+    const char *src = *head; /* Read position. */
+    char *dst = line; /* Write position. */
 
-    /* Keep reading until end of file or newline. */
-    while ((c = getc(fp)) != EOF && c != '\n')
-        ;
+    /* Check if end of text. */
+    if (*src == '\0')
+        return 0;
+
+    /* Copy characters until the buffer is full or after a newline. */
+    while (--size > 0 && *src != '\0') {
+        if ((*dst++ = *src++) == '\n')
+            break;
+    }
+
+    /* Null terminate line. */
+    *dst = '\0';
+
+    /* Update read position. */
+    *head = src;
 
-    return c == EOF ? EOF : 0;
+    return line;
+}
+
+int skip_line(const char **head)
+{
+    char c;
+
+    /* Keep reading until end of text or newline. */
+    while ((c = **head) != '\0') {
+        ++*head;
+        if (c == '\n')
+            break;
+    }
+
+    return c == '\0' ? EOF : 0;
 }
 
 int is_eol(char c)
@@ -73,6 +101,32 @@ void read_field(char **line, char *field, int *plen)
     field[0] = '\0';
 }
 
+char *next_token(char **head, char delim)
+{
+    char *tok; /* Beginning of token. */
+
+    /* Skip leading delimiters. */
+    while (**head == delim)
+        ++*head;
+
+    /* Check if no tokens remain. */
+    if (**head == '\0')
+        return 0;
+
+    /* Token begins at first non-delimiter character. */
+    tok = *head;
+
+    /* Find end of token. */
+    while (**head != '\0' && **head != delim)
+        ++*head;
+
+    /* Null terminate token and move past the delimiter. */
+    if (**head == delim)
+        *(*head)++ = '\0';
+
+    return tok;
+}
+
 int parse_number(const char *tok, word_t *w)
 {
     char c; /* Current character. */
@@ -115,3 +169,43 @@ int parse_number(const char *tok, word_t *w)
 
     return 0;
 }
+
+double monotonic_seconds()
+{
+    struct timespec ts; /* Clock reading. */
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+unsigned long fnv1a(unsigned long hash, const char *buf, size_t len)
+{
+    while (len-- > 0) {
+        hash ^= (unsigned char)*buf++;
+        hash = (hash * 16777619UL) & 0xffffffffUL;
+    }
+
+    return hash;
+}
+
+void hash_stamp(const char *buf, size_t len, char *stamp)
+{
+    sprintf(stamp, "%08lx%08lx", fnv1a(3735928559UL, buf, len), fnv1a(FNV1A_BASIS, buf, len));
+}
+
+void json_write_string(FILE *fp, const char *str)
+{
+    unsigned char c; /* Current character. */
+
+    putc('"', fp);
+    while ((c = (unsigned char)*str++) != '\0') {
+        if (c == '"' || c == '\\')
+            fprintf(fp, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(fp, "\\u%04x", c);
+        else
+            putc(c, fp);
+    }
+    putc('"', fp);
+}
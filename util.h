@@ -9,7 +9,7 @@
 
 #include "instset.h"
 
-#include <stdio.h> /* for FILE */
+#include <stdio.h> /* for EOF */
 
 /**
  * Checks whether a character terminates a line buffer i.e., if it is a newline
@@ -48,11 +48,86 @@ void read_field(char **line, char *field, int *plen);
 int parse_number(const char *tok, word_t *w);
 
 /**
- * Reads remainder of line until newline character or end of file.
+ * Splits the next token off a string, skipping leading delimiters.
  *
- * @param fp File pointer.
- * @return Zero on success, EOF if end of file reached.
+ * @details This is a reentrant replacement for strtok: the scan position is
+ *          kept in the caller supplied pointer instead of in hidden static
+ *          state, so independent tokenizations may run concurrently.
+ * @param head Pointer to the scan position. Must initially point to the
+ *             string to tokenize and will be advanced past the token.
+ * @param delim Delimiter character.
+ * @return Pointer to the null terminated token or null if no tokens remain.
+ * @note The delimiter following the token is overwritten with a null
+ *       terminator.
  */
-int skip_line(FILE *fp);
+char *next_token(char **head, char delim);
+
+/**
+ * Reads the next line from a text buffer in the manner of fgets.
+ *
+ * @param head Pointer to the read position in a null terminated buffer. Will
+ *             be advanced past the characters read.
+ * @param line Buffer that will receive the null terminated line including its
+ *             newline character, if it fits.
+ * @param size Size of the line buffer. At most size - 1 characters are read.
+ * @return The line buffer or a null pointer if the end of the text was reached
+ *         before any character was read.
+ */
+char *read_line(const char **head, char *line, int size);
+
+/**
+ * Reads remainder of line until newline character or end of text.
+ *
+ * @param head Pointer to the read position in a null terminated buffer. Will
+ *             be advanced past the newline character.
+ * @return Zero on success, EOF if end of text reached.
+ */
+int skip_line(const char **head);
+
+/**
+ * Reads a monotonic clock, for measuring durations.
+ *
+ * @return Seconds elapsed since an arbitrary point in the past.
+ */
+double monotonic_seconds();
+
+/**
+ * Offset basis of the 32 bit FNV-1a hash.
+ */
+#define FNV1A_BASIS 2166136261UL
+
+/**
+ * Feeds bytes to a 32 bit FNV-1a hash.
+ *
+ * @param hash Hash so far, FNV1A_BASIS to start a new one.
+ * @param buf Bytes.
+ * @param len Number of bytes.
+ * @return Updated hash.
+ */
+unsigned long fnv1a(unsigned long hash, const char *buf, size_t len);
+
+/**
+ * Length of a hash stamp, not counting the null terminator.
+ */
+#define HASH_STAMP_LENGTH 16
+
+/**
+ * Formats a 64 bit hash of bytes, made of two FNV-1a lanes, which tells
+ * contents apart.
+ *
+ * @param buf Bytes.
+ * @param len Number of bytes.
+ * @param stamp Buffer of HASH_STAMP_LENGTH + 1 characters receiving the
+ *              hash as hex digits.
+ */
+void hash_stamp(const char *buf, size_t len, char *stamp);
+
+/**
+ * Writes a string as a JSON string literal, quoted and escaped.
+ *
+ * @param fp Stream.
+ * @param str Null terminated string.
+ */
+void json_write_string(FILE *fp, const char *str);
 
 #endif
\ No newline at end of file
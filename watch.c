@@ -0,0 +1,308 @@
+/**
+ * @file watch.c
+ * @author Tamir Attias
+ * @brief Watch mode implementation.
+ */
+
+#include "watch.h"
+#include "job.h"
+#include "shared.h"
+#include "util.h"
+#include "dynstr.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+
+/**
+ * Events signalling that a file in a watched directory has new contents.
+ */
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE)
+
+/**
+ * A file whose changes make a watched file be reassembled.
+ */
+typedef struct {
+    /** Watch descriptor of the directory holding the file. */
+    int wd;
+    /** Name of the file in its directory. */
+    char name[FILENAME_MAX];
+    /** Index of the watched file to reassemble. */
+    int index;
+} dependency_t;
+
+/**
+ * State of watch mode.
+ */
+typedef struct {
+    /** Basenames of the watched files. */
+    char (*basenames)[MANIFEST_NAME_SIZE];
+    /** Non-zero for each watched file that must be reassembled. */
+    int *dirty;
+    /** Number of watched files. */
+    int count;
+    /** Files watched for changes. */
+    dependency_t *deps;
+    /** Number of dependencies. */
+    int dep_count;
+    /** inotify instance. */
+    int fd;
+    /** Shared assembly state kept between reassemblies, or null. */
+    struct shared *shared;
+} watch_t;
+
+/**
+ * Reads all basenames of a manifest into the watch state.
+ *
+ * @param watch Watch state.
+ * @param basenames Manifest.
+ * @return Zero on success, non-zero if out of memory.
+ */
+static int read_basenames(watch_t *watch, manifest_t *basenames)
+{
+    char (*grown)[MANIFEST_NAME_SIZE]; /* Grown basename array. */
+    int capacity = 0; /* Number of basenames that fit in the array. */
+
+    for (;;) {
+        /* Make room for one more. */
+        if (watch->count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            grown = realloc(watch->basenames, capacity * sizeof(*grown));
+            if (!grown)
+                return 1;
+            watch->basenames = grown;
+        }
+
+        if (!manifest_next(basenames, watch->basenames[watch->count]))
+            break;
+        ++watch->count;
+    }
+
+    /* Everything starts out dirty, to be assembled once. */
+    if ((watch->dirty = (int*)malloc((watch->count + 1) * sizeof(int))) == 0)
+        return 1;
+    for (capacity = 0; capacity < watch->count; ++capacity)
+        watch->dirty[capacity] = 1;
+
+    return 0;
+}
+
+/**
+ * Watches a file for changes, by watching its directory.
+ *
+ * @param watch Watch state.
+ * @param path Path of the file.
+ * @param index Index of the watched file to reassemble when it changes.
+ * @return Zero on success, non-zero on failure, which is reported.
+ */
+static int add_dependency(watch_t *watch, const char *path, int index)
+{
+    char dir[FILENAME_MAX]; /* Directory of the file. */
+    const char *slash = strrchr(path, '/'); /* Last separator in path. */
+    dependency_t *dep; /* New dependency. */
+    int i; /* Counter. */
+
+    /* Split the path; a file without a directory is in the current one. */
+    if (!slash) {
+        strcpy(dir, ".");
+    } else if (slash == path) {
+        strcpy(dir, "/");
+    } else {
+        memcpy(dir, path, slash - path);
+        dir[slash - path] = '\0';
+    }
+
+    dep = (dependency_t*)realloc(watch->deps, (watch->dep_count + 1) * sizeof(dependency_t));
+    if (!dep) {
+        printf("error: out of memory.\n");
+        return 1;
+    }
+    watch->deps = dep;
+    dep += watch->dep_count;
+
+    /* A directory is only watched once; adding it again returns the same
+       descriptor. */
+    if ((dep->wd = inotify_add_watch(watch->fd, dir, WATCH_EVENTS)) < 0) {
+        printf("error: could not watch %s: %s.\n", dir, strerror(errno));
+        return 1;
+    }
+    strcpy(dep->name, slash ? slash + 1 : path);
+    dep->index = index;
+
+    /* Keep it unless the file already had it. */
+    for (i = 0; i < watch->dep_count; ++i) {
+        if (watch->deps[i].wd == dep->wd && watch->deps[i].index == index &&
+            strcmp(watch->deps[i].name, dep->name) == 0)
+            return 0;
+    }
+    ++watch->dep_count;
+
+    return 0;
+}
+
+/**
+ * Watches the files a watched file included when it was assembled, so that
+ * changing them reassembles it too.
+ *
+ * @param watch Watch state.
+ * @param index Index of the watched file.
+ * @param deps Stamp and path of each included file, one per line.
+ */
+static void add_includes(watch_t *watch, int index, const dynstr_t *deps)
+{
+    const char *head, *end, *newline; /* Read position, end and end of line. */
+    char path[FILENAME_MAX]; /* Path of included file. */
+    size_t len; /* Length of path. */
+
+    /* Each line holds the stamp and path of a file. */
+    head = dynstr_pointer(deps);
+    end = head + dynstr_size(deps);
+    for (; head < end && (newline = memchr(head, '\n', end - head)) != 0; head = newline + 1) {
+        len = newline - head - HASH_STAMP_LENGTH - 1;
+        if (newline - head <= HASH_STAMP_LENGTH + 1 || len >= FILENAME_MAX)
+            continue;
+        memcpy(path, head + HASH_STAMP_LENGTH + 1, len);
+        path[len] = '\0';
+        add_dependency(watch, path, index);
+    }
+}
+
+/**
+ * Assembles a watched file and reports the outcome.
+ *
+ * @param watch Watch state.
+ * @param index Index of the watched file.
+ * @param options Options.
+ */
+static void assemble_watched(watch_t *watch, int index, const job_options_t *options)
+{
+    const char *basename = watch->basenames[index]; /* Basename of file. */
+    job_t *job; /* Job for the file. */
+    double started = monotonic_seconds(); /* Time assembly started. */
+    int error; /* Result of assembly. */
+
+    if ((job = job_alloc(basename, options)) == 0) {
+        printf("error: out of memory assembling %s.\n", basename);
+        return;
+    }
+
+    /* Keep the shared state warm between files. */
+    job->shared = watch->shared;
+    error = job_run(job);
+
+    /* Its includes may have changed. A build cache hit leaves them as they
+       were. */
+    if (job->shared && !job->hit)
+        add_includes(watch, index, job->shared->deps);
+
+    watch->shared = job->shared;
+    job->shared = 0;
+    job_free(job);
+
+    printf("watch: %s %s in %.1f ms.\n", basename, error ? "failed" : "assembled",
+           (monotonic_seconds() - started) * 1000);
+    fflush(stdout);
+}
+
+/**
+ * Reads pending inotify events and marks the files they concern dirty.
+ *
+ * @param watch Watch state.
+ * @return Zero on success, non-zero if reading failed.
+ */
+static int read_events(watch_t *watch)
+{
+    union {
+        struct inotify_event event; /* Aligns the buffer. */
+        char bytes[4096]; /* Events. */
+    } buf;
+    const struct inotify_event *ev; /* Current event. */
+    ssize_t len; /* Length of events read. */
+    ssize_t pos; /* Position of current event. */
+    int i; /* Counter. */
+
+    if ((len = read(watch->fd, buf.bytes, sizeof(buf.bytes))) <= 0)
+        return errno != EINTR;
+
+    for (pos = 0; pos < len; pos += sizeof(struct inotify_event) + ev->len) {
+        ev = (const struct inotify_event*)(buf.bytes + pos);
+        if (ev->len == 0)
+            continue;
+        for (i = 0; i < watch->dep_count; ++i) {
+            if (watch->deps[i].wd == ev->wd && strcmp(watch->deps[i].name, ev->name) == 0)
+                watch->dirty[watch->deps[i].index] = 1;
+        }
+    }
+
+    return 0;
+}
+
+int watch_run(manifest_t *basenames, const job_options_t *options)
+{
+    watch_t watch; /* Watch state. */
+    char path[FILENAME_MAX]; /* Path of a source file. */
+    struct pollfd pfd; /* inotify instance, to wait for more events. */
+    int i; /* Counter. */
+
+    memset(&watch, 0, sizeof(watch));
+    if ((watch.fd = inotify_init()) < 0) {
+        printf("error: could not start watching: %s.\n", strerror(errno));
+        return 1;
+    }
+    if (read_basenames(&watch, basenames) != 0) {
+        printf("error: out of memory.\n");
+        goto done;
+    }
+
+    /* Watch the source of each file. The files they include are added as
+       they are assembled. */
+    for (i = 0; i < watch.count; ++i) {
+        if (strlen(watch.basenames[i]) + 4 >= FILENAME_MAX)
+            continue; /* Too long, reported when assembling. */
+        strcpy(path, watch.basenames[i]);
+        strcat(path, ".as");
+        if (add_dependency(&watch, path, i) != 0)
+            goto done;
+    }
+
+    printf("watch: watching %d files.\n", watch.count);
+    fflush(stdout);
+
+    pfd.fd = watch.fd;
+    pfd.events = POLLIN;
+
+    for (;;) {
+        /* Reassemble the changed files, in the order given. */
+        for (i = 0; i < watch.count; ++i) {
+            if (watch.dirty[i]) {
+                watch.dirty[i] = 0;
+                assemble_watched(&watch, i, options);
+            }
+        }
+
+        /* Wait for a change, then for the burst of changes to settle. */
+        if (read_events(&watch) != 0)
+            break;
+        while (poll(&pfd, 1, WATCH_SETTLE_MS) > 0) {
+            if (read_events(&watch) != 0)
+                goto failed;
+        }
+    }
+
+failed:
+    printf("error: could not read changes: %s.\n", strerror(errno));
+
+done:
+    if (watch.shared)
+        shared_free(watch.shared);
+    free(watch.deps);
+    free(watch.dirty);
+    free(watch.basenames);
+    close(watch.fd);
+
+    return 1;
+}
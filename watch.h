@@ -0,0 +1,37 @@
+/**
+ * @file watch.h
+ * @author Tamir Attias
+ * @brief Watch mode declarations.
+ * @details In watch mode the assembler assembles its files once and then
+ *          waits for their sources to change, reassembling only the files
+ *          that changed. Changes are detected with inotify, by watching the
+ *          directories holding the sources, so that editors replacing a file
+ *          instead of writing it in place are noticed too.
+ */
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "manifest.h"
+
+/* Forward declarations. */
+struct job_options;
+
+/**
+ * Time to wait for more changes once a change was noticed, in milliseconds,
+ * so that a burst of writes (such as an editor saving several files) leads
+ * to one reassembly of each file.
+ */
+#define WATCH_SETTLE_MS 20
+
+/**
+ * Assembles files and reassembles each one whenever its source changes.
+ * Reports the outcome of every file as it finishes. Only returns on failure.
+ *
+ * @param basenames Basenames of the files to watch.
+ * @param options Options applying to every file.
+ * @return Non-zero.
+ */
+int watch_run(manifest_t *basenames, const struct job_options *options);
+
+#endif